@@ -15,6 +15,10 @@
  * 
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE  // splice(), copy_file_range() and CPU affinity
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,13 +27,68 @@
 #include <stdbool.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <float.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
 
 // Constants for data structures
 #define MAX_HISTORY 100          // Maximum number of history entries
 #define MAX_UNITS 200           // Maximum number of supported units
 #define MAX_CATEGORIES 20       // Maximum number of unit categories
 #define MAX_ALIASES 10          // Maximum number of aliases per unit
+#define MAX_DEFINITION_ALIASES 4 // Aliases of a relative unit definition
 #define HISTORY_FILE "conversion_history.txt" // History file name
+#define HISTORY_BLOB_SLACK 65536 // Dead blob bytes tolerated before compaction
+#define HISTORY_RECORD_SIZE 128 // Bytes per history record, newline included
+#define HISTORY_COMPACT_RECORDS (2 * MAX_HISTORY) // File size that triggers compaction
+#define MAX_STRESS_WRITERS 256  // Processes forked by --history-stress
+#define BATCH_CHUNK 4096        // Values converted per kernel call in batch mode
+#define ARENA_BLOCK_SIZE 65536  // First block of a scratch arena
+#define SINK_MAX_IOV 1024       // Output fragments gathered per writev()
+#define STREAM_BUFFER_SIZE (1 << 20) // Input read per step in CSV mode
+#define STREAM_DEADLINE 0.001   // Seconds a complete line may wait for its batch
+#define STREAM_THROUGHPUT_DEADLINE 0.1 // Same, with --throughput
+#define MAX_REPLAY_THREADS 64   // Upper bound for --threads in replay mode
+#define MAX_REPLAY_PAIRS 4096   // Distinct unit pairs tracked by replay
+#define REPLAY_MIN_RANGE 32768  // Smallest file range worth a replay thread
+#define MAX_PIN_CPUS 1024       // CPUs considered by --pin
+#define MAX_NUMA_NODES 64       // NUMA nodes read from sysfs
+#define PERF_COUNTER_COUNT 5    // Hardware events sampled by --bench
+#define TRACE_BUFFER_EVENTS 65536 // Trace events kept per thread
+#define METRICS_BUCKETS 12      // Latency histogram buckets (256 ns * 4^i)
+#define MAX_HOT_PAIRS 64        // Pairs accepted by --emit-hot-pairs
+#define MAX_EXPR_CODE 256       // Instructions of a compiled expression program
+#define MAX_EXPR_REGISTERS 32   // Column registers of an expression program
+#define MAX_DERIVED_COLUMNS 8   // --derive expressions per run
+#define MAX_WINDOW_KEY 64       // Bytes of a --group-column key kept
+#define MAX_CONTAINER_COLUMNS 64 // Columns of a unit-tagged container
+#define CONTAINER_BLOCK_ROWS 65536 // Rows per container block
+#define CONTAINER_CACHE_BLOCKS MAX_CONTAINER_COLUMNS // Converted blocks kept per open container
+#define CONTAINER_MAGIC "UCONTv1\n" // First 8 bytes of a container file
+#define CONTAINER_BYTE_ORDER 0x01020304u // Written native; a reader with another byte order sees it swapped
 
 // Data structures for units and conversions
 typedef struct {
@@ -40,17 +99,497 @@ typedef struct {
     bool is_temp;
     char aliases[MAX_ALIASES][16];
     int alias_count;
-    char description[256];
+    const char *description;  // Cold data: stays in read-only storage until shown
 } Unit;
 
+// A unit defined relative to other units (see unit_definitions[])
+typedef struct {
+    const char *name;
+    const char *symbol;
+    const char *expression;     // e.g. "220 yd" or "1/4 qt"
+    const char *aliases[MAX_DEFINITION_ALIASES];
+    const char *description;
+} UnitDefinition;
+
 typedef struct {
     char from[16];
     char to[16];
-    double value;
+    double value;           // First value of a batch record
     double result;
     time_t timestamp;
+    long count;             // Values in the record; > 1 for a batch record
+    long long blob_offset;  // Where a batch's pairs start in the history blob
 } ConversionEntry;
 
+// Counters of --history-stress, in memory shared across fork()
+typedef struct {
+    _Atomic uint64_t appended;      // Records appended
+    _Atomic uint64_t dropped;       // Records dropped by compactions
+    _Atomic uint64_t compactions;
+} HistoryStress;
+
+// Precomputed conversion between two units: result = value * scale + offset
+// Resolved once per unit pair so batch kernels never look units up per value
+typedef struct {
+    double scale;
+    double offset;
+    int from_index;
+    int to_index;
+    int hot_pair;               // Specialized kernel in hot_pairs.h, or 0
+} ConversionPlan;
+
+// A unit pair with a generated kernel, as written by --emit-hot-pairs
+typedef struct {
+    const char *from;
+    const char *to;
+    double scale;
+    double offset;
+} HotPair;
+
+// Single-precision copy of a plan, rounded once from the double factors
+typedef struct {
+    float scale;
+    float offset;
+} ConversionPlanF32;
+
+// How the integer storage path rounds a non-integral result
+typedef enum {
+    ROUND_EXACT,    // Keep the exact fraction (printed as a terminating decimal)
+    ROUND_DOWN,
+    ROUND_UP,
+    ROUND_NEAREST   // Ties to even
+} RoundingMode;
+
+// Exact integer conversion between units with integral factors
+// result = value * numerator / denominator, reduced by their gcd
+typedef struct {
+    uint64_t numerator;
+    uint64_t denominator;
+    int shift;          // Left shift (> 0) or right shift (< 0) for power-of-two ratios
+    bool power_of_two;
+    uint64_t magic;     // Reciprocal of the denominator for the batch division
+    int magic_shift;
+} IntegerPlan;
+
+// Exact decimal number: mantissa * 10^-scale
+typedef struct {
+    __int128 mantissa;
+    int scale;
+} Decimal;
+
+// Exact decimal ratio between two units: result = value * multiplier * 10^-scale
+// Only exact when the factor ratio has a terminating decimal expansion
+typedef struct {
+    __int128 multiplier;
+    int scale;
+    bool exact;
+} DecimalPlan;
+
+// Display units of one category for auto-scaling, sorted by factor
+// by_exponent maps a binary exponent to the largest unit not above it, so
+// picking a unit needs no log10
+#define MAX_SCALE_UNITS 16
+typedef struct {
+    bool built;
+    int count;
+    double thresholds[MAX_SCALE_UNITS + 1];  // Factors, NaN sentinel
+    char symbols[MAX_SCALE_UNITS][12];
+    uint8_t by_exponent[256];                // Exponent + 128 -> unit index
+} ScaleTable;
+
+// Aho-Corasick automaton over every unit symbol and alias, for annotate mode
+// Bytes are mapped to classes so the dense transition table stays small
+typedef struct {
+    bool built;
+    int state_count;
+    int class_count;
+    uint8_t byte_class[256];    // Class 0: byte appears in no pattern
+    int16_t *next;              // [state * class_count + class], failures folded in
+    uint8_t *depth;             // Length of the path from the root
+    int16_t *unit;              // Unit whose name ends in this state, or -1
+} UnitMatcher;
+
+// Measurement systems annotate mode converts into
+typedef enum {
+    SYSTEM_SI,
+    SYSTEM_IMPERIAL
+} UnitSystem;
+
+// Settings for a command line annotate run
+typedef struct {
+    UnitSystem system;
+    bool replace;               // Replace quantities instead of appending
+    const UnitMatcher *matcher;
+} AnnotateOptions;
+
+// Separators of locale-formatted numbers ("1,234.5", "1.234,5", "1 234,5")
+typedef struct {
+    char decimal_sep;           // '.' by default
+    char group_sep;             // '\0' = no grouping
+} NumberFormat;
+
+// Operations of the expression bytecode; each runs over a whole column
+typedef enum {
+    EXPR_CONST,                 // Must stay 0
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_LT,
+    EXPR_LE,
+    EXPR_GT,
+    EXPR_GE,
+    EXPR_EQ,
+    EXPR_NE,
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_NOT,
+    EXPR_NEG,
+    EXPR_ABS,
+    EXPR_ROUND,
+    EXPR_MIN,
+    EXPR_MAX,
+    EXPR_AFFINE                 // dst = a * constant + offset, for convert()
+} ExprOpcode;
+
+// One instruction: dst = a op b, or a op constant when `immediate`
+typedef struct {
+    uint8_t opcode;
+    uint8_t dst;
+    uint8_t a;
+    uint8_t b;
+    bool immediate;
+    double constant;
+    double offset;
+} ExprInstruction;
+
+// --where and --derive expressions compiled into one register program
+// Temporaries are numbered from 0 up; input fields are bound to
+// registers from MAX_EXPR_REGISTERS - 1 down
+typedef struct {
+    ExprInstruction code[MAX_EXPR_CODE];
+    int code_length;
+    int register_count;         // Temporaries used by the program
+    int temp_base;              // First temporary the next expression may use
+    int field_columns[MAX_EXPR_REGISTERS]; // 1-based field of register MAX - 1 - k
+    int field_count;
+    int converted_column;       // Field read by `value`
+    int where_register;         // -1 without --where
+    int derive_registers[MAX_DERIVED_COLUMNS];
+    int derive_count;
+} ExprProgram;
+
+// Operand during compilation: a register or a folded constant
+typedef struct {
+    bool constant;
+    double value;
+    int reg;
+} ExprOperand;
+
+// Recursive-descent compiler state
+typedef struct {
+    const char *source;
+    const char *p;
+    ExprProgram *program;
+    int top;                    // Next free temporary
+    int base;                   // Temporaries below belong to earlier expressions
+    const char *error;          // First error, or NULL
+    const char *error_at;
+} ExprParser;
+
+// One sample of a window: its key (timestamp or sequence number) and
+// converted value
+typedef struct {
+    double key;
+    double value;
+} WindowSample;
+
+// Ring buffer of samples with a power-of-two capacity
+typedef struct {
+    WindowSample *samples;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} SampleDeque;
+
+// Open window of one group
+typedef struct {
+    char key[MAX_WINDOW_KEY];
+    uint64_t hash;
+    SampleDeque samples;        // Every sample in the window, oldest first
+    SampleDeque minima;         // Increasing values; the front is the minimum
+    SampleDeque maxima;         // Decreasing values; the front is the maximum
+    double sum;                 // Neumaier sum of the samples
+    double compensation;
+    double next_end;            // End of the next window to close
+    double sequence;            // Samples seen, the key of count windows
+    double last_key;
+    bool started;
+    bool pending;               // Samples added since the last emitted window
+} WindowGroup;
+
+// Windowed aggregation state of a stream, kept across blocks
+// Windows are [end - size, end) with ends at multiples of `slide`;
+// slide == size gives tumbling windows
+typedef struct {
+    double size;
+    double slide;
+    bool by_time;               // Keys are timestamps, not sequence numbers
+    int time_column;            // 1-based, 0 for count windows
+    int group_column;           // 1-based, 0 for a single group
+    WindowGroup *groups;        // In order of first appearance
+    size_t group_count;
+    int *slots;                 // Hash table of group indices, -1 = empty
+    size_t slot_count;
+    long late;                  // Out-of-order samples dropped
+} WindowState;
+
+// Header of a unit-tagged container file, followed by one ContainerColumn
+// per column and the data blocks; every field is native-endian
+// Block b holds rows [b * block_rows, ...) stored column after column,
+// so one column of one block is a contiguous array of doubles
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t column_count;
+    uint32_t block_rows;
+    uint32_t reserved;
+    uint64_t row_count;
+} ContainerHeader;
+
+// Column descriptor: values are stored in `unit`, a catalogue symbol
+typedef struct {
+    char name[32];
+    char unit[16];
+    char category[32];
+} ContainerColumn;
+
+// One converted block in the reader cache
+typedef struct {
+    double *values;             // NULL for an unused slot
+    int column;
+    int to_index;
+    size_t block;
+    uint64_t last_used;
+} ContainerCacheEntry;
+
+// An open container: the mapped file and its cache of converted blocks
+typedef struct {
+    const char *map;
+    size_t map_size;
+    ContainerHeader header;
+    const ContainerColumn *columns;
+    int unit_index[MAX_CONTAINER_COLUMNS];  // Catalogue unit of each column
+    size_t block_count;
+    ContainerCacheEntry cache[CONTAINER_CACHE_BLOCKS];
+    uint64_t clock;             // Last-use counter for LRU eviction
+} Container;
+
+// Settings for a command line batch run
+typedef struct {
+    ConversionPlan plan;
+    IntegerPlan integer_plan;
+    bool has_integer_plan;      // Integer inputs can take the exact path
+    bool use_f32;
+    bool binary;
+    RoundingMode rounding;
+    const ScaleTable *scale_table;  // Set when the target is "auto"
+    bool decimal;                   // Exact fixed-point mode
+    DecimalPlan decimal_plan;
+    int column;                     // CSV mode: 1-based field to convert, 0 = off
+    char delimiter;
+    NumberFormat number_format;     // Separators of the input numbers
+    const ExprProgram *expressions; // CSV mode: --where/--derive, or NULL
+    WindowState *window;            // CSV mode: --window aggregation, or NULL
+} BatchOptions;
+
+// Bump allocator for scratch memory with reset-per-batch semantics
+// Blocks are chained when a batch outgrows the arena; a reset merges them
+// into one block, so steady-state batches do not touch the heap
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    void *last;         // Most recent allocation, can grow in place
+} Arena;
+
+// Gathers output as a list of spans and writes them with writev()
+// Untouched input is referenced in place instead of being copied
+typedef struct {
+    int fd;
+#ifndef _WIN32
+    struct iovec iov[SINK_MAX_IOV];
+#else
+    struct { void *iov_base; size_t iov_len; } iov[SINK_MAX_IOV];
+#endif
+    int count;
+    bool failed;            // A flush from sink_add() failed; reported by the next sink_flush()
+} OutputSink;
+
+// Converts the complete lines [data, data+length) of a stream into a sink
+typedef void (*SegmentFn)(const void *context, const char *data, size_t length,
+                          Arena *arena, OutputSink *sink);
+
+// How stream modes batch their input (--latency, --throughput, --deadline)
+typedef struct {
+    double deadline;        // Seconds the first line of a batch may wait
+    bool wait_for_input;    // Keep waiting for input until the deadline
+    size_t batch_size;      // Buffer bytes, the largest batch
+    bool stats;             // --stats: print batch sizes at the end
+} StreamBatching;
+
+// Follow mode (--follow FILE): the stream modes read a growing file
+typedef struct {
+    const char *path;       // NULL when reading stdin
+    const char *state_path; // Saved offset, FILE.offset unless --state
+} FollowOptions;
+
+// Why a stream batch was converted
+typedef enum {
+    FLUSH_FULL,             // The buffer filled up
+    FLUSH_BLOCKED,          // No more input was immediately available
+    FLUSH_DEADLINE,         // The first line waited for the deadline
+    FLUSH_END,              // End of input
+    FLUSH_REASONS
+} FlushReason;
+
+// Achieved batch sizes of one stream run, for --stats
+typedef struct {
+    uint64_t batches;
+    uint64_t bytes;
+    uint64_t lines;
+    size_t min_bytes, max_bytes, max_lines;
+    double max_held;        // Longest time a line waited for its batch
+    uint64_t reasons[FLUSH_REASONS];
+} StreamStats;
+
+// Growable text buffer in an arena, used to assemble output
+typedef struct {
+    Arena *arena;
+    char *data;
+    size_t length;
+    size_t capacity;
+} ArenaText;
+
+// One history record being replayed against the current catalogue
+typedef struct {
+    double value;
+    double result;
+    long line;
+    int pair;           // Index into the replay pair table, -1 if unresolved
+} ReplayEntry;
+
+// Aggregate deviation statistics of one unit pair
+typedef struct {
+    long count;
+    long deviating;
+    double max_error;   // Largest relative error
+    double sum_error;   // For the mean relative error
+} ReplayStats;
+
+// How --pin places worker threads on CPUs
+typedef enum {
+    PIN_NONE,           // Leave placement to the scheduler
+    PIN_AUTO,           // Scatter on multi-node machines, compact otherwise
+    PIN_COMPACT,        // Fill one node before the next
+    PIN_SCATTER,        // Round-robin across nodes
+    PIN_LIST            // CPUs given on the command line
+} PinPolicy;
+
+// CPUs this process may run on, grouped by NUMA node
+typedef struct {
+    int cpus[MAX_PIN_CPUS];
+    int cpu_count;
+    int node_start[MAX_NUMA_NODES + 1];  // Node n owns cpus[node_start[n] .. node_start[n+1])
+    int node_ids[MAX_NUMA_NODES];        // sysfs node numbers
+    int node_count;
+} CpuTopology;
+
+// Thread placement selected with --pin
+typedef struct {
+    PinPolicy policy;
+    int list[MAX_PIN_CPUS];             // CPUs of PIN_LIST
+    int list_count;
+    CpuTopology topology;
+} PinOptions;
+
+// Hardware performance counters of the calling thread (perf_event_open)
+// fds[i] is -1 for events the machine or kernel does not provide
+typedef struct {
+    int fds[PERF_COUNTER_COUNT];
+    uint64_t values[PERF_COUNTER_COUNT];
+    bool available;
+} PerfCounters;
+
+// Timed pipeline stages, shared by the tracer and the metrics histograms
+typedef enum {
+    STAGE_FIND_UNIT,
+    STAGE_PARSE_VALUE_WITH_PREFIX,
+    STAGE_CONVERT_VALUE,
+    STAGE_CONVERT,
+    STAGE_FORMAT_NUMBER,
+    STAGE_SAVE_HISTORY,
+    STAGE_BATCH_READ_PARSE,
+    STAGE_BATCH_CONVERT_FORMAT,
+    STAGE_STREAM_READ,
+    STAGE_CSV_PARSE,
+    STAGE_CSV_CONVERT,
+    STAGE_CSV_EVALUATE,
+    STAGE_CSV_FORMAT,
+    STAGE_WINDOW_AGGREGATE,
+    STAGE_STREAM_WRITE,
+    STAGE_ANNOTATE_SCAN,
+    STAGE_REPLAY_PARSE,
+    STAGE_REPLAY_WORKER,
+    STAGE_COUNT
+} Stage;
+
+// One completed span of the pipeline trace (Chrome "X" event)
+typedef struct {
+    Stage stage;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} TraceEvent;
+
+// Per-thread trace buffer; only its own thread writes to it, and buffers
+// are published on a lock-free list so the exit handler can find them
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int thread_id;
+    size_t count;
+    size_t dropped;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+// Plain counters of the metrics surface
+typedef enum {
+    METRIC_LOOKUP_MISSES,
+    METRIC_INVALID_UNIT_ERRORS,
+    METRIC_SCALE_CACHE_HITS,
+    METRIC_SCALE_CACHE_MISSES,
+    METRIC_REPLAY_PAIR_HITS,
+    METRIC_REPLAY_PAIR_MISSES,
+    METRIC_BLOCK_CACHE_HITS,
+    METRIC_BLOCK_CACHE_MISSES,
+    METRIC_COUNT
+} Metric;
+
+// Per-thread metrics shard; only its own thread updates it, so updates are
+// plain relaxed stores and a scrape only reads
+typedef struct MetricsShard {
+    struct MetricsShard *next;
+    int pair_units;                       // Side of the pair_conversions matrix
+    _Atomic uint64_t *pair_conversions;   // [from * pair_units + to]
+    _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t stage_buckets[STAGE_COUNT][METRICS_BUCKETS + 1];
+    _Atomic uint64_t stage_sum_ns[STAGE_COUNT];
+} MetricsShard;
+
 // Add unit prefix handling
 typedef struct {
     char prefix;
@@ -76,19 +615,31 @@ const UnitPrefix prefixes[] = {
 // Global variables
 Unit units[MAX_UNITS];
 int unit_count = 0;
+ScaleTable scale_tables[MAX_CATEGORIES];
+UnitMatcher unit_matcher;
 ConversionEntry history[MAX_HISTORY];
 int history_count = 0;
+bool history_loaded = false;  // History file is parsed on first use
+HistoryStress *history_stress;  // Set only by --history-stress
+const char *history_path = HISTORY_FILE;
+PinOptions pin_options;              // --pin; PIN_NONE unless given
+StreamBatching stream_batching = { STREAM_DEADLINE, false, STREAM_BUFFER_SIZE, false };
+FollowOptions follow_options;
 char categories[MAX_CATEGORIES][32];
 int category_count = 0;
 
 // Function prototypes
 void initialize_units();
+static void add_unit_definitions();
 void show_main_menu();
 void handle_conversion(const char *category);
 void show_category_menu(const char *category);
 double convert_value(double value, const char *from, const char *to);
 double convert_temperature(double value, const char *from, const char *to);
 void add_history_entry(const char *from, const char *to, double val, double res);
+void add_history_batch(const char *from, const char *to, const double *values,
+                       const double *results, size_t count);
+bool history_blob_read(const ConversionEntry *entry, double *values, double *results);
 void show_history();
 void clear_screen();
 void print_header(const char *title);
@@ -99,16 +650,106 @@ void print_error(const char *message);
 void print_success(const char *message);
 void save_history();
 void load_history();
+void ensure_history_loaded();
+const char *unit_description(const Unit *unit);
 void batch_conversion();
 void show_unit_info(const char *unit);
 void show_help();
 void format_number(double num, char *buffer, size_t size);
-void export_history_to_csv();
+void export_history_to_csv(bool expand_batches);
+int find_unit(const char *unit);
+bool plan_conversion(const char *from, const char *to, ConversionPlan *plan);
+ConversionPlanF32 plan_to_f32(const ConversionPlan *plan);
+void convert_batch(const ConversionPlan *plan, const double *in, double *out, size_t n);
+void convert_batch_f32(const ConversionPlanF32 *plan, const float *in, float *out, size_t n);
+bool plan_integer(const ConversionPlan *plan, IntegerPlan *iplan);
+void convert_integer(const IntegerPlan *iplan, uint64_t value,
+                     unsigned __int128 *quotient, uint64_t *remainder);
+void convert_integer_batch(const IntegerPlan *iplan, const uint64_t *in,
+                           unsigned __int128 *quotient, uint64_t *remainder, size_t n);
+void format_integer_result(const IntegerPlan *iplan, unsigned __int128 quotient,
+                           uint64_t remainder, RoundingMode mode,
+                           char *buffer, size_t size);
+bool parse_u64(const char *input, uint64_t *value, char **endptr);
+bool parse_decimal(const char *input, Decimal *out, char **endptr);
+bool parse_number(const char *p, const char *end, const NumberFormat *format, double *value);
+bool format_decimal(const Decimal *number, char *buffer, size_t size);
+bool plan_decimal(const ConversionPlan *plan, DecimalPlan *dplan);
+bool convert_decimal(const DecimalPlan *dplan, const Decimal *value, Decimal *result);
+const ScaleTable *get_scale_table(const char *category);
+int classify_scale(const ScaleTable *table, double base_value);
+void classify_scale_batch(const ScaleTable *table, const double *base_values,
+                          uint8_t *unit_out, size_t n);
+void format_scaled(const ScaleTable *table, int unit, double base_value,
+                   char *buffer, size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+Arena *scratch_arena();
+char *arena_read_line(Arena *arena, FILE *stream);
+void text_init(ArenaText *text, Arena *arena, size_t capacity);
+void text_append(ArenaText *text, const char *format, ...);
+void sink_init(OutputSink *sink, int fd);
+void sink_add(OutputSink *sink, const char *data, size_t length);
+bool sink_flush(OutputSink *sink);
+bool passthrough_fd(int in_fd, int out_fd);
+int run_replay(const char *path, double tolerance, int threads);
+int run_history_stress(int writers, long records);
+int parse_stream_option(int argc, char *argv[], int *i);
+bool parse_pin_policy(const char *text);
+int pin_cpu(int index);
+bool pin_thread(int cpu);
+const UnitMatcher *get_unit_matcher();
+int run_annotate(UnitSystem system, bool replace);
+int run_verify(uint64_t seed, long count);
+void perf_open(PerfCounters *counters);
+void perf_start(PerfCounters *counters);
+void perf_stop(PerfCounters *counters);
+void perf_close(PerfCounters *counters);
+int run_bench(long count);
+int run_emit_hot_pairs(const char *path, int pair_count, char *pairs[]);
+int compile_expression(ExprProgram *program, const char *option, const char *source);
+int run_pack(const char *path, int spec_count, char *specs[], char delimiter);
+bool container_open(Container *container, const char *path);
+void container_close(Container *container);
+int container_find_column(const Container *container, const char *name);
+const double *container_read(Container *container, int column, int to_index, size_t block,
+                             size_t *rows);
+int run_unpack(const char *path, int spec_count, char *specs[], char delimiter);
+void run_expression(const ExprProgram *program, double **registers, size_t n);
+int run_emit_cpp(const char *dir);
+bool trace_open(const char *path);
+uint64_t trace_begin();
+void trace_end(Stage stage, uint64_t start);
+void metrics_count(Metric metric);
+void metrics_count_pair(int from_index, int to_index, uint64_t n);
+void metrics_history_depth(int entries, int pending);
+bool metrics_open_file(const char *path);
+bool metrics_listen(const char *path);
+int run_command_line(int argc, char *argv[]);
+
+// Kernels for hot unit pairs, generated by --emit-hot-pairs
+// Without the header every plan takes the generic kernel
+#if defined(__has_include)
+#if __has_include("hot_pairs.h")
+#include "hot_pairs.h"
+#endif
+#endif
+#ifndef HOT_PAIR_COUNT
+#define HOT_PAIR_COUNT 0
+static bool convert_hot_pair(int id, const double *restrict in,
+                             double *restrict out, size_t n) {
+    (void)id; (void)in; (void)out; (void)n;
+    return false;
+}
+#endif
 
 // Function to parse value with unit prefix
 // Handles prefixes like k (kilo), M (mega), m (milli), etc.
 // Example: "10m" -> 0.01, "2k" -> 2000
 double parse_value_with_prefix(const char *input, char *unit) {
+    uint64_t trace_start = trace_begin();
     char *endptr;
     double value = strtod(input, &endptr);
     
@@ -119,6 +760,7 @@ double parse_value_with_prefix(const char *input, char *unit) {
     strncpy(unit, endptr, 15);
     unit[15] = '\0';
     
+    trace_end(STAGE_PARSE_VALUE_WITH_PREFIX, trace_start);
     return value;
 }
 
@@ -437,6 +1079,9 @@ void initialize_units() {
         "Imperial unit of area, 43,560 square feet"
     };
 
+    // Units defined relative to the ones above
+    add_unit_definitions();
+
     // Initialize categories
     strcpy(categories[category_count++], "Length");
     strcpy(categories[category_count++], "Temperature");
@@ -450,6 +1095,178 @@ void initialize_units() {
     strcpy(categories[category_count++], "Pressure");
 }
 
+// Units defined relative to other units
+// A definition is a product of numbers and exactly one unit, with '*' or
+// '/' between factors ("220 yd", "1/4 qt", "10 ch"); it may refer to any
+// unit above or to another definition, in any order. Definitions are
+// resolved to plain factors when the catalogue is built.
+static const UnitDefinition unit_definitions[] = {
+    // Length
+    {"Furlong", "fur", "10 ch", {"furlong", "furlongs"}, "10 chains, 220 yards"},
+    {"Chain", "ch", "22 yd", {"chain", "chains"}, "Surveyor's chain, 22 yards"},
+    {"Fathom", "ftm", "6 ft", {"fathom", "fathoms"}, "Nautical unit of depth, 6 feet"},
+    {"Hand", "hh", "4 in", {"hand", "hands"}, "Used for horse heights, 4 inches"},
+    {"League", "lea", "3 mi", {"league", "leagues"}, "3 miles"},
+    {"Nautical Mile", "nmi", "1852 m", {"nauticalmile", "NMI"}, "Exactly 1852 meters"},
+
+    // Volume (US customary)
+    {"Teaspoon", "tsp", "1/3 tbsp", {"teaspoon", "TSP"}, "One third of a tablespoon"},
+    {"Tablespoon", "tbsp", "1/2 floz", {"tablespoon", "TBSP"}, "Half a fluid ounce"},
+    {"Fluid Ounce", "fl oz", "1/8 cup", {"floz", "FLOZ", "fl-oz"}, "One eighth of a cup"},
+    {"Cup", "cup", "1/4 qt", {"cups", "CUP"}, "A quarter of a quart, 8 fluid ounces"},
+    {"Gill", "gi", "1/2 cup", {"gill", "GILL"}, "Half a cup, 4 fluid ounces"},
+
+    // Mass
+    {"Stone", "st", "14 lb", {"stone", "ST"}, "14 pounds"},
+    {"Short Ton", "ton", "2000 lb", {"tons", "TON"}, "US ton, 2000 pounds"},
+    {"Tonne", "t", "1000 kg", {"tonne", "tonnes"}, "Metric ton, 1000 kilograms"},
+
+    // Time
+    {"Fortnight", "fn", "2 wk", {"fortnight", "fortnights"}, "14 days"}
+};
+
+#define UNIT_DEFINITION_COUNT ((int)(sizeof(unit_definitions) / sizeof(unit_definitions[0])))
+
+// Resolution state of each definition during the depth-first walk
+typedef enum {
+    DEFINITION_UNVISITED,
+    DEFINITION_IN_PROGRESS,
+    DEFINITION_RESOLVED,
+    DEFINITION_FAILED
+} DefinitionState;
+
+typedef struct {
+    DefinitionState state;
+    double factor;              // Against the category base unit
+    const char *category;
+} DefinitionResult;
+
+// Index of the definition whose symbol or alias is `name`, or -1
+static int find_unit_definition(const char *name) {
+    for (int i = 0; i < UNIT_DEFINITION_COUNT; i++) {
+        const UnitDefinition *definition = &unit_definitions[i];
+        if (strcmp(definition->symbol, name) == 0) return i;
+        for (int j = 0; j < MAX_DEFINITION_ALIASES && definition->aliases[j]; j++) {
+            if (strcmp(definition->aliases[j], name) == 0) return i;
+        }
+    }
+    return -1;
+}
+
+// Resolve definition `index`, resolving the definitions it refers to first
+// Every definition is evaluated once; a definition reached again while it
+// is still being resolved closes a cycle
+static bool resolve_unit_definition(int index, DefinitionResult *results) {
+    DefinitionResult *result = &results[index];
+    const UnitDefinition *definition = &unit_definitions[index];
+    if (result->state == DEFINITION_RESOLVED) return true;
+    if (result->state == DEFINITION_FAILED) return false;
+    if (result->state == DEFINITION_IN_PROGRESS) {
+        fprintf(stderr, "Warning: unit definitions form a cycle through '%s'\n",
+                definition->symbol);
+        result->state = DEFINITION_FAILED;
+        return false;
+    }
+    result->state = DEFINITION_IN_PROGRESS;
+
+    double factor = 1.0;
+    const char *category = NULL;
+    char op = '*';
+    bool ok = true;
+    const char *p = definition->expression;
+    while (ok && *p) {
+        if (*p == ' ') {
+            p++;
+        } else if (*p == '*' || *p == '/') {
+            op = *p++;
+        } else if (isdigit((unsigned char)*p) || *p == '.') {
+            char *end;
+            double number = strtod(p, &end);
+            factor = op == '*' ? factor * number : factor / number;
+            op = '*';
+            p = end;
+        } else {
+            char name[16];
+            size_t n = strcspn(p, " */");
+            if (n >= sizeof(name) || op != '*' || category != NULL) {
+                fprintf(stderr, "Warning: unit definition '%s' must multiply exactly one unit\n",
+                        definition->symbol);
+                ok = false;
+                break;
+            }
+            memcpy(name, p, n);
+            name[n] = '\0';
+            p += n;
+
+            int referenced = find_unit_definition(name);
+            if (referenced >= 0) {
+                ok = resolve_unit_definition(referenced, results);
+                factor *= results[referenced].factor;
+                category = results[referenced].category;
+            } else {
+                int unit = find_unit(name);
+                if (unit < 0 || units[unit].is_temp) {
+                    fprintf(stderr, "Warning: unit definition '%s' refers to unknown unit '%s'\n",
+                            definition->symbol, name);
+                    ok = false;
+                    break;
+                }
+                factor *= units[unit].factor;
+                category = units[unit].category;
+            }
+        }
+    }
+
+    if (ok && (category == NULL || !isfinite(factor) || factor <= 0)) {
+        fprintf(stderr, "Warning: unit definition '%s' is not a positive multiple of a unit\n",
+                definition->symbol);
+        ok = false;
+    }
+    if (!ok) {
+        result->state = DEFINITION_FAILED;
+        return false;
+    }
+    result->factor = factor;
+    result->category = category;
+    result->state = DEFINITION_RESOLVED;
+    return true;
+}
+
+// Add every relative definition to the catalogue as a plain unit
+// Factors are fully resolved here, so these units cost the same at
+// runtime as units defined directly against their base
+static void add_unit_definitions() {
+    DefinitionResult results[UNIT_DEFINITION_COUNT];
+    memset(results, 0, sizeof(results));
+
+    for (int i = 0; i < UNIT_DEFINITION_COUNT; i++) {
+        resolve_unit_definition(i, results);
+    }
+
+    // Append in table order once everything is resolved, so a definition
+    // never sees another one through find_unit()
+    for (int i = 0; i < UNIT_DEFINITION_COUNT && unit_count < MAX_UNITS; i++) {
+        if (results[i].state != DEFINITION_RESOLVED) continue;
+        const UnitDefinition *definition = &unit_definitions[i];
+        Unit *unit = &units[unit_count++];
+        memset(unit, 0, sizeof(*unit));
+        snprintf(unit->name, sizeof(unit->name), "%s", definition->name);
+        snprintf(unit->symbol, sizeof(unit->symbol), "%s", definition->symbol);
+        snprintf(unit->category, sizeof(unit->category), "%s", results[i].category);
+        unit->factor = results[i].factor;
+        for (int j = 0; j < MAX_DEFINITION_ALIASES && definition->aliases[j]; j++) {
+            snprintf(unit->aliases[unit->alias_count++], sizeof(unit->aliases[0]), "%s",
+                     definition->aliases[j]);
+        }
+        unit->description = definition->description;
+    }
+}
+
+// Get a unit's description, or an empty string if it has none
+const char *unit_description(const Unit *unit) {
+    return unit->description ? unit->description : "";
+}
+
 // Clear terminal screen
 void clear_screen() {
     #ifdef _WIN32
@@ -536,497 +1353,7048 @@ void print_success(const char *message) {
     printf("%s\n", message);
 }
 
-// Convert between units using their conversion factors
-// Special handling for temperature conversions
-double convert_value(double value, const char *from, const char *to) {
-    // Check if it's temperature conversion
-    bool is_temp_conversion = false;
-    for (int i = 0; i < unit_count; i++) {
-        char normalized_symbol[8];
-        strcpy(normalized_symbol, units[i].symbol);
-        normalize_unit_name(normalized_symbol);
-        
-        if (strcmp(normalized_symbol, from) == 0 && units[i].is_temp) {
-            is_temp_conversion = true;
-            break;
-        }
-    }
-    
-    if (is_temp_conversion) {
-        return convert_temperature(value, from, to);
-    }
-    
-    // Regular conversion
-    double from_factor = 1.0, to_factor = 1.0;
-    bool found_from = false, found_to = false;
-    
-    for (int i = 0; i < unit_count; i++) {
-        char normalized_symbol[8];
-        strcpy(normalized_symbol, units[i].symbol);
-        normalize_unit_name(normalized_symbol);
-        
-        if (strcmp(normalized_symbol, from) == 0) {
-            from_factor = units[i].factor;
-            found_from = true;
-        }
-        if (strcmp(normalized_symbol, to) == 0) {
-            to_factor = units[i].factor;
-            found_to = true;
-        }
-    }
-    
-    if (!found_from || !found_to) {
-        print_error("Invalid unit conversion!");
-        return value;
-    }
-    
-    // Handle potential overflow for large numbers
-    if (fabs(value) > 1e15) {
-        print_error("Warning: Very large number, precision may be affected");
-    }
-    
-    return value * from_factor / to_factor;
+// Monotonic time in seconds, for profiling
+static double now_seconds() {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
 }
 
-// Temperature conversion
-double convert_temperature(double value, const char *from, const char *to) {
-    // Convert to Celsius first
-    double celsius;
-    
-    if (strcmp(from, "C") == 0) {
-        celsius = value;
-    } else if (strcmp(from, "F") == 0) {
-        celsius = (value - 32) * 5/9;
-    } else if (strcmp(from, "K") == 0) {
-        celsius = value - 273.15;
-    } else {
-        return value; // Shouldn't happen if input is validated
-    }
-    
-    // Convert from Celsius to target unit
-    if (strcmp(to, "C") == 0) {
-        return celsius;
-    } else if (strcmp(to, "F") == 0) {
-        return (celsius * 9/5) + 32;
-    } else if (strcmp(to, "K") == 0) {
-        return celsius + 273.15;
+// Stage names as they appear in traces and metrics
+static const char *stage_names[STAGE_COUNT] = {
+    "find_unit", "parse_value_with_prefix", "convert_value", "convert",
+    "format_number", "save_history", "batch_read_parse", "batch_convert_format",
+    "stream_read", "csv_parse", "csv_convert", "csv_evaluate", "csv_format",
+    "window_aggregate",
+    "stream_write", "annotate_scan", "replay_parse", "replay_worker"
+};
+
+// Pipeline tracer state; trace_enabled is only set before work starts
+static bool trace_enabled = false;
+static const char *trace_path = NULL;
+static _Atomic(TraceBuffer *) trace_buffers = NULL;
+static atomic_int trace_next_thread = 1;
+static uint64_t trace_origin_ns = 0;
+
+static uint64_t trace_clock_ns() {
+#ifdef _WIN32
+    return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// This thread's trace buffer, created and published on first use
+static TraceBuffer *trace_local_buffer() {
+    static _Thread_local TraceBuffer *local = NULL;
+    if (local == NULL) {
+        local = calloc(1, sizeof(TraceBuffer));
+        if (local == NULL) return NULL;
+        local->thread_id = atomic_fetch_add(&trace_next_thread, 1);
+        TraceBuffer *head = atomic_load(&trace_buffers);
+        do {
+            local->next = head;
+        } while (!atomic_compare_exchange_weak(&trace_buffers, &head, local));
     }
-    
-    return value;
+    return local;
 }
 
-// Add conversion to history
-void add_history_entry(const char *from, const char *to, double val, double res) {
-    if (history_count < MAX_HISTORY) {
-        strncpy(history[history_count].from, from, sizeof(history[history_count].from)-1);
-        history[history_count].from[sizeof(history[history_count].from)-1] = '\0';
-        
-        strncpy(history[history_count].to, to, sizeof(history[history_count].to)-1);
-        history[history_count].to[sizeof(history[history_count].to)-1] = '\0';
-        
-        history[history_count].value = val;
-        history[history_count].result = res;
-        history[history_count].timestamp = time(NULL);
-        history_count++;
-    } else {
-        // Shift history down
-        for (int i = 0; i < MAX_HISTORY-1; i++) {
-            history[i] = history[i+1];
-        }
-        // Add new entry at end
-        strncpy(history[MAX_HISTORY-1].from, from, sizeof(history[MAX_HISTORY-1].from)-1);
-        history[MAX_HISTORY-1].from[sizeof(history[MAX_HISTORY-1].from)-1] = '\0';
-        
-        strncpy(history[MAX_HISTORY-1].to, to, sizeof(history[MAX_HISTORY-1].to)-1);
-        history[MAX_HISTORY-1].to[sizeof(history[MAX_HISTORY-1].to)-1] = '\0';
-        
-        history[MAX_HISTORY-1].value = val;
-        history[MAX_HISTORY-1].result = res;
-        history[MAX_HISTORY-1].timestamp = time(NULL);
+// Metrics state; shards are published on a lock-free list like trace buffers
+static bool metrics_enabled = false;
+static const char *metrics_path = NULL;
+static const char *metrics_socket_path = NULL;
+static _Atomic(MetricsShard *) metrics_shards = NULL;
+static atomic_int metrics_history_entries = 0;
+static atomic_int metrics_history_pending = 0;
+
+// Start timing a span; returns 0 when neither tracing nor metrics are on
+uint64_t trace_begin() {
+    return (trace_enabled || metrics_enabled) ? trace_clock_ns() : 0;
+}
+
+static void metrics_observe(Stage stage, uint64_t duration_ns);
+
+// Record a span started with trace_begin()
+// A full buffer drops new spans and counts them instead of blocking
+void trace_end(Stage stage, uint64_t start) {
+    if (start == 0) return;
+    uint64_t end = trace_clock_ns();
+    if (metrics_enabled) metrics_observe(stage, end - start);
+    if (!trace_enabled) return;
+    TraceBuffer *buffer = trace_local_buffer();
+    if (buffer == NULL) return;
+    if (buffer->count == TRACE_BUFFER_EVENTS) {
+        buffer->dropped++;
+        return;
     }
-    save_history(); // Save after each new entry
+    TraceEvent *event = &buffer->events[buffer->count++];
+    event->stage = stage;
+    event->start_ns = start;
+    event->duration_ns = end - start;
 }
 
-// Save conversion history to file
-void save_history() {
-    FILE *file = fopen(HISTORY_FILE, "w");
+// Write every thread's spans as Chrome trace-event JSON (loads in
+// chrome://tracing and Perfetto)
+static void trace_write() {
+    if (!trace_enabled) return;
+    trace_enabled = false;
+
+    FILE *file = fopen(trace_path, "w");
     if (file == NULL) {
-        print_error("Could not save history");
+        fprintf(stderr, "Error: cannot write trace '%s': %s\n", trace_path, strerror(errno));
         return;
     }
-    
-    for (int i = 0; i < history_count; i++) {
-        fprintf(file, "%s,%s,%.8g,%.8g,%ld\n",
-                history[i].from,
-                history[i].to,
-                history[i].value,
-                history[i].result,
-                history[i].timestamp);
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    size_t dropped = 0;
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                      "\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", buffer->thread_id,
+                buffer->thread_id == 1 ? "main" : "worker", buffer->thread_id);
+        first = false;
+        for (size_t i = 0; i < buffer->count; i++) {
+            const TraceEvent *event = &buffer->events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                          "\"ts\":%.3f,\"dur\":%.3f}",
+                    stage_names[event->stage], buffer->thread_id,
+                    (event->start_ns - trace_origin_ns) / 1e3, event->duration_ns / 1e3);
+        }
+        dropped += buffer->dropped;
     }
-    
+    fprintf(file, "\n]}\n");
     fclose(file);
-}
 
-// Load conversion history from file
-void load_history() {
-    FILE *file = fopen(HISTORY_FILE, "r");
-    if (file == NULL) {
-        return; // No history file exists yet
+    if (dropped > 0) {
+        fprintf(stderr, "Note: trace buffers were full, %zu spans dropped\n", dropped);
     }
-    
-    char line[256];
-    while (fgets(line, sizeof(line), file) && history_count < MAX_HISTORY) {
-        char from[16], to[16];
-        double value, result;
-        time_t timestamp;
-        
-        if (sscanf(line, "%[^,],%[^,],%lf,%lf,%ld",
-                   from, to, &value, &result, &timestamp) == 5) {
-            strncpy(history[history_count].from, from, sizeof(history[history_count].from)-1);
-            history[history_count].from[sizeof(history[history_count].from)-1] = '\0';
-            
-            strncpy(history[history_count].to, to, sizeof(history[history_count].to)-1);
-            history[history_count].to[sizeof(history[history_count].to)-1] = '\0';
-            
-            history[history_count].value = value;
-            history[history_count].result = result;
-            history[history_count].timestamp = timestamp;
-            history_count++;
+}
+
+// Enable tracing; the trace is written to `path` at exit
+bool trace_open(const char *path) {
+    trace_path = path;
+    trace_origin_ns = trace_clock_ns();
+    trace_enabled = true;
+    trace_local_buffer();   // The calling thread is "main"
+    return atexit(trace_write) == 0;
+}
+
+// This thread's metrics shard, created and published on first use
+static MetricsShard *metrics_local_shard() {
+    static _Thread_local MetricsShard *local = NULL;
+    if (local == NULL) {
+        MetricsShard *shard = calloc(1, sizeof(MetricsShard));
+        if (shard == NULL) return NULL;
+        shard->pair_units = unit_count;
+        shard->pair_conversions = calloc((size_t)unit_count * unit_count + 1,
+                                         sizeof(_Atomic uint64_t));
+        if (shard->pair_conversions == NULL) {
+            free(shard);
+            return NULL;
         }
+        MetricsShard *head = atomic_load(&metrics_shards);
+        do {
+            shard->next = head;
+        } while (!atomic_compare_exchange_weak(&metrics_shards, &head, shard));
+        local = shard;
     }
-    
-    fclose(file);
+    return local;
 }
 
-// Show conversion history
-void show_history() {
-    clear_screen();
-    print_header("Conversion History");
-    
-    if (history_count == 0) {
-        print_error("No conversion history available!");
+// Single-writer increment: no locked instruction on the hot path
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t metrics_read(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Count one event
+void metrics_count(Metric metric) {
+    if (!metrics_enabled) return;
+    MetricsShard *shard = metrics_local_shard();
+    if (shard) metrics_add(&shard->counters[metric], 1);
+}
+
+// Count `n` values converted between two units
+void metrics_count_pair(int from_index, int to_index, uint64_t n) {
+    if (!metrics_enabled || from_index < 0 || to_index < 0) return;
+    MetricsShard *shard = metrics_local_shard();
+    if (shard && from_index < shard->pair_units && to_index < shard->pair_units) {
+        metrics_add(&shard->pair_conversions[from_index * shard->pair_units + to_index], n);
+    }
+}
+
+// Publish the history gauges: records held, and records not yet saved
+void metrics_history_depth(int entries, int pending) {
+    atomic_store_explicit(&metrics_history_entries, entries, memory_order_relaxed);
+    atomic_store_explicit(&metrics_history_pending, pending, memory_order_relaxed);
+}
+
+// Upper bound of a latency bucket in nanoseconds
+static uint64_t metrics_bucket_bound(int bucket) {
+    return (uint64_t)256 << (2 * bucket);
+}
+
+// Record a stage duration in the latency histogram
+static void metrics_observe(Stage stage, uint64_t duration_ns) {
+    MetricsShard *shard = metrics_local_shard();
+    if (shard == NULL) return;
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS && duration_ns > metrics_bucket_bound(bucket)) bucket++;
+    metrics_add(&shard->stage_buckets[stage][bucket], 1);
+    metrics_add(&shard->stage_sum_ns[stage], duration_ns);
+}
+
+// Sum one counter over all shards
+static uint64_t metrics_total(Metric metric) {
+    uint64_t total = 0;
+    for (MetricsShard *shard = atomic_load(&metrics_shards); shard; shard = shard->next) {
+        total += metrics_read(&shard->counters[metric]);
+    }
+    return total;
+}
+
+// Render every metric in the Prometheus text exposition format
+static void metrics_render(ArenaText *out) {
+    MetricsShard *shards = atomic_load(&metrics_shards);
+    int n = unit_count;
+    uint64_t *pairs = arena_alloc(out->arena, ((size_t)n * n + 1) * sizeof(uint64_t));
+    uint64_t category_totals[MAX_CATEGORIES] = {0};
+    memset(pairs, 0, ((size_t)n * n + 1) * sizeof(uint64_t));
+
+    for (MetricsShard *shard = shards; shard; shard = shard->next) {
+        int side = shard->pair_units < n ? shard->pair_units : n;
+        for (int i = 0; i < side; i++) {
+            for (int j = 0; j < side; j++) {
+                pairs[i * n + j] += metrics_read(&shard->pair_conversions[i * shard->pair_units + j]);
+            }
+        }
+    }
+
+    text_append(out, "# HELP converter_conversions_total Values converted, by unit pair.\n");
+    text_append(out, "# TYPE converter_conversions_total counter\n");
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (pairs[i * n + j] == 0) continue;
+            text_append(out, "converter_conversions_total{category=\"%s\",from=\"%s\",to=\"%s\"} %llu\n",
+                        units[i].category, units[i].symbol, units[j].symbol,
+                        (unsigned long long)pairs[i * n + j]);
+            for (int c = 0; c < category_count; c++) {
+                if (strcmp(categories[c], units[i].category) == 0) {
+                    category_totals[c] += pairs[i * n + j];
+                    break;
+                }
+            }
+        }
+    }
+
+    text_append(out, "# HELP converter_category_conversions_total Values converted, by category.\n");
+    text_append(out, "# TYPE converter_category_conversions_total counter\n");
+    for (int c = 0; c < category_count; c++) {
+        text_append(out, "converter_category_conversions_total{category=\"%s\"} %llu\n",
+                    categories[c], (unsigned long long)category_totals[c]);
+    }
+
+    text_append(out, "# HELP converter_lookup_misses_total Unit names that matched no unit.\n");
+    text_append(out, "# TYPE converter_lookup_misses_total counter\n");
+    text_append(out, "converter_lookup_misses_total %llu\n",
+                (unsigned long long)metrics_total(METRIC_LOOKUP_MISSES));
+    text_append(out, "# HELP converter_invalid_unit_errors_total Conversions rejected for unknown or incompatible units.\n");
+    text_append(out, "# TYPE converter_invalid_unit_errors_total counter\n");
+    text_append(out, "converter_invalid_unit_errors_total %llu\n",
+                (unsigned long long)metrics_total(METRIC_INVALID_UNIT_ERRORS));
+
+    text_append(out, "# HELP converter_cache_requests_total Cache lookups, by cache and result.\n");
+    text_append(out, "# TYPE converter_cache_requests_total counter\n");
+    text_append(out, "converter_cache_requests_total{cache=\"scale_table\",result=\"hit\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_SCALE_CACHE_HITS));
+    text_append(out, "converter_cache_requests_total{cache=\"scale_table\",result=\"miss\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_SCALE_CACHE_MISSES));
+    text_append(out, "converter_cache_requests_total{cache=\"replay_pair\",result=\"hit\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_REPLAY_PAIR_HITS));
+    text_append(out, "converter_cache_requests_total{cache=\"replay_pair\",result=\"miss\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_REPLAY_PAIR_MISSES));
+    text_append(out, "converter_cache_requests_total{cache=\"container_block\",result=\"hit\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_BLOCK_CACHE_HITS));
+    text_append(out, "converter_cache_requests_total{cache=\"container_block\",result=\"miss\"} %llu\n",
+                (unsigned long long)metrics_total(METRIC_BLOCK_CACHE_MISSES));
+
+    text_append(out, "# HELP converter_history_entries History records held in memory.\n");
+    text_append(out, "# TYPE converter_history_entries gauge\n");
+    text_append(out, "converter_history_entries %d\n", atomic_load(&metrics_history_entries));
+    text_append(out, "# HELP converter_history_pending History records not yet saved to disk.\n");
+    text_append(out, "# TYPE converter_history_pending gauge\n");
+    text_append(out, "converter_history_pending %d\n", atomic_load(&metrics_history_pending));
+
+    text_append(out, "# HELP converter_stage_duration_seconds Time spent per pipeline stage.\n");
+    text_append(out, "# TYPE converter_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        uint64_t buckets[METRICS_BUCKETS + 1] = {0}, sum_ns = 0, count = 0;
+        for (MetricsShard *shard = shards; shard; shard = shard->next) {
+            for (int b = 0; b <= METRICS_BUCKETS; b++) {
+                buckets[b] += metrics_read(&shard->stage_buckets[stage][b]);
+            }
+            sum_ns += metrics_read(&shard->stage_sum_ns[stage]);
+        }
+        for (int b = 0; b <= METRICS_BUCKETS; b++) count += buckets[b];
+        if (count == 0) continue;
+
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += buckets[b];
+            text_append(out, "converter_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                        stage_names[stage], metrics_bucket_bound(b) / 1e9,
+                        (unsigned long long)cumulative);
+        }
+        text_append(out, "converter_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                    stage_names[stage], (unsigned long long)count);
+        text_append(out, "converter_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                    stage_names[stage], sum_ns / 1e9);
+        text_append(out, "converter_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                    stage_names[stage], (unsigned long long)count);
+    }
+}
+
+// Write the metrics to the --metrics-file path at exit
+static void metrics_write() {
+    Arena arena = {0};
+    ArenaText text;
+    text_init(&text, &arena, 16384);
+    metrics_render(&text);
+
+    FILE *file = fopen(metrics_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: cannot write metrics '%s': %s\n", metrics_path, strerror(errno));
     } else {
-        printf("%-5s %-15s %-15s %-15s %-15s %-20s\n", 
-               "No.", "From", "To", "Value", "Result", "Time");
-        printf("----------------------------------------------------------------\n");
-        
-        for (int i = 0; i < history_count; i++) {
-            char time_str[32];
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", 
-                    localtime(&history[i].timestamp));
-            
-            char value_str[32], result_str[32];
-            format_number(history[i].value, value_str, sizeof(value_str));
-            format_number(history[i].result, result_str, sizeof(result_str));
-            
-            printf("%-5d %-15s %-15s %-15s %-15s %-20s\n",
-                   i+1,
-                   history[i].from,
-                   history[i].to,
-                   value_str,
-                   result_str,
-                   time_str);
+        fwrite(text.data, 1, text.length, file);
+        fclose(file);
+    }
+    arena_free(&arena);
+}
+
+// Enable metrics; they are written to `path` at exit
+bool metrics_open_file(const char *path) {
+    metrics_path = path;
+    metrics_enabled = true;
+    return atexit(metrics_write) == 0;
+}
+
+#ifndef _WIN32
+// Remove the metrics socket at exit
+static void metrics_unlink_socket() {
+    unlink(metrics_socket_path);
+}
+
+// Serve one scrape per connection; an HTTP request gets an HTTP response,
+// anything else (or silence) gets the bare exposition text
+static void *metrics_listener(void *arg) {
+    int server = (int)(intptr_t)arg;
+    Arena arena = {0};
+
+    while (1) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
+
+        char request[512];
+        ssize_t received = 0;
+        struct pollfd pfd = { client, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) > 0) {
+            received = read(client, request, sizeof(request) - 1);
+        }
+        bool http = received >= 4 && memcmp(request, "GET ", 4) == 0;
+
+        ArenaText text;
+        text_init(&text, &arena, 16384);
+        metrics_render(&text);
+        if (http) {
+            dprintf(client, "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n", text.length);
+        }
+        for (size_t done = 0; done < text.length;) {
+            ssize_t n = write(client, text.data + done, text.length - done);
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        close(client);
+        arena_reset(&arena);
+    }
+    arena_free(&arena);
+    return NULL;
+}
+#endif
+
+// Enable metrics and serve them on a unix socket at `path`
+// (e.g. curl --unix-socket PATH http://localhost/metrics)
+bool metrics_listen(const char *path) {
+#ifndef _WIN32
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        perror("socket");
+        return false;
+    }
+    unlink(path);
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server, 8) < 0) {
+        fprintf(stderr, "Error: cannot listen on '%s': %s\n", path, strerror(errno));
+        close(server);
+        return false;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_listener, (void *)(intptr_t)server) != 0) {
+        close(server);
+        return false;
+    }
+    pthread_detach(thread);
+    metrics_socket_path = path;
+    atexit(metrics_unlink_socket);
+    metrics_enabled = true;
+    return true;
+#else
+    fprintf(stderr, "Error: --metrics-socket is not supported on this platform\n");
+    return false;
+#endif
+}
+
+// Round a size up to the arena alignment
+static size_t arena_align(size_t size) {
+    size_t align = sizeof(max_align_t);
+    return (size + align - 1) & ~(align - 1);
+}
+
+static ArenaBlock *arena_new_block(size_t size, ArenaBlock *next) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+// Allocate scratch memory; it lives until the next arena_reset()
+void *arena_alloc(Arena *arena, size_t size) {
+    size = arena_align(size);
+    ArenaBlock *head = arena->head;
+    if (head == NULL || head->size - head->used < size) {
+        size_t block_size = head ? head->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size) block_size *= 2;
+        head = arena->head = arena_new_block(block_size, head);
+    }
+    void *ptr = (char *)head->data + head->used;
+    head->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+// Grow an allocation, in place if it is the most recent one
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    ArenaBlock *head = arena->head;
+    if (ptr != NULL && ptr == arena->last) {
+        size_t offset = (size_t)((char *)ptr - (char *)head->data);
+        if (offset + arena_align(new_size) <= head->size) {
+            head->used = offset + arena_align(new_size);
+            return ptr;
+        }
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (ptr != NULL) memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+// Release everything allocated since the last reset
+// If the batch needed several blocks they are replaced by one block of
+// the combined size, so the next batch of the same shape fits without malloc
+void arena_reset(Arena *arena) {
+    ArenaBlock *head = arena->head;
+    if (head != NULL && head->next != NULL) {
+        size_t total = 0;
+        while (head != NULL) {
+            ArenaBlock *next = head->next;
+            total += head->size;
+            free(head);
+            head = next;
+        }
+        arena->head = arena_new_block(total, NULL);
+    } else if (head != NULL) {
+        head->used = 0;
+    }
+    arena->last = NULL;
+}
+
+// Return all of an arena's memory to the heap
+void arena_free(Arena *arena) {
+    ArenaBlock *head = arena->head;
+    while (head != NULL) {
+        ArenaBlock *next = head->next;
+        free(head);
+        head = next;
+    }
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+// Per-thread scratch arena, so worker threads never share an allocator
+Arena *scratch_arena() {
+    static _Thread_local Arena arena;
+    return &arena;
+}
+
+// Read one line of any length into the arena, without the newline
+// Returns NULL at end of input
+char *arena_read_line(Arena *arena, FILE *stream) {
+    size_t capacity = 128, length = 0;
+    char *line = arena_alloc(arena, capacity);
+
+    while (fgets(line + length, (int)(capacity - length), stream)) {
+        length += strlen(line + length);
+        if (length > 0 && line[length-1] == '\n') {
+            line[length-1] = '\0';
+            return line;
+        }
+        if (length + 1 < capacity) {
+            return line; // Last line without a newline
+        }
+        line = arena_grow(arena, line, capacity, capacity * 2);
+        capacity *= 2;
+    }
+    return length > 0 ? line : NULL;
+}
+
+// Start an arena-backed text buffer
+void text_init(ArenaText *text, Arena *arena, size_t capacity) {
+    text->arena = arena;
+    text->data = arena_alloc(arena, capacity);
+    text->data[0] = '\0';
+    text->length = 0;
+    text->capacity = capacity;
+}
+
+// Append formatted text, growing the buffer inside the arena
+void text_append(ArenaText *text, const char *format, ...) {
+    for (;;) {
+        size_t room = text->capacity - text->length;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(text->data + text->length, room, format, args);
+        va_end(args);
+        if (written < 0) return;
+        if ((size_t)written < room) {
+            text->length += (size_t)written;
+            return;
+        }
+        size_t capacity = text->capacity * 2;
+        while (capacity - text->length <= (size_t)written) capacity *= 2;
+        text->data = arena_grow(text->arena, text->data, text->length + 1, capacity);
+        text->capacity = capacity;
+    }
+}
+
+// Start an output sink on a file descriptor
+void sink_init(OutputSink *sink, int fd) {
+    sink->fd = fd;
+    sink->count = 0;
+    sink->failed = false;
+}
+
+// Queue a span for output; it must stay valid until the next flush
+// Spans that continue the previous one are merged
+void sink_add(OutputSink *sink, const char *data, size_t length) {
+    if (length == 0) return;
+    if (sink->count > 0) {
+        char *last_end = (char *)sink->iov[sink->count-1].iov_base +
+                         sink->iov[sink->count-1].iov_len;
+        if (last_end == data) {
+            sink->iov[sink->count-1].iov_len += length;
+            return;
+        }
+    }
+    if (sink->count == SINK_MAX_IOV && !sink_flush(sink)) {
+        sink->failed = true;
+    }
+    sink->iov[sink->count].iov_base = (void *)data;
+    sink->iov[sink->count].iov_len = length;
+    sink->count++;
+}
+
+// Write all queued spans, resuming after partial writes
+bool sink_flush(OutputSink *sink) {
+    int first = 0;
+    bool ok = true;
+
+#ifndef _WIN32
+    while (first < sink->count) {
+        ssize_t written = writev(sink->fd, &sink->iov[first], sink->count - first);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        while (first < sink->count && (size_t)written >= sink->iov[first].iov_len) {
+            written -= (ssize_t)sink->iov[first].iov_len;
+            first++;
+        }
+        if (first < sink->count) {
+            sink->iov[first].iov_base = (char *)sink->iov[first].iov_base + written;
+            sink->iov[first].iov_len -= (size_t)written;
+        }
+    }
+#else
+    FILE *stream = sink->fd == 2 ? stderr : stdout;
+    for (; first < sink->count; first++) {
+        if (fwrite(sink->iov[first].iov_base, 1, sink->iov[first].iov_len, stream) !=
+            sink->iov[first].iov_len) {
+            ok = false;
+        }
+    }
+#endif
+    sink->count = 0;
+    if (sink->failed) {
+        sink->failed = false;
+        return false;
+    }
+    return ok;
+}
+
+// Copy a whole input to the output without converting anything
+// Uses copy_file_range() between files and splice() when a pipe is involved,
+// so the bytes never enter user space; falls back to read/write
+bool passthrough_fd(int in_fd, int out_fd) {
+#ifdef __linux__
+    ssize_t moved;
+    while ((moved = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0) {}
+    if (moved == 0) return true;
+
+    while ((moved = splice(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0) {}
+    if (moved == 0) return true;
+#endif
+#ifndef _WIN32
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(out_fd, buffer + done, (size_t)(n - done));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += written;
+        }
+    }
+    return n == 0;
+#else
+    (void)in_fd;
+    (void)out_fd;
+    return false;
+#endif
+}
+
+// Convert between units using their conversion factors
+// Special handling for temperature conversions
+double convert_value(double value, const char *from, const char *to) {
+    uint64_t trace_start = trace_begin();
+
+    // One pass finds both units: their factors (last match), whether it
+    // is a temperature conversion, and the indices (first match) that
+    // label the pair in the metrics, so no second lookup is needed
+    double from_factor = 1.0, to_factor = 1.0;
+    int from_index = -1, to_index = -1;
+    bool found_from = false, found_to = false, is_temp_conversion = false;
+    
+    for (int i = 0; i < unit_count; i++) {
+        char normalized_symbol[8];
+        strcpy(normalized_symbol, units[i].symbol);
+        normalize_unit_name(normalized_symbol);
         
-        printf("\nOptions:\n");
-        printf("1. Clear history\n");
-        printf("2. Export to CSV\n");
-        printf("3. Return to menu\n");
-        printf("\nEnter your choice: ");
-        
-        char choice[16];
-        fgets(choice, sizeof(choice), stdin);
-        
-        switch (choice[0]) {
-            case '1':
-                history_count = 0;
-                save_history();
-                print_success("History cleared!");
-                break;
-            case '2':
-                export_history_to_csv();
-                break;
-            case '3':
-                return;
-            default:
-                print_error("Invalid choice!");
+        if (strcmp(normalized_symbol, from) == 0) {
+            if (!found_from) from_index = i;
+            if (units[i].is_temp) is_temp_conversion = true;
+            from_factor = units[i].factor;
+            found_from = true;
+        }
+        if (strcmp(normalized_symbol, to) == 0) {
+            if (!found_to) to_index = i;
+            to_factor = units[i].factor;
+            found_to = true;
         }
     }
     
-    printf("\nPress Enter to continue...");
-    getchar();
+    if (is_temp_conversion) {
+        double result = convert_temperature(value, from, to);
+        if (metrics_enabled) metrics_count_pair(from_index, to_index, 1);
+        trace_end(STAGE_CONVERT_VALUE, trace_start);
+        return result;
+    }
+    
+    if (!found_from || !found_to) {
+        print_error("Invalid unit conversion!");
+        metrics_count(METRIC_INVALID_UNIT_ERRORS);
+        trace_end(STAGE_CONVERT_VALUE, trace_start);
+        return value;
+    }
+    
+    // Handle potential overflow for large numbers
+    if (fabs(value) > 1e15) {
+        print_error("Warning: Very large number, precision may be affected");
+    }
+    
+    if (metrics_enabled) metrics_count_pair(from_index, to_index, 1);
+    trace_end(STAGE_CONVERT_VALUE, trace_start);
+    return value * from_factor / to_factor;
 }
 
-// Show category menu
-void show_category_menu(const char *category) {
-    clear_screen();
-    print_header(category);
+// Temperature conversion
+double convert_temperature(double value, const char *from, const char *to) {
+    // Convert to Celsius first
+    double celsius;
     
-    printf("Available units:\n\n");
-    printf("%-15s %-10s %-40s\n", "Unit", "Symbol", "Description");
-    printf("----------------------------------------------------------------\n");
+    if (strcmp(from, "C") == 0) {
+        celsius = value;
+    } else if (strcmp(from, "F") == 0) {
+        celsius = (value - 32) * 5/9;
+    } else if (strcmp(from, "K") == 0) {
+        celsius = value - 273.15;
+    } else {
+        return value; // Shouldn't happen if input is validated
+    }
+    
+    // Convert from Celsius to target unit
+    if (strcmp(to, "C") == 0) {
+        return celsius;
+    } else if (strcmp(to, "F") == 0) {
+        return (celsius * 9/5) + 32;
+    } else if (strcmp(to, "K") == 0) {
+        return celsius + 273.15;
+    }
     
+    return value;
+}
+
+// Find a unit by symbol or alias
+// Exact matches win; otherwise names are compared after normalization
+// Returns the index into units[] or -1 if the unit is unknown
+int find_unit(const char *unit) {
     for (int i = 0; i < unit_count; i++) {
-        if (strcmp(units[i].category, category) == 0) {
-            printf("%-15s %-10s %-40s\n", 
-                   units[i].name, 
-                   units[i].symbol,
-                   units[i].description);
+        if (strcmp(units[i].symbol, unit) == 0) {
+            return i;
+        }
+        for (int j = 0; j < units[i].alias_count; j++) {
+            if (strcmp(units[i].aliases[j], unit) == 0) {
+                return i;
+            }
+        }
+    }
+
+    char wanted[16];
+    strncpy(wanted, unit, sizeof(wanted)-1);
+    wanted[sizeof(wanted)-1] = '\0';
+    normalize_unit_name(wanted);
+
+    for (int i = 0; i < unit_count; i++) {
+        char candidate[16];
+        strcpy(candidate, units[i].symbol);
+        normalize_unit_name(candidate);
+        if (strcmp(candidate, wanted) == 0) {
+            return i;
+        }
+        for (int j = 0; j < units[i].alias_count; j++) {
+            strcpy(candidate, units[i].aliases[j]);
+            normalize_unit_name(candidate);
+            if (strcmp(candidate, wanted) == 0) {
+                return i;
+            }
         }
     }
-    
-    printf("\n");
+    metrics_count(METRIC_LOOKUP_MISSES);
+    return -1;
+}
+
+// Express a temperature unit as celsius = value * scale + offset
+static void temperature_to_celsius(const Unit *unit, double *scale, double *offset) {
+    if (strcmp(unit->name, "Fahrenheit") == 0) {
+        *scale = 5.0 / 9.0;
+        *offset = -32.0 * 5.0 / 9.0;
+    } else if (strcmp(unit->name, "Kelvin") == 0) {
+        *scale = 1.0;
+        *offset = -273.15;
+    } else {
+        *scale = 1.0;
+        *offset = 0.0;
+    }
+}
+
+// Resolve a unit pair into a conversion plan
+// Returns false if either unit is unknown or the categories differ
+bool plan_conversion(const char *from, const char *to, ConversionPlan *plan) {
+    uint64_t trace_start = trace_begin();
+    int from_index = find_unit(from);
+    int to_index = find_unit(to);
+    trace_end(STAGE_FIND_UNIT, trace_start);
+    if (from_index < 0 || to_index < 0) {
+        metrics_count(METRIC_INVALID_UNIT_ERRORS);
+        return false;
+    }
+
+    const Unit *src = &units[from_index];
+    const Unit *dst = &units[to_index];
+    if (strcmp(src->category, dst->category) != 0) {
+        metrics_count(METRIC_INVALID_UNIT_ERRORS);
+        return false;
+    }
+
+    plan->from_index = from_index;
+    plan->to_index = to_index;
+
+    if (src->is_temp && dst->is_temp) {
+        // Go through Celsius: c = x*a1 + b1, result = (c - b2) / a2
+        double a1, b1, a2, b2;
+        temperature_to_celsius(src, &a1, &b1);
+        temperature_to_celsius(dst, &a2, &b2);
+        plan->scale = a1 / a2;
+        plan->offset = (b1 - b2) / a2;
+    } else {
+        plan->scale = src->factor / dst->factor;
+        plan->offset = 0.0;
+    }
+
+    // Route to a generated kernel only if it was built from this exact plan
+    plan->hot_pair = 0;
+#if HOT_PAIR_COUNT > 0
+    for (int i = 0; i < HOT_PAIR_COUNT; i++) {
+        const HotPair *hot = &hot_pairs[i];
+        if (strcmp(hot->from, src->symbol) == 0 && strcmp(hot->to, dst->symbol) == 0 &&
+            hot->scale == plan->scale && hot->offset == plan->offset) {
+            plan->hot_pair = i + 1;
+            break;
+        }
+    }
+#endif
+    return true;
+}
+
+// Round a plan to single precision once, so the float kernel never
+// touches doubles
+ConversionPlanF32 plan_to_f32(const ConversionPlan *plan) {
+    ConversionPlanF32 plan32 = { (float)plan->scale, (float)plan->offset };
+    return plan32;
+}
+
+// Convert an array of values with a precomputed plan
+// The loops carry no dependencies so the compiler can vectorize them
+void convert_batch(const ConversionPlan *plan, const double *restrict in,
+                   double *restrict out, size_t n) {
+    const double scale = plan->scale;
+    const double offset = plan->offset;
+
+    if (plan->hot_pair != 0 && convert_hot_pair(plan->hot_pair, in, out, n)) {
+        return;
+    }
+    if (offset == 0.0) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] * scale;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] * scale + offset;
+        }
+    }
+}
+
+// Single-precision batch kernel: half the memory traffic of the double
+// kernel and twice the values per SIMD register
+// See documentation.txt for the error bounds relative to convert_batch()
+void convert_batch_f32(const ConversionPlanF32 *plan, const float *restrict in,
+                       float *restrict out, size_t n) {
+    const float scale = plan->scale;
+    const float offset = plan->offset;
+
+    if (offset == 0.0f) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] * scale;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] * scale + offset;
+        }
+    }
+}
+
+// Convert a factor to an integer if it is one exactly
+static bool factor_as_u64(double factor, uint64_t *out) {
+    if (!(factor >= 1.0 && factor < 18446744073709551616.0) || factor != floor(factor)) {
+        return false;
+    }
+    *out = (uint64_t)factor;
+    return true;
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static bool is_power_of_two(uint64_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+static int log2_u64(uint64_t x) {
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+}
+
+// True if `x` has no prime factors other than 2 and 5, i.e. 1/x is a
+// terminating decimal
+static bool is_decimal_denominator(uint64_t x) {
+    while (x % 2 == 0) x /= 2;
+    while (x % 5 == 0) x /= 5;
+    return x == 1;
+}
+
+// Build an exact integer plan for units whose factors are integers
+// (Digital Storage: powers of 1024, or powers of ten for decimal units)
+// The reduced denominator must be of the form 2^a * 5^b, so the exact
+// result is a terminating decimal; other ratios (s -> h) take the
+// floating point path
+// Returns false when the pair needs the floating point path
+bool plan_integer(const ConversionPlan *plan, IntegerPlan *iplan) {
+    const Unit *src = &units[plan->from_index];
+    const Unit *dst = &units[plan->to_index];
+    uint64_t from_factor, to_factor;
+
+    if (src->is_temp || dst->is_temp ||
+        !factor_as_u64(src->factor, &from_factor) ||
+        !factor_as_u64(dst->factor, &to_factor)) {
+        return false;
+    }
+
+    uint64_t g = gcd_u64(from_factor, to_factor);
+    iplan->numerator = from_factor / g;
+    iplan->denominator = to_factor / g;
+    if (!is_decimal_denominator(iplan->denominator)) return false;
+    iplan->power_of_two = false;
+    iplan->shift = 0;
+
+    // After reduction one side is 1, so a power-of-two ratio is a single shift
+    if (iplan->denominator == 1 && is_power_of_two(iplan->numerator)) {
+        iplan->power_of_two = true;
+        iplan->shift = log2_u64(iplan->numerator);
+    } else if (iplan->numerator == 1 && is_power_of_two(iplan->denominator)) {
+        iplan->power_of_two = true;
+        iplan->shift = -log2_u64(iplan->denominator);
+    }
+
+    // Division by the denominator as a multiply-high and two shifts
+    // (Granlund & Montgomery), exact for every 64-bit dividend:
+    // l = ceil(log2 d), magic = floor(2^64 * (2^l - d) / d) + 1
+    iplan->magic = 0;
+    iplan->magic_shift = 0;
+    if (iplan->denominator > 1 && !is_power_of_two(iplan->denominator)) {
+        int l = log2_u64(iplan->denominator) + 1;
+        unsigned __int128 pow2 = (unsigned __int128)1 << l;
+        iplan->magic = (uint64_t)(((pow2 - iplan->denominator) << 64) / iplan->denominator + 1);
+        iplan->magic_shift = l;
+    }
+    return true;
+}
+
+// Exact conversion of one integer: value * num / den = quotient + remainder / den
+void convert_integer(const IntegerPlan *iplan, uint64_t value,
+                     unsigned __int128 *quotient, uint64_t *remainder) {
+    if (iplan->power_of_two) {
+        if (iplan->shift >= 0) {
+            *quotient = (unsigned __int128)value << iplan->shift;
+            *remainder = 0;
+        } else {
+            int k = -iplan->shift;
+            *quotient = value >> k;
+            *remainder = value & ((UINT64_C(1) << k) - 1);
+        }
+        return;
+    }
+
+    unsigned __int128 product = (unsigned __int128)value * iplan->numerator;
+    *quotient = product / iplan->denominator;
+    *remainder = (uint64_t)(product % iplan->denominator);
+}
+
+// Exact conversion of a column of integers
+// Down-conversions by a power of two (the common bytes -> MB case) are a
+// shift and a mask per value and vectorize; other ratios go through 128-bit
+// arithmetic one value at a time
+void convert_integer_batch(const IntegerPlan *iplan, const uint64_t *restrict in,
+                           unsigned __int128 *restrict quotient,
+                           uint64_t *restrict remainder, size_t n) {
+    if (iplan->power_of_two && iplan->shift < 0) {
+        const int k = -iplan->shift;
+        const uint64_t mask = (UINT64_C(1) << k) - 1;
+        for (size_t i = 0; i < n; i++) {
+            remainder[i] = in[i] & mask;
+        }
+        for (size_t i = 0; i < n; i++) {
+            quotient[i] = in[i] >> k;
+        }
+        return;
+    }
+
+    const uint64_t numerator = iplan->numerator, denominator = iplan->denominator;
+    if (denominator == 1) {
+        // Up-conversion (GB -> B): a shift or multiply, nothing left over
+        for (size_t i = 0; i < n; i++) {
+            remainder[i] = 0;
+        }
+        if (iplan->power_of_two) {
+            const int k = iplan->shift;
+            for (size_t i = 0; i < n; i++) {
+                quotient[i] = (unsigned __int128)in[i] << k;
+            }
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                quotient[i] = (unsigned __int128)in[i] * numerator;
+            }
+        }
+        return;
+    }
+    if (is_power_of_two(denominator)) {
+        // Multiply, then shift and mask the 128-bit product
+        const int k = log2_u64(denominator);
+        const uint64_t mask = denominator - 1;
+        for (size_t i = 0; i < n; i++) {
+            unsigned __int128 product = (unsigned __int128)in[i] * numerator;
+            quotient[i] = product >> k;
+            remainder[i] = (uint64_t)product & mask;
+        }
+        return;
+    }
+
+    // Multiply, then divide by the reciprocal while the product fits in
+    // 64 bits; only larger products take the 128-bit division
+    const uint64_t magic = iplan->magic;
+    const int shift = iplan->magic_shift - 1;
+    for (size_t i = 0; i < n; i++) {
+        unsigned __int128 product = (unsigned __int128)in[i] * numerator;
+        if ((uint64_t)(product >> 64) == 0) {
+            uint64_t x = (uint64_t)product;
+            uint64_t t = (uint64_t)(((unsigned __int128)x * magic) >> 64);
+            uint64_t q = (t + ((x - t) >> 1)) >> shift;
+            quotient[i] = q;
+            remainder[i] = x - q * denominator;
+        } else {
+            quotient[i] = product / denominator;
+            remainder[i] = (uint64_t)(product % denominator);
+        }
+    }
+}
+
+// Write an unsigned 128-bit integer in decimal, returns the length
+static int format_u128(unsigned __int128 value, char *buffer, size_t size) {
+    char digits[40];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value != 0);
+
+    int len = 0;
+    while (n > 0 && (size_t)len + 1 < size) {
+        buffer[len++] = digits[--n];
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+// Format an exact integer result, applying the rounding mode
+// ROUND_EXACT prints the fraction as a decimal; it terminates within 64
+// digits because plan_integer() only allows denominators 2^a * 5^b < 2^64
+void format_integer_result(const IntegerPlan *iplan, unsigned __int128 quotient,
+                           uint64_t remainder, RoundingMode mode,
+                           char *buffer, size_t size) {
+    uint64_t den = iplan->denominator;
+
+    if (remainder != 0 && mode != ROUND_EXACT) {
+        if (mode == ROUND_UP) {
+            quotient++;
+        } else if (mode == ROUND_NEAREST) {
+            // Compare 2r with den without overflowing
+            uint64_t half = den - remainder;
+            if (remainder > half || (remainder == half && (quotient & 1))) {
+                quotient++;
+            }
+        }
+        remainder = 0;
+    }
+
+    int len = format_u128(quotient, buffer, size);
+    if (remainder == 0 || (size_t)len + 2 >= size) {
+        return;
+    }
+
+    buffer[len++] = '.';
+    unsigned __int128 r = remainder;
+    for (int digits = 0; r != 0 && digits < 64 && (size_t)len + 1 < size; digits++) {
+        r *= 10;
+        buffer[len++] = (char)('0' + (int)(r / den));
+        r %= den;
+    }
+    buffer[len] = '\0';
+}
+
+// High bit set in every byte of x that is an ASCII digit ('0' to '9')
+// Bytes are masked to seven bits first so no addition carries into the
+// next byte; bytes >= 0x80 are never digits
+static inline uint64_t swar_digit_mask(uint64_t x) {
+    const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+    uint64_t low = x & ~highs;
+    return (low + 0x50 * ones) & ~(low + 0x46 * ones) & ~x & highs;
+}
+
+// Exact powers of ten for the fast path of parse_number()
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Value of eight ASCII digits loaded little-endian into one word
+// Pairs, then quads, then the octet are combined with three multiplies
+static inline uint64_t parse_eight_digits(uint64_t x) {
+    x -= 0x3030303030303030ull;
+    x = (x * 10) + (x >> 8);
+    x = (((x & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+         (((x >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+    return x;
+}
+
+// Accumulate a run of digits into the mantissa and the normalized text
+// Whole words of eight digits are classified and converted at once
+static const char *scan_digits(const char *p, const char *end, uint64_t *mantissa,
+                               int *digits, char *text, size_t *length, size_t size) {
+    while (p < end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (end - p >= 8 && *digits + 8 <= 19 && *length + 8 < size) {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            if (swar_digit_mask(x) == 0x8080808080808080ull) {
+                *mantissa = *mantissa * 100000000u + parse_eight_digits(x);
+                *digits += 8;
+                memcpy(text + *length, p, 8);
+                *length += 8;
+                p += 8;
+                continue;
+            }
+        }
+#endif
+        if (*p < '0' || *p > '9' || *length + 1 >= size) break;
+        if (*digits < 19) *mantissa = *mantissa * 10 + (uint64_t)(*p - '0');
+        (*digits)++;
+        text[(*length)++] = *p++;
+    }
+    return p;
+}
+
+// Parse the whole of [p, end) as a number written with the separators of
+// `format`; surrounding spaces (and a trailing '\r') are ignored
+// Group separators are accepted between digits of the integer part.
+// Up to 19 significant digits with a mantissa below 2^53 and a power of ten
+// up to 22 are converted exactly with one multiply or divide (Clinger's
+// fast path); everything else goes through strtod() on the normalized
+// digits. With the default format, strtod() also gets the last word, so
+// inf, nan and hex floats keep working.
+bool parse_number(const char *p, const char *end, const NumberFormat *format, double *value) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    const char *start = p;
+
+    // Normalized copy for strtod(); digits stop 10 short of the end so the
+    // point, "e-", six exponent digits and the terminator always fit
+    char text[128];
+    size_t length = 0, digit_room = sizeof(text) - 10;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool negative = false;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        text[length++] = *p++;
+    }
+
+    // Integer part; group separators must split it into groups of three
+    // after a leading group of one to three digits
+    int group_start = 0;
+    bool grouped = false;
+    while (p < end) {
+        p = scan_digits(p, end, &mantissa, &digits, text, &length, digit_room);
+        int group = digits - group_start;
+        if (format->group_sep != '\0' && p < end && *p == format->group_sep &&
+            group > 0 && (grouped ? group == 3 : group <= 3)) {
+            p++;
+            grouped = true;
+            group_start = digits;
+            continue;
+        }
+        break;
+    }
+    if (grouped && digits - group_start != 3) return false;
+    int integer_digits = digits;
+
+    // Fraction
+    if (p < end && *p == format->decimal_sep) {
+        p++;
+        text[length++] = '.';
+        p = scan_digits(p, end, &mantissa, &digits, text, &length, digit_room);
+        exponent -= digits - integer_digits;
+    }
+
+    // Exponent
+    if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool exponent_negative = false;
+        if (q < end && (*q == '-' || *q == '+')) exponent_negative = *q++ == '-';
+        if (q < end && isdigit((unsigned char)*q)) {
+            int e = 0;
+            text[length++] = 'e';
+            if (exponent_negative) text[length++] = '-';
+            // Leading zeros are skipped and the value capped at six digits,
+            // so the copy never outgrows the buffer
+            while (q < end && isdigit((unsigned char)*q)) {
+                if (e < 100000 && (e > 0 || *q != '0') && length + 1 < sizeof(text)) {
+                    e = e * 10 + (*q - '0');
+                    text[length++] = *q;
+                }
+                q++;
+            }
+            if (e == 0) text[length++] = '0';
+            exponent += exponent_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    if (digits > 0 && p == end) {
+        if (digits <= 19 && mantissa <= (1ull << 53) &&
+            exponent >= -22 && exponent <= 22) {
+            double result = (double)mantissa;
+            result = exponent < 0 ? result / exact_powers_of_ten[-exponent]
+                                  : result * exact_powers_of_ten[exponent];
+            *value = negative ? -result : result;
+            return true;
+        }
+        text[length] = '\0';
+        *value = strtod(text, NULL);
+        return true;
+    }
+
+    // Not a plain decimal: with the default format, defer to strtod()
+    size_t n = (size_t)(end - start);
+    if (format->decimal_sep == '.' && format->group_sep == '\0' && n > 0 && n < sizeof(text)) {
+        char *parsed_end;
+        memcpy(text, start, n);
+        text[n] = '\0';
+        *value = strtod(text, &parsed_end);
+        return parsed_end == text + n;
+    }
+    return false;
+}
+
+// Parse a plain non-negative integer (digits only) without going through
+// a double; returns false on overflow or if there are no digits
+bool parse_u64(const char *input, uint64_t *value, char **endptr) {
+    const char *p = input;
+    uint64_t v = 0;
+
+    while (*p == ' ') p++;
+    if (!isdigit((unsigned char)*p)) {
+        return false;
+    }
+    while (isdigit((unsigned char)*p)) {
+        uint64_t digit = (uint64_t)(*p - '0');
+        if (v > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+        p++;
+    }
+    // A fraction or exponent means this is not an integer input
+    if (*p == '.' || *p == 'e' || *p == 'E') {
+        return false;
+    }
+
+    *value = v;
+    if (endptr) *endptr = (char *)p;
+    return true;
+}
+
+#define DECIMAL_MAX_DIGITS 36  // Keeps mantissas well inside 128 bits
+
+// Parse a decimal number ("-12.375", "1.5e3") as a scaled integer
+// without going through strtod
+// Returns false if there are no digits or too many significant digits
+bool parse_decimal(const char *input, Decimal *out, char **endptr) {
+    const char *p = input;
+    bool negative = false;
+    __int128 mantissa = 0;
+    int scale = 0, digits = 0;
+    bool any_digit = false;
+
+    while (*p == ' ') p++;
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+
+    for (bool fraction = false;; p++) {
+        if (isdigit((unsigned char)*p)) {
+            any_digit = true;
+            if (mantissa != 0 || *p != '0') digits++;
+            if (digits > DECIMAL_MAX_DIGITS) return false;
+            mantissa = mantissa * 10 + (*p - '0');
+            if (fraction) scale++;
+        } else if (*p == '.' && !fraction) {
+            fraction = true;
+        } else {
+            break;
+        }
+    }
+    if (!any_digit) return false;
+
+    if (*p == 'e' || *p == 'E') {
+        const char *q = p + 1;
+        bool exp_negative = false;
+        if (*q == '-' || *q == '+') {
+            exp_negative = (*q == '-');
+            q++;
+        }
+        if (isdigit((unsigned char)*q)) {
+            int exponent = 0;
+            while (isdigit((unsigned char)*q)) {
+                if (exponent < 10000) exponent = exponent * 10 + (*q - '0');
+                q++;
+            }
+            scale += exp_negative ? exponent : -exponent;
+            p = q;
+        }
+    }
+
+    // Canonical form: no trailing zeros in the mantissa
+    while (mantissa != 0 && mantissa % 10 == 0) {
+        mantissa /= 10;
+        scale--;
+    }
+    if (mantissa == 0) scale = 0;
+
+    out->mantissa = negative ? -mantissa : mantissa;
+    out->scale = scale;
+    if (endptr) *endptr = (char *)p;
+    return true;
+}
+
+// Print a decimal exactly, without float formatting
+// Returns false, leaving an empty string, if the digits and zeros the
+// scale calls for do not fit in `size`
+bool format_decimal(const Decimal *number, char *buffer, size_t size) {
+    char digits[48];
+    int n = 0;
+    unsigned __int128 magnitude = number->mantissa < 0 ?
+        -(unsigned __int128)number->mantissa : (unsigned __int128)number->mantissa;
+    do {
+        digits[n++] = (char)('0' + (int)(magnitude % 10));
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    long needed = (number->mantissa < 0) +
+                  (number->scale <= 0 ? n + (number->mantissa != 0 ? -(long)number->scale : 0)
+                   : number->scale >= n ? 2 + (long)number->scale : n + 1);
+    if (size == 0 || needed >= (long)size) {
+        if (size > 0) buffer[0] = '\0';
+        return false;
+    }
+
+    size_t len = 0;
+#define PUT(c) do { if (len + 1 < size) buffer[len++] = (c); } while (0)
+    if (number->mantissa < 0) PUT('-');
+    if (number->scale <= 0) {
+        while (n > 0) PUT(digits[--n]);
+        for (int i = 0; i < -number->scale && number->mantissa != 0; i++) PUT('0');
+    } else if (number->scale >= n) {
+        PUT('0');
+        PUT('.');
+        for (int i = 0; i < number->scale - n; i++) PUT('0');
+        while (n > 0) PUT(digits[--n]);
+    } else {
+        while (n > 0) {
+            if (n == number->scale) PUT('.');
+            PUT(digits[--n]);
+        }
+    }
+#undef PUT
+    buffer[len] = '\0';
+    return true;
+}
+
+// Recover the decimal a factor was written as in initialize_units():
+// the shortest representation that round-trips to the same double
+static bool decimal_from_factor(double factor, Decimal *out) {
+    char text[32];
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, factor);
+        if (strtod(text, NULL) == factor) {
+            return parse_decimal(text, out, NULL);
+        }
+    }
+    return false;
+}
+
+// Build the exact decimal ratio of a unit pair
+// from/to = (m1 / m2) * 10^(s2-s1); after reducing m1/m2 the ratio is a
+// terminating decimal only if the denominator is 2^a * 5^b, in which case
+// it is scaled up to a power of ten
+bool plan_decimal(const ConversionPlan *plan, DecimalPlan *dplan) {
+    const Unit *src = &units[plan->from_index];
+    const Unit *dst = &units[plan->to_index];
+    Decimal from, to;
+
+    dplan->exact = false;
+    if (src->is_temp || dst->is_temp ||
+        !decimal_from_factor(src->factor, &from) ||
+        !decimal_from_factor(dst->factor, &to) ||
+        from.mantissa > (__int128)UINT64_MAX || to.mantissa > (__int128)UINT64_MAX) {
+        return false;
+    }
+
+    uint64_t num = (uint64_t)from.mantissa, den = (uint64_t)to.mantissa;
+    uint64_t g = gcd_u64(num, den);
+    num /= g;
+    den /= g;
+
+    int twos = 0, fives = 0;
+    uint64_t rest = den;
+    while (rest % 2 == 0) { rest /= 2; twos++; }
+    while (rest % 5 == 0) { rest /= 5; fives++; }
+    if (rest != 1) {
+        return false;
+    }
+
+    // 10^k must fit in 128 bits (TB -> B style ratios need k = 40)
+    int k = twos > fives ? twos : fives;
+    if (k > DECIMAL_MAX_DIGITS) {
+        return false;
+    }
+    __int128 power = 1;
+    for (int i = 0; i < k; i++) power *= 10;
+
+    if (__builtin_mul_overflow((__int128)num, power / (__int128)den, &dplan->multiplier)) {
+        return false;
+    }
+    dplan->scale = from.scale - to.scale + k;
+    dplan->exact = true;
+    return true;
+}
+
+// Convert a decimal exactly with integer arithmetic
+// Returns false on overflow; the caller falls back to the double path
+bool convert_decimal(const DecimalPlan *dplan, const Decimal *value, Decimal *result) {
+    __int128 product;
+    if (!dplan->exact ||
+        __builtin_mul_overflow(value->mantissa, dplan->multiplier, &product)) {
+        return false;
+    }
+
+    int scale = value->scale + dplan->scale;
+    while (product != 0 && product % 10 == 0) {
+        product /= 10;
+        scale--;
+    }
+    result->mantissa = product;
+    result->scale = product == 0 ? 0 : scale;
+    return true;
+}
+
+// True if a factor is exactly a power of ten
+static bool is_decimal_power(double factor) {
+    return factor > 0 && factor == pow(10, round(log10(factor)));
+}
+
+// Add a display unit to a scale table, skipping duplicate factors
+static void add_scale_unit(ScaleTable *table, double factor, const char *symbol) {
+    if (table->count >= MAX_SCALE_UNITS) return;
+    for (int i = 0; i < table->count; i++) {
+        if (table->thresholds[i] == factor) return;
+    }
+
+    // Insertion sort by factor
+    int i = table->count++;
+    while (i > 0 && table->thresholds[i-1] > factor) {
+        table->thresholds[i] = table->thresholds[i-1];
+        strcpy(table->symbols[i], table->symbols[i-1]);
+        i--;
+    }
+    table->thresholds[i] = factor;
+    snprintf(table->symbols[i], sizeof(table->symbols[i]), "%s", symbol);
+}
+
+// Binary exponent of a double, read straight from its bits
+static int binary_exponent(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (int)((bits >> 52) & 0x7ff) - 1023;
+}
+
+static int clamp_exponent(int exponent) {
+    return exponent < -128 ? -128 : (exponent > 127 ? 127 : exponent);
+}
+
+// Build the scale table of a category
+// Candidates are the units a reader expects to see: powers of ten of the
+// base unit, powers of 1024 for storage and every time unit; the base unit
+// also gets milli/micro/nano/pico variants below 1
+static void build_scale_table(ScaleTable *table, const char *category) {
+    table->count = 0;
+    const Unit *base = NULL;
+
+    for (int i = 0; i < unit_count; i++) {
+        const Unit *unit = &units[i];
+        if (strcmp(unit->category, category) != 0 || unit->is_temp) continue;
+
+        if (unit->factor == 1.0 && base == NULL) base = unit;
+        if (strcmp(category, "Digital Storage") == 0 ||
+            strcmp(category, "Time") == 0 ||
+            is_decimal_power(unit->factor)) {
+            add_scale_unit(table, unit->factor, unit->symbol);
+        }
+    }
+
+    // Prefixes do not apply to squared symbols or fractional bytes
+    if (base != NULL && strstr(base->symbol, "²") == NULL &&
+        strcmp(category, "Digital Storage") != 0) {
+        static const char *small_prefixes[] = {"m", "µ", "n", "p"};
+        static const double small_factors[] = {1e-3, 1e-6, 1e-9, 1e-12};
+        for (int i = 0; i < 4; i++) {
+            char symbol[12];
+            snprintf(symbol, sizeof(symbol), "%s%s", small_prefixes[i], base->symbol);
+            add_scale_unit(table, small_factors[i], symbol);
+        }
+    }
+    // NaN sentinel: no comparison with it is true, not even for infinity
+    table->thresholds[table->count] = NAN;
+
+    // Largest unit whose factor is at most 2^e; at least a factor of two
+    // separates neighbouring units, so one comparison finishes the job
+    for (int e = -128; e <= 127; e++) {
+        double power = ldexp(1.0, e);
+        int index = 0;
+        while (index + 1 < table->count && table->thresholds[index + 1] <= power) {
+            index++;
+        }
+        table->by_exponent[e + 128] = (uint8_t)index;
+    }
+    table->built = true;
+}
+
+// Get the scale table of a category, building it on first use
+// Returns NULL for unknown categories and for temperatures
+const ScaleTable *get_scale_table(const char *category) {
+    for (int i = 0; i < category_count; i++) {
+        if (strcmp(categories[i], category) == 0) {
+            if (!scale_tables[i].built) {
+                metrics_count(METRIC_SCALE_CACHE_MISSES);
+                build_scale_table(&scale_tables[i], category);
+            } else {
+                metrics_count(METRIC_SCALE_CACHE_HITS);
+            }
+            return scale_tables[i].count > 0 ? &scale_tables[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Pick the display unit for a value expressed in the category base unit
+int classify_scale(const ScaleTable *table, double base_value) {
+    double magnitude = fabs(base_value);
+    int index = table->by_exponent[clamp_exponent(binary_exponent(magnitude)) + 128];
+    return index + (magnitude >= table->thresholds[index + 1]);
+}
+
+// Classify a column of base values without branches in the loop body
+void classify_scale_batch(const ScaleTable *table, const double *restrict base_values,
+                          uint8_t *restrict unit_out, size_t n) {
+    const uint8_t *by_exponent = table->by_exponent;
+    const double *thresholds = table->thresholds;
+
+    for (size_t i = 0; i < n; i++) {
+        double magnitude = fabs(base_values[i]);
+        int index = by_exponent[clamp_exponent(binary_exponent(magnitude)) + 128];
+        unit_out[i] = (uint8_t)(index + (magnitude >= thresholds[index + 1]));
+    }
+}
+
+// Format a base value in the chosen display unit with three significant
+// figures, e.g. "1.46 MB" or "420 µs"
+void format_scaled(const ScaleTable *table, int unit, double base_value,
+                   char *buffer, size_t size) {
+    double scaled = base_value / table->thresholds[unit];
+    if (fabs(scaled) >= 1e15) {
+        // Far past the largest unit: scientific notation, so the unit
+        // always fits
+        snprintf(buffer, size, "%.3e %s", scaled, table->symbols[unit]);
+    } else if (fabs(scaled) >= 1000) {
+        // Only past the largest unit; keep every integer digit
+        snprintf(buffer, size, "%.0f %s", scaled, table->symbols[unit]);
+    } else {
+        snprintf(buffer, size, "%.3g %s", scaled, table->symbols[unit]);
+    }
+}
+
+// Sidecar of the history file holding the values and results of batch
+// records, as native-endian (value, result) double pairs
+static void history_blob_path(char *path, size_t size) {
+    snprintf(path, size, "%s.blob", history_path);
+}
+
+// flock() that retries on EINTR; no locking where flock is missing
+static bool history_flock(int fd, int operation) {
+#ifndef _WIN32
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) return false;
+    }
+#else
+    (void)fd;
+    (void)operation;
+#endif
+    return true;
+}
+
+// Open the history file with `flags` and a lock held. Compaction and
+// rewrites rename a new file over the path, so once locked the descriptor
+// must still be the file the path names; otherwise the lock is taken
+// again on the new file
+static int history_open_with_lock(int flags, int operation) {
+    for (;;) {
+        int fd = open(history_path, flags, 0644);
+        if (fd < 0) return -1;
+        if (!history_flock(fd, operation)) {
+            close(fd);
+            return -1;
+        }
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(history_path, &current) == 0 &&
+            opened.st_ino == current.st_ino && opened.st_dev == current.st_dev) {
+            return fd;
+        }
+        close(fd);  // Replaced while we waited; closing drops the lock
+    }
+}
+
+// Open the history file for writing with a lock held, creating it:
+// shared for appends, exclusive for compaction and rewrites
+static int history_open_locked(int operation) {
+    return history_open_with_lock(O_RDWR | O_APPEND | O_CREAT, operation);
+}
+
+// Open the history file read-only under the shared lock, for readers
+// Never creates the file; -1 (errno ENOENT) if there is none
+static int history_open_shared(void) {
+    return history_open_with_lock(O_RDONLY, LOCK_SH);
+}
+
+// Release a lock taken by history_open_locked()
+static void history_unlock(int fd) {
+    history_flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Write all of `data`, retrying short writes
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Append `count` value/result pairs to the blob; called with the shared
+// history lock held, so appenders serialize on the blob's own lock
+// Returns the byte offset they start at, or -1 if the blob is not writable
+static long long history_blob_append(const double *values, const double *results,
+                                     size_t count) {
+    char path[1024];
+    double pairs[2 * 256];
+    struct stat info;
+    history_blob_path(path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    if (!history_flock(fd, LOCK_EX) || fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    long long offset = (long long)info.st_size;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count;) {
+        size_t n = 0;
+        for (; n < 256 && i < count; n++, i++) {
+            pairs[2 * n] = values[i];
+            pairs[2 * n + 1] = results[i];
+        }
+        ok = write_all(fd, pairs, 2 * n * sizeof(double));
+    }
+    if (!ok && ftruncate(fd, (off_t)offset) != 0) offset = -1;
+    history_unlock(fd);
+    return ok ? offset : -1;
+}
+
+// Read the values and results of a batch record into arrays of
+// entry->count doubles; false if the blob no longer holds them
+// The shared lock keeps a compaction from moving them meanwhile
+bool history_blob_read(const ConversionEntry *entry, double *values, double *results) {
+    char path[1024];
+    double pairs[2 * 256];
+    history_blob_path(path, sizeof(path));
+    int lock = history_open_shared();
+    FILE *blob = fopen(path, "rb");
+    bool ok = blob != NULL && fseek(blob, (long)entry->blob_offset, SEEK_SET) == 0;
+    for (long i = 0; ok && i < entry->count;) {
+        size_t want = entry->count - i < 256 ? (size_t)(entry->count - i) : 256;
+        ok = fread(pairs, 2 * sizeof(double), want, blob) == want;
+        for (size_t k = 0; ok && k < want; k++, i++) {
+            values[i] = pairs[2 * k];
+            results[i] = pairs[2 * k + 1];
+        }
+    }
+    if (blob) fclose(blob);
+    if (lock >= 0) history_unlock(lock);
+    return ok;
+}
+
+// Format `entry` as one fixed-size record: the CSV line padded with
+// spaces to HISTORY_RECORD_SIZE bytes including the newline (the longest
+// line is 126 bytes), so every record is a single write()
+static void format_history_record(const ConversionEntry *entry, char *record) {
+    int n = snprintf(record, HISTORY_RECORD_SIZE, "%s,%s,%.8g,%.8g,%ld", entry->from,
+                     entry->to, entry->value, entry->result, (long)entry->timestamp);
+    // Batch records add their count and blob offset
+    if (entry->count > 1) {
+        n += snprintf(record + n, HISTORY_RECORD_SIZE - n, ",%ld,%lld", entry->count,
+                      entry->blob_offset);
+    }
+    memset(record + n, ' ', HISTORY_RECORD_SIZE - 1 - n);
+    record[HISTORY_RECORD_SIZE - 1] = '\n';
+}
+
+// Parse one history line, fixed-size or from before records were padded
+static bool parse_history_record(const char *line, ConversionEntry *entry) {
+    char from[16], to[16];
+    double value, result;
+    long timestamp, count = 1;
+    long long blob_offset = 0;
+
+    int fields = sscanf(line, "%15[^,],%15[^,],%lf,%lf,%ld,%ld,%lld",
+                        from, to, &value, &result, &timestamp, &count, &blob_offset);
+    if (fields != 5 && (fields != 7 || count < 2 || blob_offset < 0)) return false;
+    snprintf(entry->from, sizeof(entry->from), "%s", from);
+    snprintf(entry->to, sizeof(entry->to), "%s", to);
+    entry->value = value;
+    entry->result = result;
+    entry->timestamp = (time_t)timestamp;
+    entry->count = fields == 7 ? count : 1;
+    entry->blob_offset = fields == 7 ? blob_offset : 0;
+    return true;
+}
+
+// Read every record of a history file in file order
+static ConversionEntry *read_history_records(FILE *file, Arena *arena, size_t *count) {
+    size_t capacity = 256;
+    ConversionEntry *records = arena_alloc(arena, capacity * sizeof(ConversionEntry));
+    Arena line_arena = {0};
+    char *line;
+
+    *count = 0;
+    while ((line = arena_read_line(&line_arena, file)) != NULL) {
+        if (*count == capacity) {
+            records = arena_grow(arena, records, capacity * sizeof(ConversionEntry),
+                                 capacity * 2 * sizeof(ConversionEntry));
+            capacity *= 2;
+        }
+        if (parse_history_record(line, &records[*count])) (*count)++;
+        arena_reset(&line_arena);
+    }
+    arena_free(&line_arena);
+    return records;
+}
+
+// Order records by timestamp, equal ones in file order, so the appends of
+// concurrent instances are merged by time. Returns the index of the first
+// of the newest MAX_HISTORY
+// Insertion sort: appends arrive almost in order
+static size_t merge_history_records(ConversionEntry *records, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        ConversionEntry entry = records[i];
+        size_t j = i;
+        for (; j > 0 && records[j-1].timestamp > entry.timestamp; j--) records[j] = records[j-1];
+        records[j] = entry;
+    }
+    return count > MAX_HISTORY ? count - MAX_HISTORY : 0;
+}
+
+// Write `records` to the temporary file `temp`; removed again on failure
+static bool write_history_temp(const ConversionEntry *records, size_t count, const char *temp) {
+    char record[HISTORY_RECORD_SIZE];
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        format_history_record(&records[i], record);
+        ok = write_all(fd, record, sizeof(record));
+    }
+    if (close(fd) != 0 || !ok) {
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+// Replace the history file with `records`; called with the exclusive lock
+// held. The new file is renamed over the old one, so a reader sees one or
+// the other, never a partial file
+static bool write_history_file(const ConversionEntry *records, size_t count) {
+    char temp[1040];
+    snprintf(temp, sizeof(temp), "%s.tmp", history_path);
+    if (!write_history_temp(records, count, temp)) return false;
+    if (rename(temp, history_path) != 0) {
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+// Write a new blob holding only the batches of `records` to `temp` once
+// dead batches make up most of the old one, and point the records'
+// offsets into it; called with the exclusive lock held. The caller
+// renames it into place together with the history file
+// Returns true if `temp` was written; otherwise the records are unchanged
+static bool compact_history_blob(ConversionEntry *records, size_t count, const char *temp) {
+    char path[1024];
+    long long live = 0, size = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].count > 1) live += records[i].count * 2 * (long long)sizeof(double);
+    }
+    history_blob_path(path, sizeof(path));
+    FILE *blob = fopen(path, "rb");
+    if (blob == NULL) return false;
+    if (fseek(blob, 0, SEEK_END) == 0) size = ftell(blob);
+    if (size <= 2 * live + HISTORY_BLOB_SLACK) {
+        fclose(blob);
+        return false;
+    }
+
+    FILE *out = fopen(temp, "wb");
+    if (out == NULL) {
+        fclose(blob);
+        return false;
+    }
+    long long offsets[MAX_HISTORY], written = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        if (records[i].count <= 1) continue;
+        char buffer[4096];
+        long long remaining = records[i].count * 2 * (long long)sizeof(double);
+        offsets[i] = written;
+        ok = fseek(blob, (long)records[i].blob_offset, SEEK_SET) == 0;
+        while (ok && remaining > 0) {
+            size_t n = remaining < (long long)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+            ok = fread(buffer, 1, n, blob) == n && fwrite(buffer, 1, n, out) == n;
+            remaining -= (long long)n;
+            written += (long long)n;
+        }
+    }
+    fclose(blob);
+    if (fclose(out) != 0 || !ok) {
+        remove(temp);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].count > 1) records[i].blob_offset = offsets[i];
+    }
+    return true;
+}
+
+// Put a compacted history file and blob in place under the exclusive
+// lock: the blob first, then the history file whose offsets point into
+// it. The old blob stays linked as a backup until the history file is
+// renamed, so a failure at any step leaves the old pair in place
+static bool replace_history_and_blob(const char *history_temp, const char *blob_temp) {
+    char path[1024], backup[1040];
+    history_blob_path(path, sizeof(path));
+    snprintf(backup, sizeof(backup), "%s.old", path);
+    remove(backup);
+    bool ok = link(path, backup) == 0 && rename(blob_temp, path) == 0;
+    if (ok && rename(history_temp, history_path) != 0) {
+        rename(backup, path);
+        ok = false;
+    }
+    remove(backup);
+    if (!ok) {
+        remove(history_temp);
+        remove(blob_temp);
+    }
+    return ok;
+}
+
+// Compaction: under the exclusive lock, merge the records in timestamp
+// order and rewrite the file with the newest MAX_HISTORY (and the blob
+// with their batches). In-memory history is replaced by the merged view
+static void compact_history() {
+    int fd = history_open_locked(LOCK_EX);
+    if (fd < 0) return;
+
+    // Another instance may have compacted while we waited for the lock
+    struct stat info;
+    FILE *file = NULL;
+    if (fstat(fd, &info) != 0 || info.st_size < HISTORY_COMPACT_RECORDS * HISTORY_RECORD_SIZE ||
+        (file = fopen(history_path, "r")) == NULL) {
+        history_unlock(fd);
+        return;
+    }
+    Arena arena = {0};
+    size_t count;
+    ConversionEntry *records = read_history_records(file, &arena, &count);
+    fclose(file);
+    size_t first = merge_history_records(records, count);
+
+    // Both files are written in full before either replaces its original
+    char history_temp[1040], blob_temp[1040];
+    snprintf(history_temp, sizeof(history_temp), "%s.tmp", history_path);
+    snprintf(blob_temp, sizeof(blob_temp), "%s.blob.tmp", history_path);
+    bool blob_written = compact_history_blob(records + first, count - first, blob_temp);
+    bool ok = write_history_temp(records + first, count - first, history_temp);
+    if (!ok && blob_written) remove(blob_temp);
+    if (ok) {
+        ok = blob_written ? replace_history_and_blob(history_temp, blob_temp)
+                          : rename(history_temp, history_path) == 0;
+    }
+    if (!ok) remove(history_temp);
+    if (ok) {
+        history_count = (int)(count - first);
+        memcpy(history, records + first, history_count * sizeof(ConversionEntry));
+        if (history_stress) {
+            atomic_fetch_add(&history_stress->dropped, first);
+            atomic_fetch_add(&history_stress->compactions, 1);
+        }
+    }
+    arena_free(&arena);
+    history_unlock(fd);
+}
+
+// Append one record to the history file: a single O_APPEND write of a
+// fixed-size record under the shared lock, so concurrent instances never
+// overwrite each other. A batch's values go to the blob under the same
+// lock, so no compaction can run between the two appends
+// Sets *compact once the file has grown enough to need compaction
+static bool append_history_record(ConversionEntry *entry, const double *values,
+                                  const double *results, bool *compact) {
+    char record[HISTORY_RECORD_SIZE];
+    struct stat info;
+    int fd = history_open_locked(LOCK_SH);
+    if (fd < 0) return false;
+    if (entry->count > 1) {
+        entry->blob_offset = history_blob_append(values, results, (size_t)entry->count);
+        if (entry->blob_offset < 0) {
+            history_unlock(fd);
+            return false;
+        }
+    }
+    format_history_record(entry, record);
+    bool ok = write(fd, record, sizeof(record)) == (ssize_t)sizeof(record);
+    *compact = fstat(fd, &info) == 0 &&
+               info.st_size >= HISTORY_COMPACT_RECORDS * HISTORY_RECORD_SIZE;
+    history_unlock(fd);
+
+    if (ok && history_stress) atomic_fetch_add(&history_stress->appended, 1);
+    return ok;
+}
+
+// Add a record to history: appended to the file, and kept in memory with
+// the oldest evicted when full
+// Returns false if it could not be saved; a failed batch is not kept
+static bool add_history_record(ConversionEntry *entry, const double *values,
+                               const double *results) {
+    bool compact = false;
+    ensure_history_loaded();
+    uint64_t trace_start = trace_begin();
+    bool saved = append_history_record(entry, values, results, &compact);
+    trace_end(STAGE_SAVE_HISTORY, trace_start);
+    if (!saved && entry->count > 1) return false;
+    if (!saved) print_error("Could not save history");
+
+    if (history_count == MAX_HISTORY) {
+        memmove(history, history + 1, (MAX_HISTORY - 1) * sizeof(ConversionEntry));
+        history_count--;
+    }
+    history[history_count++] = *entry;
+    metrics_history_depth(history_count, saved ? 0 : 1);
+    if (compact) compact_history();
+    return saved;
+}
+
+// Fill a history entry stamped with the current time
+static void history_entry_init(ConversionEntry *entry, const char *from, const char *to,
+                               double val, double res, long count) {
+    snprintf(entry->from, sizeof(entry->from), "%s", from);
+    snprintf(entry->to, sizeof(entry->to), "%s", to);
+    entry->value = val;
+    entry->result = res;
+    entry->timestamp = time(NULL);
+    entry->count = count;
+    entry->blob_offset = 0;
+}
+
+// Add conversion to history
+void add_history_entry(const char *from, const char *to, double val, double res) {
+    ConversionEntry entry;
+    history_entry_init(&entry, from, to, val, res, 1);
+    add_history_record(&entry, NULL, NULL);
+}
+
+// Add a whole batch to history as one record: the unit pair, time, count
+// and first value/result in the history file, every pair in the blob
+// Falls back to one entry per value if the blob cannot be written
+void add_history_batch(const char *from, const char *to, const double *values,
+                       const double *results, size_t count) {
+    ConversionEntry entry;
+    if (count == 0) return;
+    history_entry_init(&entry, from, to, values[0], results[0], (long)count);
+    if (count == 1 || !add_history_record(&entry, values, results)) {
+        for (size_t i = 0; i < count; i++) add_history_entry(from, to, values[i], results[i]);
+    }
+}
+
+// Print every value of batch record `entry`
+static void show_history_batch(const ConversionEntry *entry) {
+    Arena *arena = scratch_arena();
+    double *values = arena_alloc(arena, entry->count * sizeof(double));
+    double *results = arena_alloc(arena, entry->count * sizeof(double));
+    if (!history_blob_read(entry, values, results)) {
+        print_error("The values of this batch are no longer available");
+    } else {
+        printf("\n%ld values, %s -> %s:\n", entry->count, entry->from, entry->to);
+        for (long i = 0; i < entry->count; i++) {
+            printf("%.8g %s = %.8g %s\n", values[i], entry->from, results[i], entry->to);
+        }
+    }
+    arena_reset(arena);
+}
+
+// Save conversion history to file, replacing its content (used to clear
+// it; additions are appended instead). The blob goes with the last batch
+void save_history() {
+    uint64_t trace_start = trace_begin();
+    int fd = history_open_locked(LOCK_EX);
+    if (fd < 0 || !write_history_file(history, history_count)) {
+        print_error("Could not save history");
+    } else {
+        bool has_batches = false;
+        for (int i = 0; i < history_count; i++) has_batches |= history[i].count > 1;
+        if (!has_batches) {
+            char blob_path[1024];
+            history_blob_path(blob_path, sizeof(blob_path));
+            remove(blob_path);
+        }
+    }
+    if (fd >= 0) history_unlock(fd);
+    metrics_history_depth(history_count, 0);
+    trace_end(STAGE_SAVE_HISTORY, trace_start);
+}
+
+// Load conversion history from file
+// Records of all instances are merged by timestamp; the newest
+// MAX_HISTORY are kept
+void load_history() {
+    FILE *file = fopen(history_path, "r");
+    if (file == NULL) {
+        return; // No history file exists yet
+    }
+    
+    Arena arena = {0};
+    size_t count;
+    ConversionEntry *records = read_history_records(file, &arena, &count);
+    fclose(file);
+    size_t first = merge_history_records(records, count);
+    history_count = (int)(count - first);
+    memcpy(history, records + first, history_count * sizeof(ConversionEntry));
+    arena_free(&arena);
+    metrics_history_depth(history_count, 0);
+}
+
+// Load history the first time something needs it
+// Startup and one-shot conversions never touch the history file
+void ensure_history_loaded() {
+    if (!history_loaded) {
+        history_loaded = true;
+        load_history();
+    }
+}
+
+// Reload history from the file, picking up records of other instances
+static void refresh_history() {
+    history_loaded = true;
+    history_count = 0;
+    load_history();
+}
+
+// Show conversion history
+void show_history() {
+    refresh_history();
+    clear_screen();
+    print_header("Conversion History");
+    
+    if (history_count == 0) {
+        print_error("No conversion history available!");
+    } else {
+        printf("%-5s %-15s %-15s %-15s %-15s %-20s\n", 
+               "No.", "From", "To", "Value", "Result", "Time");
+        printf("----------------------------------------------------------------\n");
+        
+        bool has_batches = false;
+        for (int i = 0; i < history_count; i++) {
+            char time_str[32];
+            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", 
+                    localtime(&history[i].timestamp));
+            
+            // Batch records show their size; option 4 expands them
+            char value_str[32], result_str[32];
+            if (history[i].count > 1) {
+                snprintf(value_str, sizeof(value_str), "%ld values", history[i].count);
+                snprintf(result_str, sizeof(result_str), "(batch)");
+                has_batches = true;
+            } else {
+                format_number(history[i].value, value_str, sizeof(value_str));
+                format_number(history[i].result, result_str, sizeof(result_str));
+            }
+            
+            printf("%-5d %-15s %-15s %-15s %-15s %-20s\n",
+                   i+1,
+                   history[i].from,
+                   history[i].to,
+                   value_str,
+                   result_str,
+                   time_str);
+        }
+        
+        printf("\nOptions:\n");
+        printf("1. Clear history\n");
+        printf("2. Export to CSV\n");
+        printf("3. Return to menu\n");
+        if (has_batches) printf("4. Show the values of a batch\n");
+        printf("\nEnter your choice: ");
+        
+        char choice[16];
+        fgets(choice, sizeof(choice), stdin);
+        
+        switch (choice[0]) {
+            case '1':
+                history_count = 0;
+                save_history();
+                print_success("History cleared!");
+                break;
+            case '2':
+                if (has_batches) {
+                    printf("Expand batches into one row per value? (y/n): ");
+                    fgets(choice, sizeof(choice), stdin);
+                }
+                export_history_to_csv(has_batches && (choice[0] == 'y' || choice[0] == 'Y'));
+                break;
+            case '3':
+                return;
+            case '4': {
+                if (!has_batches) {
+                    print_error("Invalid choice!");
+                    break;
+                }
+                printf("Batch number: ");
+                fgets(choice, sizeof(choice), stdin);
+                int number = atoi(choice);
+                if (number < 1 || number > history_count || history[number-1].count <= 1) {
+                    print_error("Not a batch record!");
+                } else {
+                    show_history_batch(&history[number-1]);
+                }
+                break;
+            }
+            default:
+                print_error("Invalid choice!");
+        }
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Show category menu
+void show_category_menu(const char *category) {
+    clear_screen();
+    print_header(category);
+    
+    printf("Available units:\n\n");
+    printf("%-15s %-10s %-40s\n", "Unit", "Symbol", "Description");
+    printf("----------------------------------------------------------------\n");
+    
+    for (int i = 0; i < unit_count; i++) {
+        if (strcmp(units[i].category, category) == 0) {
+            printf("%-15s %-10s %-40s\n", 
+                   units[i].name, 
+                   units[i].symbol,
+                   unit_description(&units[i]));
+        }
+    }
+    
+    printf("\n");
+}
+
+// Handle the conversion process for a given category
+// Supports unit prefixes and validates input
+void handle_conversion(const char *category) {
+    show_category_menu(category);
+    
+    char input[32], from_unit[16], to_unit[16];
+    double value;
+    int attempts = 0;
+    
+    // Get value and unit together
+    while (attempts < 3) {
+        printf("\nEnter value and unit: ");
+        if (fgets(input, sizeof(input), stdin)) {
+            input[strcspn(input, "\n")] = '\0';
+            
+            value = parse_value_with_prefix(input, from_unit);
+            normalize_unit_name(from_unit);
+            
+            if (unit_exists(from_unit, category)) {
+                break;
+            }
+            metrics_count(METRIC_INVALID_UNIT_ERRORS);
+            print_error("Invalid unit! Please try again.");
+        }
+        attempts++;
+    }
+    
+    if (attempts >= 3) {
+        print_error("Too many failed attempts. Returning to menu.");
+        return;
+    }
+    
+    // Get target unit
+    attempts = 0;
+    bool valid_unit = false;
+    while (!valid_unit && attempts < 3) {
+        printf("Convert to: ");
+        get_clean_input(to_unit, sizeof(to_unit));
+        
+        if (unit_exists(to_unit, category)) {
+            valid_unit = true;
+        } else {
+            metrics_count(METRIC_INVALID_UNIT_ERRORS);
+            print_error("Invalid unit! Please try again.");
+            attempts++;
+        }
+    }
+    
+    if (!valid_unit) {
+        print_error("Too many failed attempts. Returning to menu.");
+        return;
+    }
+    
+    // Perform conversion
+    double result = convert_value(value, from_unit, to_unit);
+    
+    // Format numbers for display
+    char value_str[32], result_str[128];
+    format_number(value, value_str, sizeof(value_str));
+    format_number(result, result_str, sizeof(result_str));
+    
+    // Integer byte counts are converted exactly instead of through a double
+    ConversionPlan plan;
+    IntegerPlan integer_plan;
+    uint64_t integer_value;
+    if (plan_conversion(from_unit, to_unit, &plan) &&
+        plan_integer(&plan, &integer_plan) &&
+        parse_u64(input, &integer_value, NULL)) {
+        unsigned __int128 quotient;
+        uint64_t remainder;
+        convert_integer(&integer_plan, integer_value, &quotient, &remainder);
+        format_integer_result(&integer_plan, quotient, remainder, ROUND_EXACT,
+                              result_str, sizeof(result_str));
+        snprintf(value_str, sizeof(value_str), "%llu", (unsigned long long)integer_value);
+    }
+    
+    // Display result
+    printf("\nResult: %s %s = %s %s\n\n", value_str, from_unit, result_str, to_unit);
+    
+    // Add to history
+    add_history_entry(from_unit, to_unit, value, result);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Batch conversion mode
+void batch_conversion() {
+    clear_screen();
+    print_header("Batch Conversion Mode");
+    
+    char from_unit[16], to_unit[16];
+    Arena *arena = scratch_arena();
+    size_t capacity = 128;
+    double *values = arena_alloc(arena, capacity * sizeof(double));
+    size_t value_count = 0;
+    
+    printf("Enter values to convert (one per line, empty line to finish):\n");
+    
+    char *input;
+    while ((input = arena_read_line(arena, stdin)) != NULL) {
+        if (strlen(input) == 0) break;
+        
+        char *endptr;
+        double value = strtod(input, &endptr);
+        if (endptr == input || *endptr != '\0') {
+            print_error("Invalid number! Skipping...");
+            continue;
+        }
+        
+        if (value_count == capacity) {
+            values = arena_grow(arena, values, capacity * sizeof(double),
+                                capacity * 2 * sizeof(double));
+            capacity *= 2;
+        }
+        values[value_count++] = value;
+    }
+    
+    if (value_count == 0) {
+        print_error("No values entered!");
+        arena_reset(arena);
+        return;
+    }
+    
+    // Get units
+    printf("\nConvert from: ");
+    get_clean_input(from_unit, sizeof(from_unit));
+    
+    printf("Convert to: ");
+    get_clean_input(to_unit, sizeof(to_unit));
+    
+    // Perform conversions
+    // The whole batch becomes one history record
+    printf("\nResults:\n");
+    double *results = arena_alloc(arena, value_count * sizeof(double));
+    for (size_t i = 0; i < value_count; i++) {
+        results[i] = convert_value(values[i], from_unit, to_unit);
+        printf("%.8g %s = %.8g %s\n", values[i], from_unit, results[i], to_unit);
+    }
+    add_history_batch(from_unit, to_unit, values, results, value_count);
+    arena_reset(arena);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Show main menu
+void show_main_menu() {
+    clear_screen();
+    print_header("Ultimate Unit Converter");
+    
+    printf("Select a category:\n\n");
+    
+    for (int i = 0; i < category_count; i++) {
+        printf("%2d. %s\n", i+1, categories[i]);
+    }
+    
+    printf("\n");
+    printf("%2d. History\n", category_count+1);
+    printf("%2d. Help\n", category_count+2);
+    printf("%2d. Quit\n\n", category_count+3);
+    
+    printf("Enter your choice: ");
+}
+
+// Add new function to show unit information
+void show_unit_info(const char *unit) {
+    for (int i = 0; i < unit_count; i++) {
+        if (strcmp(units[i].name, unit) == 0 || strcmp(units[i].symbol, unit) == 0) {
+            printf("\nUnit Information:\n");
+            printf("Name: %s\n", units[i].name);
+            printf("Symbol: %s\n", units[i].symbol);
+            printf("Category: %s\n", units[i].category);
+            printf("Description: %s\n", unit_description(&units[i]));
+            if (units[i].alias_count > 0) {
+                printf("Aliases: ");
+                for (int j = 0; j < units[i].alias_count; j++) {
+                    printf("%s%s", units[i].aliases[j],
+                           j < units[i].alias_count-1 ? ", " : "");
+                }
+                printf("\n");
+            }
+            return;
+        }
+    }
+    print_error("Unit not found");
+}
+
+// Add function to format numbers nicely
+void format_number(double num, char *buffer, size_t size) {
+    uint64_t trace_start = trace_begin();
+    if (num == 0) {
+        snprintf(buffer, size, "0");
+        trace_end(STAGE_FORMAT_NUMBER, trace_start);
+        return;
+    }
+
+    // Count the number of digits
+    int digits = (int)ceil(log10(fabs(num) + 1));
+    
+    if (digits > 6) {
+        // Get the exponent
+        int exponent = (int)floor(log10(fabs(num)));
+        
+        // Calculate the mantissa
+        double mantissa = num / pow(10, exponent);
+        
+        // Format the number as x × 10^n
+        snprintf(buffer, size, "%.2f × 10^%d", mantissa, exponent);
+    } else {
+        // Use normal decimal format for smaller numbers
+        snprintf(buffer, size, "%.6g", num);
+    }
+    trace_end(STAGE_FORMAT_NUMBER, trace_start);
+}
+
+// Add function to show help
+void show_help() {
+    clear_screen();
+    print_header("Help");
+    
+    printf("Features:\n");
+    printf("1. Multiple unit categories\n");
+    printf("2. Quick conversion mode\n");
+    printf("3. Conversion history\n");
+    printf("4. Unit information display\n");
+    printf("5. Scientific notation for large/small numbers\n");
+    printf("6. Unit aliases support\n");
+    printf("7. Temperature conversion\n");
+    printf("8. Batch conversion mode\n");
+    
+    printf("\nTips:\n");
+    printf("- Use unit symbols (e.g., 'km' for kilometer)\n");
+    printf("- View unit info to learn more about each unit\n");
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Add function to export history to CSV
+// Batch records are one row with their count and empty value/result,
+// or with `expand_batches` one row per value read from the blob
+void export_history_to_csv(bool expand_batches) {
+    refresh_history();
+    FILE *file = fopen("conversion_history.csv", "w");
+    if (file == NULL) {
+        print_error("Could not create CSV file!");
+        return;
+    }
+    
+    // Write header
+    fprintf(file, "From,To,Value,Result,Timestamp,Count\n");
+    
+    // Write data
+    Arena *arena = scratch_arena();
+    for (int i = 0; i < history_count; i++) {
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", 
+                localtime(&history[i].timestamp));
+        
+        if (history[i].count > 1) {
+            double *values = NULL, *results = NULL;
+            if (expand_batches) {
+                values = arena_alloc(arena, history[i].count * sizeof(double));
+                results = arena_alloc(arena, history[i].count * sizeof(double));
+            }
+            if (values && history_blob_read(&history[i], values, results)) {
+                for (long k = 0; k < history[i].count; k++) {
+                    fprintf(file, "%s,%s,%.8g,%.8g,%s,1\n", history[i].from, history[i].to,
+                            values[k], results[k], time_str);
+                }
+            } else {
+                fprintf(file, "%s,%s,,,%s,%ld\n", history[i].from, history[i].to,
+                        time_str, history[i].count);
+            }
+            arena_reset(arena);
+            continue;
+        }
+        fprintf(file, "%s,%s,%.8g,%.8g,%s,1\n",
+                history[i].from,
+                history[i].to,
+                history[i].value,
+                history[i].result,
+                time_str);
+    }
+    
+    fclose(file);
+    print_success("History exported to conversion_history.csv");
+}
+
+// History stress benchmark: `writers` processes each add `records`
+// entries (every tenth a batch of 4) to one temporary history file, with
+// compaction running as it fills up. Afterwards every line must be a
+// whole fixed-size record, and appended = dropped by compaction + left in
+// the file, i.e. no append was lost to a concurrent rewrite
+int run_history_stress(int writers, long records) {
+#ifndef _WIN32
+    char path[] = "/tmp/converter-history-XXXXXX";
+    int temp_fd = mkstemp(path);
+    if (temp_fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(temp_fd);
+    if (writers < 1) writers = 1;
+    if (writers > MAX_STRESS_WRITERS) writers = MAX_STRESS_WRITERS;
+    if (records < 1) records = 1;
+
+    HistoryStress *stress = mmap(NULL, sizeof(HistoryStress), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stress == MAP_FAILED) {
+        perror("mmap");
+        remove(path);
+        return 1;
+    }
+    memset(stress, 0, sizeof(*stress));
+    history_path = path;
+    history_stress = stress;
+    fflush(stdout);
+
+    double start = now_seconds();
+    pid_t pids[MAX_STRESS_WRITERS];
+    int started = 0;
+    for (int w = 0; w < writers; w++) {
+        pids[w] = fork();
+        if (pids[w] == 0) {
+            history_loaded = true;
+            history_count = 0;
+            for (long i = 0; i < records; i++) {
+                double value = w * 1e7 + i;
+                if (i % 10 == 9) {
+                    double values[4], results[4];
+                    for (int k = 0; k < 4; k++) {
+                        values[k] = value + k;
+                        results[k] = values[k] * 1000;
+                    }
+                    add_history_batch("km", "m", values, results, 4);
+                } else {
+                    add_history_entry("km", "m", value, value * 1000);
+                }
+            }
+            _exit(0);
+        }
+        if (pids[w] < 0) {
+            perror("fork");
+            break;
+        }
+        started++;
+    }
+    bool ok = started == writers;
+    for (int w = 0; w < started; w++) {
+        int status;
+        if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ok = false;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    // Every line must be a whole record, and batches must read back
+    long lines = 0, torn = 0, bad_batches = 0;
+    FILE *file = fopen(path, "r");
+    Arena arena = {0};
+    char *line;
+    while (file && (line = arena_read_line(&arena, file)) != NULL) {
+        ConversionEntry entry;
+        lines++;
+        if (strlen(line) != HISTORY_RECORD_SIZE - 1 || !parse_history_record(line, &entry)) {
+            torn++;
+        } else if (entry.count > 1) {
+            double values[4], results[4];
+            bool intact = entry.count == 4 && history_blob_read(&entry, values, results);
+            for (int k = 0; intact && k < 4; k++) {
+                intact = values[k] == values[0] + k && results[k] == values[k] * 1000;
+            }
+            if (!intact) bad_batches++;
+        }
+        arena_reset(&arena);
+    }
+    if (file) fclose(file);
+    arena_free(&arena);
+
+    uint64_t appended = atomic_load(&stress->appended), dropped = atomic_load(&stress->dropped);
+    uint64_t expected = (uint64_t)writers * (uint64_t)records;
+    bool accounted = appended == expected && dropped + (uint64_t)lines == appended;
+    ok = ok && accounted && torn == 0 && bad_batches == 0;
+
+    printf("History stress: %d writers x %ld records, %llu appends in %.3f s (%.0f appends/s)\n",
+           writers, records, (unsigned long long)appended, elapsed,
+           elapsed > 0 ? appended / elapsed : 0.0);
+    printf("  compactions: %llu, records dropped by compaction: %llu, records in file: %ld\n",
+           (unsigned long long)atomic_load(&stress->compactions),
+           (unsigned long long)dropped, lines);
+    printf("  torn records: %ld, unreadable batches: %ld, appends accounted for: %s\n",
+           torn, bad_batches, accounted ? "all" : "NO");
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    char extra[1040];
+    history_blob_path(extra, sizeof(extra));
+    remove(extra);
+    remove(path);
+    history_stress = NULL;
+    munmap(stress, sizeof(HistoryStress));
+    return ok ? 0 : 1;
+#else
+    (void)writers;
+    (void)records;
+    fprintf(stderr, "Error: --history-stress is not supported on this platform\n");
+    return 1;
+#endif
+}
+
+// Print command line usage
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s                               interactive mode\n", program);
+    fprintf(stderr, "  %s VALUE FROM TO                 convert one value\n", program);
+    fprintf(stderr, "  %s --batch FROM TO [options]     convert values from stdin\n", program);
+    fprintf(stderr, "  %s --batch FROM auto             pick the most readable unit per value\n", program);
+    fprintf(stderr, "  %s --verify [--seed N] [--count N]\n", program);
+    fprintf(stderr, "                                    differential test of all conversion paths\n");
+    fprintf(stderr, "  %s --bench [--count N]            benchmark the hot paths\n", program);
+    fprintf(stderr, "  %s --history-stress N [--records M]\n", program);
+    fprintf(stderr, "                                    N processes appending to one history\n");
+    fprintf(stderr, "  %s --emit-cpp DIR                 write C++ quantity types for the catalogue\n", program);
+    fprintf(stderr, "  %s --pack FILE NAME:UNIT...       store delimited stdin in a unit-tagged container\n", program);
+    fprintf(stderr, "  %s --unpack FILE [NAME[:UNIT]...] print container columns, converted on read\n", program);
+    fprintf(stderr, "  %s --emit-hot-pairs FILE FROM:TO...\n", program);
+    fprintf(stderr, "                                    generate kernels for hot pairs (hot_pairs.h)\n");
+    fprintf(stderr, "  %s --replay [FILE] [--tolerance X] [--threads N] [--pin POLICY]\n", program);
+    fprintf(stderr, "                                    re-run history against the catalogue\n");
+    fprintf(stderr, "  %s --annotate si|imperial [--replace] [--latency|--throughput|--deadline MS] [--stats] [--follow FILE]\n", program);
+    fprintf(stderr, "                                    convert quantities found in text on stdin\n");
+    fprintf(stderr, "\nAny mode may be preceded by --startup-profile to time startup phases,\n");
+    fprintf(stderr, "by --trace FILE to write a Chrome/Perfetto trace of the pipeline,\n");
+    fprintf(stderr, "and by --metrics-file FILE or --metrics-socket PATH for Prometheus metrics.\n");
+    fprintf(stderr, "\nBatch options:\n");
+    fprintf(stderr, "  --f32      use the single-precision kernel\n");
+    fprintf(stderr, "  --binary   read and write raw native-endian doubles (floats with --f32)\n");
+    fprintf(stderr, "  --decimal  exact fixed-point conversion when the factor ratio is decimal\n");
+    fprintf(stderr, "  --column N convert field N of delimited lines, pass the rest through\n");
+    fprintf(stderr, "  --delimiter C\n");
+    fprintf(stderr, "             field delimiter for --column (default ',')\n");
+    fprintf(stderr, "  --where EXPR\n");
+    fprintf(stderr, "             keep only rows where EXPR is true, e.g. '$2 > 700'\n");
+    fprintf(stderr, "  --derive EXPR\n");
+    fprintf(stderr, "             append a field computed by EXPR (repeatable)\n");
+    fprintf(stderr, "  --window N|DURATION [--slide N|DURATION] [--time-column N] [--group-column N]\n");
+    fprintf(stderr, "             emit count, mean, min and max per window instead of values\n");
+    fprintf(stderr, "  --decimal-sep C\n");
+    fprintf(stderr, "             decimal separator of the input numbers (default '.')\n");
+    fprintf(stderr, "  --group-sep C|space|none\n");
+    fprintf(stderr, "             digit group separator of the input numbers (default none)\n");
+    fprintf(stderr, "  --round exact|down|up|nearest\n");
+    fprintf(stderr, "             rounding for exact integer results (default exact)\n");
+    fprintf(stderr, "  --latency | --throughput | --deadline MS\n");
+    fprintf(stderr, "             stream batching: convert every read, fill large batches, or\n");
+    fprintf(stderr, "             flush a batch after MS (default 1) (text, CSV and --annotate)\n");
+    fprintf(stderr, "  --stats    print achieved stream batch sizes to stderr\n");
+    fprintf(stderr, "  --follow FILE [--state PATH]\n");
+    fprintf(stderr, "             convert FILE, then its appended lines as it grows\n");
+}
+
+// Batch mode over raw binary values
+static int run_batch_binary(const BatchOptions *options) {
+    Arena *arena = scratch_arena();
+    if (options->use_f32) {
+        float *in = arena_alloc(arena, BATCH_CHUNK * sizeof(float));
+        float *out = arena_alloc(arena, BATCH_CHUNK * sizeof(float));
+        ConversionPlanF32 plan32 = plan_to_f32(&options->plan);
+        size_t n;
+        while ((n = fread(in, sizeof(float), BATCH_CHUNK, stdin)) > 0) {
+            convert_batch_f32(&plan32, in, out, n);
+            metrics_count_pair(options->plan.from_index, options->plan.to_index, n);
+            if (fwrite(out, sizeof(float), n, stdout) != n) return 1;
+        }
+    } else {
+        double *in = arena_alloc(arena, BATCH_CHUNK * sizeof(double));
+        double *out = arena_alloc(arena, BATCH_CHUNK * sizeof(double));
+        size_t n;
+        while ((n = fread(in, sizeof(double), BATCH_CHUNK, stdin)) > 0) {
+            convert_batch(&options->plan, in, out, n);
+            metrics_count_pair(options->plan.from_index, options->plan.to_index, n);
+            if (fwrite(out, sizeof(double), n, stdout) != n) return 1;
+        }
+    }
+    arena_reset(arena);
+    return ferror(stdin) ? 1 : 0;
+}
+
+// One chunk of parsed text values, allocated from the scratch arena
+// Integer inputs are also kept exactly for the integer path
+typedef struct {
+    double *values;
+    uint64_t *integers;
+    bool *is_integer;
+    size_t count;
+} TextChunk;
+
+// Text batch state carried from one stream segment to the next
+typedef struct {
+    const BatchOptions *options;
+    long *line_number;          // Lines read so far, for error messages
+} TextStream;
+
+// Allocate the arrays of a chunk from an arena
+static void text_chunk_init(TextChunk *chunk, Arena *arena) {
+    chunk->values = arena_alloc(arena, BATCH_CHUNK * sizeof(double));
+    chunk->integers = arena_alloc(arena, BATCH_CHUNK * sizeof(uint64_t));
+    chunk->is_integer = arena_alloc(arena, BATCH_CHUNK * sizeof(bool));
+    chunk->count = 0;
+}
+
+// Convert one chunk of text values and append the results to `output`
+static void flush_text_chunk(const BatchOptions *options, TextChunk *chunk, Arena *arena,
+                             ArenaText *output) {
+    size_t n = chunk->count;
+    uint64_t trace_start = trace_begin();
+
+    if (options->scale_table) {
+        double *base_values = arena_alloc(arena, n * sizeof(double));
+        uint8_t *scale_units = arena_alloc(arena, n * sizeof(uint8_t));
+        convert_batch(&options->plan, chunk->values, base_values, n);
+        classify_scale_batch(options->scale_table, base_values, scale_units, n);
+        for (size_t i = 0; i < n; i++) {
+            char buffer[64];
+            format_scaled(options->scale_table, scale_units[i], base_values[i],
+                          buffer, sizeof(buffer));
+            text_append(output, "%s\n", buffer);
+        }
+    } else if (options->use_f32) {
+        float *in32 = arena_alloc(arena, n * sizeof(float));
+        float *out32 = arena_alloc(arena, n * sizeof(float));
+        ConversionPlanF32 plan32 = plan_to_f32(&options->plan);
+        for (size_t i = 0; i < n; i++) in32[i] = (float)chunk->values[i];
+        convert_batch_f32(&plan32, in32, out32, n);
+        for (size_t i = 0; i < n; i++) text_append(output, "%.7g\n", out32[i]);
+    } else if (options->has_integer_plan) {
+        double *out = arena_alloc(arena, n * sizeof(double));
+        unsigned __int128 *quotients = arena_alloc(arena, n * sizeof(unsigned __int128));
+        uint64_t *remainders = arena_alloc(arena, n * sizeof(uint64_t));
+        convert_batch(&options->plan, chunk->values, out, n);
+        convert_integer_batch(&options->integer_plan, chunk->integers,
+                              quotients, remainders, n);
+        for (size_t i = 0; i < n; i++) {
+            if (chunk->is_integer[i]) {
+                char buffer[128];
+                format_integer_result(&options->integer_plan, quotients[i], remainders[i],
+                                      options->rounding, buffer, sizeof(buffer));
+                text_append(output, "%s\n", buffer);
+            } else {
+                text_append(output, "%.15g\n", out[i]);
+            }
+        }
+    } else {
+        double *out = arena_alloc(arena, n * sizeof(double));
+        convert_batch(&options->plan, chunk->values, out, n);
+        for (size_t i = 0; i < n; i++) text_append(output, "%.15g\n", out[i]);
+    }
+    trace_end(STAGE_BATCH_CONVERT_FORMAT, trace_start);
+    metrics_count_pair(options->plan.from_index, options->plan.to_index, n);
+    chunk->count = 0;
+}
+
+// Decimal mode: convert one line exactly if the input is a short decimal
+// and the factor ratio is an exact decimal
+// Returns false if the line needs the double path
+static bool convert_decimal_line(const BatchOptions *options, const char *line,
+                                 ArenaText *output) {
+    Decimal value, result;
+    char *endptr;
+
+    if (!parse_decimal(line, &value, &endptr)) return false;
+    while (*endptr == ' ' || *endptr == '\r') endptr++;
+    if (*endptr != '\0' || !convert_decimal(&options->decimal_plan, &value, &result)) {
+        return false;
+    }
+
+    // Results too long to print in full (1e200 in -> m) take the double path
+    char buffer[96];
+    if (!format_decimal(&result, buffer, sizeof(buffer))) return false;
+    text_append(output, "%s\n", buffer);
+    metrics_count_pair(options->plan.from_index, options->plan.to_index, 1);
+    return true;
+}
+
+// Text batch mode: convert the complete lines [data, data+length), one
+// value per line, into the sink
+// Values are converted in chunks of BATCH_CHUNK through the batch kernels;
+// chunk arrays, line copies and output all come from the segment arena
+static void text_segment(const void *context, const char *data, size_t length,
+                         Arena *arena, OutputSink *sink) {
+    const TextStream *stream = context;
+    const BatchOptions *options = stream->options;
+    const char *end = data + length;
+    size_t line_capacity = 256;
+    char *line = arena_alloc(arena, line_capacity);
+    TextChunk chunk;
+    ArenaText output;
+    uint64_t trace_start = trace_begin();
+
+    text_chunk_init(&chunk, arena);
+    text_init(&output, arena, length + 64);
+    for (const char *next = data; next < end;) {
+        // Copy the line out so the parsers get a terminated string
+        const char *newline = memchr(next, '\n', (size_t)(end - next));
+        size_t line_length = (size_t)((newline ? newline : end) - next);
+        if (line_length >= line_capacity) {
+            while (line_length >= line_capacity) line_capacity *= 2;
+            line = arena_alloc(arena, line_capacity);
+        }
+        memcpy(line, next, line_length);
+        line[line_length] = '\0';
+        next = newline ? newline + 1 : end;
+        long line_number = ++*stream->line_number;
+        if (line[0] == '\0') continue;
+
+        if (options->decimal && convert_decimal_line(options, line, &output)) {
+            continue;
+        }
+
+        double value;
+        if (!parse_number(line, line + line_length, &options->number_format, &value)) {
+            fprintf(stderr, "Error: invalid number on line %ld, skipping\n", line_number);
+            continue;
+        }
+
+        // Inexact decimal-mode values are written in order, not batched
+        if (options->decimal) {
+            text_append(&output, "%.15g\n", value * options->plan.scale + options->plan.offset);
+            metrics_count_pair(options->plan.from_index, options->plan.to_index, 1);
+            continue;
+        }
+
+        // Plain integers take the exact path when the unit pair allows it;
+        // grouped integers like "1,234" stay on the double path
+        size_t i = chunk.count++;
+        char *integer_end;
+        chunk.values[i] = value;
+        chunk.integers[i] = 0;
+        chunk.is_integer[i] = options->has_integer_plan &&
+                              parse_u64(line, &chunk.integers[i], &integer_end);
+        if (chunk.is_integer[i]) {
+            while (*integer_end == ' ' || *integer_end == '\r') integer_end++;
+            chunk.is_integer[i] = *integer_end == '\0';
+        }
+
+        if (chunk.count == BATCH_CHUNK) {
+            trace_end(STAGE_BATCH_READ_PARSE, trace_start);
+            flush_text_chunk(options, &chunk, arena, &output);
+            trace_start = trace_begin();
+        }
+    }
+    trace_end(STAGE_BATCH_READ_PARSE, trace_start);
+    if (chunk.count > 0) flush_text_chunk(options, &chunk, arena, &output);
+    sink_add(sink, output.data, output.length);
+}
+
+// Find field number `column` (1-based) of the line [line, end)
+// Returns false if the line has fewer fields
+static bool find_csv_field(const char *line, const char *end, int column, char delimiter,
+                           const char **field_start, const char **field_end) {
+    const char *p = line;
+    for (int field = 1; field < column; field++) {
+        p = memchr(p, delimiter, (size_t)(end - p));
+        if (p == NULL) return false;
+        p++;
+    }
+    const char *q = memchr(p, delimiter, (size_t)(end - p));
+    *field_start = p;
+    *field_end = q ? q : end;
+    return true;
+}
+
+// CSV mode: convert the complete lines in [data, data+length)
+// Converted numbers are formatted into the segment arena; everything else
+// is passed to the sink as spans pointing into the input buffer
+static void convert_csv_segment(const BatchOptions *options, const char *data, size_t length,
+                                Arena *arena, OutputSink *sink) {
+    const char *end = data + length;
+    size_t capacity = 256, count = 0;
+    const char **starts = arena_alloc(arena, capacity * sizeof(char *));
+    const char **ends = arena_alloc(arena, capacity * sizeof(char *));
+    double *values = arena_alloc(arena, capacity * sizeof(double));
+    uint64_t trace_start = trace_begin();
+
+    // Pass 1: locate and parse the field of every line
+    for (const char *line = data; line < end;) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        const char *line_end = newline ? newline : end;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+
+        const char *field_start, *field_end;
+        if (find_csv_field(line, line_end, options->column, options->delimiter,
+                           &field_start, &field_end) && field_end > field_start) {
+            double value;
+            if (parse_number(field_start, field_end, &options->number_format, &value)) {
+                if (count == capacity) {
+                    starts = arena_grow(arena, starts, capacity * sizeof(char *),
+                                        capacity * 2 * sizeof(char *));
+                    ends = arena_grow(arena, ends, capacity * sizeof(char *),
+                                      capacity * 2 * sizeof(char *));
+                    values = arena_grow(arena, values, capacity * sizeof(double),
+                                        capacity * 2 * sizeof(double));
+                    capacity *= 2;
+                }
+                starts[count] = field_start;
+                ends[count] = field_end;
+                values[count] = value;
+                count++;
+            }
+        }
+        line = newline ? newline + 1 : end;
+    }
+
+    trace_end(STAGE_CSV_PARSE, trace_start);
+
+    // Pass 2: convert the column in one kernel call and gather the output
+    trace_start = trace_begin();
+    double *results = arena_alloc(arena, (count ? count : 1) * sizeof(double));
+    convert_batch(&options->plan, values, results, count);
+    trace_end(STAGE_CSV_CONVERT, trace_start);
+    metrics_count_pair(options->plan.from_index, options->plan.to_index, count);
+
+    trace_start = trace_begin();
+    const char *cursor = data;
+    for (size_t i = 0; i < count; i++) {
+        sink_add(sink, cursor, (size_t)(starts[i] - cursor));
+        char *fragment = arena_alloc(arena, 32);
+        int n = snprintf(fragment, 32, "%.15g", results[i]);
+        sink_add(sink, fragment, (size_t)n);
+        cursor = ends[i];
+    }
+    sink_add(sink, cursor, (size_t)(end - cursor));
+    trace_end(STAGE_CSV_FORMAT, trace_start);
+}
+
+// Run one expression instruction over n rows
+// Every opcode is a flat loop over whole columns, so the compiler can
+// vectorize each of them; dst may alias a or b
+static void expr_execute(const ExprInstruction *in, double **registers, size_t n) {
+    double *dst = registers[in->dst];
+    const double *a = registers[in->a];
+    const double *b = in->immediate ? NULL : registers[in->b];
+
+// Apply `result`, written in terms of x (from a) and y (from b or the
+// immediate constant), to every row
+#define EXPR_LOOP(result)                                                   \
+    do {                                                                    \
+        if (b == NULL) {                                                    \
+            const double y = in->constant;                                  \
+            for (size_t i = 0; i < n; i++) {                                \
+                const double x = a[i];                                      \
+                (void)x; (void)y;                                           \
+                dst[i] = (result);                                          \
+            }                                                               \
+        } else {                                                            \
+            for (size_t i = 0; i < n; i++) {                                \
+                const double x = a[i], y = b[i];                            \
+                (void)x; (void)y;                                           \
+                dst[i] = (result);                                          \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+    switch ((ExprOpcode)in->opcode) {
+        case EXPR_CONST:  EXPR_LOOP(y); break;
+        case EXPR_ADD:    EXPR_LOOP(x + y); break;
+        case EXPR_SUB:    EXPR_LOOP(x - y); break;
+        case EXPR_MUL:    EXPR_LOOP(x * y); break;
+        case EXPR_DIV:    EXPR_LOOP(x / y); break;
+        case EXPR_LT:     EXPR_LOOP((double)(x < y)); break;
+        case EXPR_LE:     EXPR_LOOP((double)(x <= y)); break;
+        case EXPR_GT:     EXPR_LOOP((double)(x > y)); break;
+        case EXPR_GE:     EXPR_LOOP((double)(x >= y)); break;
+        case EXPR_EQ:     EXPR_LOOP((double)(x == y)); break;
+        case EXPR_NE:     EXPR_LOOP((double)(x != y)); break;
+        case EXPR_AND:    EXPR_LOOP((double)((x != 0) & (y != 0))); break;
+        case EXPR_OR:     EXPR_LOOP((double)((x != 0) | (y != 0))); break;
+        case EXPR_NOT:    EXPR_LOOP((double)(x == 0)); break;
+        case EXPR_NEG:    EXPR_LOOP(-x); break;
+        case EXPR_ABS:    EXPR_LOOP(fabs(x)); break;
+        case EXPR_ROUND:  EXPR_LOOP(round(x)); break;
+        case EXPR_MIN:    EXPR_LOOP(fmin(x, y)); break;
+        case EXPR_MAX:    EXPR_LOOP(fmax(x, y)); break;
+        case EXPR_AFFINE: EXPR_LOOP(x * y + in->offset); break;
+    }
+#undef EXPR_LOOP
+}
+
+// Run a compiled program over n rows; field registers must already point
+// at the parsed columns and every temporary at room for n values
+void run_expression(const ExprProgram *program, double **registers, size_t n) {
+    for (int i = 0; i < program->code_length; i++) {
+        expr_execute(&program->code[i], registers, n);
+    }
+}
+
+// Record the first compile error and where it happened
+static ExprOperand expr_fail(ExprParser *parser, const char *message) {
+    if (parser->error == NULL) {
+        parser->error = message;
+        parser->error_at = parser->p;
+    }
+    ExprOperand operand = { true, 0.0, -1 };
+    return operand;
+}
+
+static void expr_skip_spaces(ExprParser *parser) {
+    while (*parser->p == ' ' || *parser->p == '\t') parser->p++;
+}
+
+// Consume `token` if it comes next; words must not run into an identifier
+static bool expr_accept(ExprParser *parser, const char *token) {
+    expr_skip_spaces(parser);
+    size_t n = strlen(token);
+    if (strncmp(parser->p, token, n) != 0) return false;
+    if (isalpha((unsigned char)token[0]) &&
+        (isalnum((unsigned char)parser->p[n]) || parser->p[n] == '_')) {
+        return false;
+    }
+    parser->p += n;
+    return true;
+}
+
+// Append an instruction; its destination is the next free temporary
+static ExprOperand expr_emit(ExprParser *parser, ExprInstruction instruction) {
+    ExprProgram *program = parser->program;
+    if (parser->top >= MAX_EXPR_REGISTERS - program->field_count) {
+        return expr_fail(parser, "expression too complex");
+    }
+    if (program->code_length == MAX_EXPR_CODE) {
+        return expr_fail(parser, "expression too long");
+    }
+    instruction.dst = (uint8_t)parser->top++;
+    if (parser->top > program->register_count) program->register_count = parser->top;
+    program->code[program->code_length++] = instruction;
+    ExprOperand operand = { false, 0.0, instruction.dst };
+    return operand;
+}
+
+// Release the temporary of an operand; temporaries are freed in stack
+// order, so releasing the first operand of an operation frees both
+static void expr_release(ExprParser *parser, ExprOperand operand) {
+    if (!operand.constant && operand.reg < parser->top && operand.reg >= parser->base) {
+        parser->top = operand.reg;
+    }
+}
+
+// Load a constant operand into a register
+static ExprOperand expr_materialize(ExprParser *parser, ExprOperand operand) {
+    if (!operand.constant) return operand;
+    ExprInstruction instruction = { .opcode = EXPR_CONST, .immediate = true,
+                                    .constant = operand.value };
+    return expr_emit(parser, instruction);
+}
+
+// Emit `a op b`, folding constants at compile time
+// Constants are kept as immediates on the right where the operation
+// allows it, so "$2 > 700" is a single instruction
+static ExprOperand expr_operation(ExprParser *parser, ExprOpcode opcode,
+                                  ExprOperand a, ExprOperand b, double offset) {
+    if (parser->error) return a;
+    ExprInstruction instruction = { .opcode = (uint8_t)opcode, .offset = offset };
+
+    if (a.constant && b.constant) {
+        double x = a.value, result;
+        double *registers[1] = { &x };
+        instruction.immediate = true;
+        instruction.constant = b.value;
+        expr_execute(&instruction, registers, 1);
+        result = x;
+        ExprOperand operand = { true, result, -1 };
+        return operand;
+    }
+    if (a.constant) {
+        static const ExprOpcode mirrored[] = {
+            [EXPR_ADD] = EXPR_ADD, [EXPR_MUL] = EXPR_MUL, [EXPR_LT] = EXPR_GT,
+            [EXPR_LE] = EXPR_GE, [EXPR_GT] = EXPR_LT, [EXPR_GE] = EXPR_LE,
+            [EXPR_EQ] = EXPR_EQ, [EXPR_NE] = EXPR_NE, [EXPR_AND] = EXPR_AND,
+            [EXPR_OR] = EXPR_OR, [EXPR_MIN] = EXPR_MIN, [EXPR_MAX] = EXPR_MAX
+        };
+        if (opcode < sizeof(mirrored) / sizeof(mirrored[0]) && mirrored[opcode] != EXPR_CONST) {
+            ExprOperand swap = a;
+            a = b;
+            b = swap;
+            instruction.opcode = (uint8_t)mirrored[opcode];
+        } else {
+            a = expr_materialize(parser, a);
+        }
+    }
+
+    instruction.a = (uint8_t)a.reg;
+    if (b.constant) {
+        instruction.immediate = true;
+        instruction.constant = b.value;
+    } else {
+        instruction.b = (uint8_t)b.reg;
+    }
+    expr_release(parser, b);
+    expr_release(parser, a);
+    return expr_emit(parser, instruction);
+}
+
+static ExprOperand expr_parse_or(ExprParser *parser);
+
+// Unit argument of convert(): the text up to ',' or ')', optionally quoted
+static int expr_parse_unit(ExprParser *parser, char *name, size_t size) {
+    expr_skip_spaces(parser);
+    const char *start = parser->p, *end;
+    char quote = *start == '"' || *start == '\'' ? *start : '\0';
+    if (quote) {
+        end = strchr(++start, quote);
+        if (end == NULL) {
+            expr_fail(parser, "unterminated unit name");
+            return -1;
+        }
+        parser->p = end + 1;
+    } else {
+        end = start + strcspn(start, ",)");
+        parser->p = end;
+        while (end > start && end[-1] == ' ') end--;
+    }
+    if (end == start || (size_t)(end - start) >= size) {
+        expr_fail(parser, "expected a unit name");
+        return -1;
+    }
+    memcpy(name, start, (size_t)(end - start));
+    name[end - start] = '\0';
+    return 0;
+}
+
+// Function call: abs(x), round(x), min(x, y), max(x, y),
+// convert(x, from, to)
+static ExprOperand expr_parse_call(ExprParser *parser, const char *name, size_t length) {
+    static const struct {
+        const char *name;
+        ExprOpcode opcode;
+        int arguments;
+    } functions[] = {
+        {"abs", EXPR_ABS, 1}, {"round", EXPR_ROUND, 1},
+        {"min", EXPR_MIN, 2}, {"max", EXPR_MAX, 2}, {"convert", EXPR_AFFINE, 1}
+    };
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strlen(functions[i].name) != length || strncmp(functions[i].name, name, length) != 0) {
+            continue;
+        }
+        ExprOperand a = expr_parse_or(parser), b = { true, 0.0, -1 };
+        double offset = 0.0;
+        if (functions[i].arguments == 2) {
+            if (!expr_accept(parser, ",")) return expr_fail(parser, "expected ','");
+            b = expr_parse_or(parser);
+        }
+        if (functions[i].opcode == EXPR_AFFINE) {
+            char from[32], to[32];
+            ConversionPlan plan;
+            if (!expr_accept(parser, ",")) return expr_fail(parser, "expected ','");
+            if (expr_parse_unit(parser, from, sizeof(from)) < 0) return a;
+            if (!expr_accept(parser, ",")) return expr_fail(parser, "expected ','");
+            if (expr_parse_unit(parser, to, sizeof(to)) < 0) return a;
+            if (!plan_conversion(from, to, &plan)) {
+                return expr_fail(parser, "convert() between unknown or incompatible units");
+            }
+            b.value = plan.scale;
+            offset = plan.offset;
+        }
+        if (!expr_accept(parser, ")")) return expr_fail(parser, "expected ')'");
+        return expr_operation(parser, functions[i].opcode, a, b, offset);
+    }
+    parser->p = name;
+    return expr_fail(parser, "unknown function");
+}
+
+// Register of input field `column`, bound on first reference
+static ExprOperand expr_field(ExprParser *parser, int column) {
+    ExprProgram *program = parser->program;
+    int k = 0;
+    while (k < program->field_count && program->field_columns[k] != column) k++;
+    if (k == program->field_count) {
+        if (MAX_EXPR_REGISTERS - 1 - k < program->register_count) {
+            return expr_fail(parser, "too many fields");
+        }
+        program->field_columns[program->field_count++] = column;
+    }
+    ExprOperand operand = { false, 0.0, MAX_EXPR_REGISTERS - 1 - k };
+    return operand;
+}
+
+// primary: number | $N | value | function(...) | ( expression )
+static ExprOperand expr_parse_primary(ExprParser *parser) {
+    expr_skip_spaces(parser);
+    const char *p = parser->p;
+    if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1]))) {
+        char *end;
+        double value = strtod(p, &end);
+        parser->p = end;
+        ExprOperand operand = { true, value, -1 };
+        return operand;
+    }
+    if (*p == '$') {
+        char *end;
+        long column = strtol(p + 1, &end, 10);
+        if (end == p + 1 || column < 1 || column > 10000) {
+            return expr_fail(parser, "expected a field number after '$'");
+        }
+        parser->p = end;
+        return expr_field(parser, (int)column);
+    }
+    if (*p == '(') {
+        parser->p++;
+        ExprOperand operand = expr_parse_or(parser);
+        if (!expr_accept(parser, ")")) return expr_fail(parser, "expected ')'");
+        return operand;
+    }
+    if (isalpha((unsigned char)*p)) {
+        const char *q = p;
+        while (isalnum((unsigned char)*q) || *q == '_') q++;
+        parser->p = q;
+        if (q - p == 5 && strncmp(p, "value", 5) == 0) {
+            return expr_field(parser, parser->program->converted_column);
+        }
+        if (!expr_accept(parser, "(")) {
+            parser->p = p;
+            return expr_fail(parser, "unknown name");
+        }
+        return expr_parse_call(parser, p, (size_t)(q - p));
+    }
+    return expr_fail(parser, "expected a number, field or '('");
+}
+
+// unary: -unary | not unary | primary
+static ExprOperand expr_parse_unary(ExprParser *parser) {
+    ExprOperand none = { true, 0.0, -1 };
+    if (expr_accept(parser, "-")) {
+        return expr_operation(parser, EXPR_NEG, expr_parse_unary(parser), none, 0.0);
+    }
+    bool negate = expr_accept(parser, "not");
+    if (!negate && parser->p[0] == '!' && parser->p[1] != '=') {
+        parser->p++;
+        negate = true;
+    }
+    if (negate) {
+        return expr_operation(parser, EXPR_NOT, expr_parse_unary(parser), none, 0.0);
+    }
+    return expr_parse_primary(parser);
+}
+
+// Binary operator levels, from loosest to tightest
+static const struct {
+    const char *token;
+    ExprOpcode opcode;
+    int level;
+} expr_operators[] = {
+    {"or", EXPR_OR, 0}, {"||", EXPR_OR, 0},
+    {"and", EXPR_AND, 1}, {"&&", EXPR_AND, 1},
+    {"==", EXPR_EQ, 2}, {"!=", EXPR_NE, 2}, {"<=", EXPR_LE, 2},
+    {">=", EXPR_GE, 2}, {"<", EXPR_LT, 2}, {">", EXPR_GT, 2},
+    {"+", EXPR_ADD, 3}, {"-", EXPR_SUB, 3},
+    {"*", EXPR_MUL, 4}, {"/", EXPR_DIV, 4}
+};
+
+#define EXPR_LEVELS 5
+
+// Left-associative binary operators at `level` and tighter
+static ExprOperand expr_parse_level(ExprParser *parser, int level) {
+    if (level == EXPR_LEVELS) return expr_parse_unary(parser);
+    ExprOperand left = expr_parse_level(parser, level + 1);
+    while (parser->error == NULL) {
+        size_t i = 0, count = sizeof(expr_operators) / sizeof(expr_operators[0]);
+        while (i < count && (expr_operators[i].level != level ||
+                             !expr_accept(parser, expr_operators[i].token))) {
+            i++;
+        }
+        if (i == count) break;
+        ExprOperand right = expr_parse_level(parser, level + 1);
+        left = expr_operation(parser, expr_operators[i].opcode, left, right, 0.0);
+    }
+    return left;
+}
+
+static ExprOperand expr_parse_or(ExprParser *parser) {
+    return expr_parse_level(parser, 0);
+}
+
+// Compile one --where or --derive expression into `program`
+// The result stays in its register for the rest of the program; returns
+// the register, or -1 after printing the error
+int compile_expression(ExprProgram *program, const char *option, const char *source) {
+    ExprParser parser = { source, source, program, program->temp_base, program->temp_base,
+                          NULL, NULL };
+    ExprOperand result = expr_parse_or(&parser);
+    expr_skip_spaces(&parser);
+    if (parser.error == NULL && *parser.p != '\0') expr_fail(&parser, "unexpected text");
+    if (parser.error == NULL) result = expr_materialize(&parser, result);
+    if (parser.error != NULL) {
+        fprintf(stderr, "Error: %s: %s at column %d\n  %s\n  %*s^\n", option, parser.error,
+                (int)(parser.error_at - source) + 1, source, (int)(parser.error_at - source), "");
+        return -1;
+    }
+    // Keep a temporary result out of reach of later expressions; a bare
+    // field is used in place
+    if (result.reg < MAX_EXPR_REGISTERS - program->field_count) {
+        program->temp_base = result.reg + 1;
+    }
+    return result.reg;
+}
+
+// CSV mode with --where/--derive: parse the converted column and every
+// field the expressions use, convert, run the program once over the
+// whole segment, then write the rows that pass with the derived fields
+// appended
+// Rows whose converted or referenced fields are not numbers are dropped
+// by --where; otherwise a row without a number to convert is passed
+// through unchanged, and one with a missing expression input keeps its
+// converted field and gets empty derived fields
+static void evaluate_csv_segment(const BatchOptions *options, const char *data, size_t length,
+                                 Arena *arena, OutputSink *sink) {
+    const ExprProgram *program = options->expressions;
+    const char *end = data + length;
+    uint64_t trace_start = trace_begin();
+
+    size_t rows = 0;
+    for (const char *p = data; p < end; rows++) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        p = newline ? newline + 1 : end;
+    }
+    if (rows == 0) return;
+
+    const char **lines = arena_alloc(arena, (rows + 1) * sizeof(char *));
+    const char **field_starts = arena_alloc(arena, rows * sizeof(char *));
+    const char **field_ends = arena_alloc(arena, rows * sizeof(char *));
+    bool *valid = arena_alloc(arena, rows * sizeof(bool));         // Field to convert
+    bool *inputs_valid = arena_alloc(arena, rows * sizeof(bool));  // All expression inputs
+    double *raw = arena_alloc(arena, rows * sizeof(double));
+    double *converted = arena_alloc(arena, rows * sizeof(double));
+    double *registers[MAX_EXPR_REGISTERS] = {0};
+    for (int r = 0; r < program->register_count; r++) {
+        registers[r] = arena_alloc(arena, rows * sizeof(double));
+    }
+    for (int k = 0; k < program->field_count; k++) {
+        double **slot = &registers[MAX_EXPR_REGISTERS - 1 - k];
+        *slot = program->field_columns[k] == options->column
+              ? converted : arena_alloc(arena, rows * sizeof(double));
+    }
+
+    // Pass 1: split lines, parse the converted field and the referenced ones
+    size_t count = 0;
+    const char *line = data;
+    for (size_t row = 0; row < rows; row++) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        const char *line_end = newline ? newline : end;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        lines[row] = line;
+
+        const char *start, *stop;
+        valid[row] = find_csv_field(line, line_end, options->column, options->delimiter,
+                                    &start, &stop) &&
+                     parse_number(start, stop, &options->number_format, &raw[row]);
+        field_starts[row] = valid[row] ? start : line_end;
+        field_ends[row] = valid[row] ? stop : line_end;
+        if (!valid[row]) raw[row] = 0.0;
+        inputs_valid[row] = valid[row];
+        for (int k = 0; k < program->field_count && inputs_valid[row]; k++) {
+            if (program->field_columns[k] == options->column) continue;
+            double *column = registers[MAX_EXPR_REGISTERS - 1 - k];
+            inputs_valid[row] = find_csv_field(line, line_end, program->field_columns[k],
+                                               options->delimiter, &start, &stop) &&
+                                parse_number(start, stop, &options->number_format, &column[row]);
+        }
+        for (int k = 0; k < program->field_count && !inputs_valid[row]; k++) {
+            if (program->field_columns[k] != options->column) {
+                registers[MAX_EXPR_REGISTERS - 1 - k][row] = 0.0;
+            }
+        }
+        count += valid[row];
+        line = newline ? newline + 1 : end;
+    }
+    lines[rows] = end;
+    trace_end(STAGE_CSV_PARSE, trace_start);
+
+    // Pass 2: convert, then run every instruction over the whole segment
+    trace_start = trace_begin();
+    convert_batch(&options->plan, raw, converted, rows);
+    trace_end(STAGE_CSV_CONVERT, trace_start);
+    metrics_count_pair(options->plan.from_index, options->plan.to_index, count);
+
+    trace_start = trace_begin();
+    run_expression(program, registers, rows);
+    trace_end(STAGE_CSV_EVALUATE, trace_start);
+
+    // Pass 3: gather the output
+    trace_start = trace_begin();
+    const double *keep = program->where_register >= 0 ? registers[program->where_register] : NULL;
+    for (size_t row = 0; row < rows; row++) {
+        if (keep != NULL && (!inputs_valid[row] || !(keep[row] != 0))) continue;
+        if (!valid[row]) {
+            sink_add(sink, lines[row], (size_t)(lines[row + 1] - lines[row]));
+            continue;
+        }
+        const char *line_end = lines[row + 1];
+        if (line_end > lines[row] && line_end[-1] == '\n') line_end--;
+        if (line_end > lines[row] && line_end[-1] == '\r') line_end--;
+
+        size_t fragment_size = 32 * (size_t)(program->derive_count + 1);
+        char *fragment = arena_alloc(arena, fragment_size);
+        int n = snprintf(fragment, 32, "%.15g", converted[row]);
+        sink_add(sink, lines[row], (size_t)(field_starts[row] - lines[row]));
+        sink_add(sink, fragment, (size_t)n);
+        sink_add(sink, field_ends[row], (size_t)(line_end - field_ends[row]));
+
+        char *derived = fragment + n;
+        size_t derived_length = 0;
+        for (int d = 0; d < program->derive_count; d++) {
+            if (!inputs_valid[row]) {
+                derived[derived_length++] = options->delimiter;
+                continue;
+            }
+            derived_length += (size_t)snprintf(derived + derived_length, 32, "%c%.15g",
+                                               options->delimiter,
+                                               registers[program->derive_registers[d]][row]);
+        }
+        sink_add(sink, derived, derived_length);
+        sink_add(sink, line_end, (size_t)(lines[row + 1] - line_end));
+    }
+    trace_end(STAGE_CSV_FORMAT, trace_start);
+}
+
+// Append a sample to a deque, doubling the ring when it is full
+static void deque_push(SampleDeque *deque, double key, double value) {
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        WindowSample *samples = malloc(capacity * sizeof(WindowSample));
+        if (samples == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            samples[i] = deque->samples[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->samples);
+        deque->samples = samples;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    WindowSample *sample = &deque->samples[(deque->head + deque->count++) & (deque->capacity - 1)];
+    sample->key = key;
+    sample->value = value;
+}
+
+static WindowSample *deque_front(SampleDeque *deque) {
+    return &deque->samples[deque->head];
+}
+
+static WindowSample *deque_back(SampleDeque *deque) {
+    return &deque->samples[(deque->head + deque->count - 1) & (deque->capacity - 1)];
+}
+
+static void deque_pop_front(SampleDeque *deque) {
+    deque->head = (deque->head + 1) & (deque->capacity - 1);
+    deque->count--;
+}
+
+// Neumaier summation: `compensation` collects the low-order bits that
+// `sum` loses, so long sliding sums do not drift
+static void neumaier_add(double *sum, double *compensation, double value) {
+    double t = *sum + value;
+    if (fabs(*sum) >= fabs(value)) {
+        *compensation += (*sum - t) + value;
+    } else {
+        *compensation += (value - t) + *sum;
+    }
+    *sum = t;
+}
+
+// FNV-1a hash of a group key
+static uint64_t window_key_hash(const char *key, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Find or create the window group of `key`
+// Groups live in an array in order of first appearance; an
+// open-addressed table of indices (at most half full) finds them
+static WindowGroup *window_group(WindowState *state, const char *key, size_t length) {
+    if (length >= MAX_WINDOW_KEY) length = MAX_WINDOW_KEY - 1;
+    if (state->group_count * 2 >= state->slot_count) {
+        size_t slot_count = state->slot_count ? state->slot_count * 2 : 64;
+        int *slots = malloc(slot_count * sizeof(int));
+        WindowGroup *groups = realloc(state->groups, slot_count / 2 * sizeof(WindowGroup));
+        if (slots == NULL || groups == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < slot_count; i++) slots[i] = -1;
+        for (size_t g = 0; g < state->group_count; g++) {
+            size_t i = groups[g].hash & (slot_count - 1);
+            while (slots[i] >= 0) i = (i + 1) & (slot_count - 1);
+            slots[i] = (int)g;
+        }
+        free(state->slots);
+        state->slots = slots;
+        state->slot_count = slot_count;
+        state->groups = groups;
+    }
+
+    uint64_t hash = window_key_hash(key, length);
+    size_t i = hash & (state->slot_count - 1);
+    for (; state->slots[i] >= 0; i = (i + 1) & (state->slot_count - 1)) {
+        WindowGroup *group = &state->groups[state->slots[i]];
+        if (group->hash == hash && strlen(group->key) == length &&
+            memcmp(group->key, key, length) == 0) {
+            return group;
+        }
+    }
+    state->slots[i] = (int)state->group_count;
+    WindowGroup *group = &state->groups[state->group_count++];
+    memset(group, 0, sizeof(*group));
+    memcpy(group->key, key, length);
+    group->key[length] = '\0';
+    group->hash = hash;
+    return group;
+}
+
+// Drop the samples of a group that fall before `start`
+static void window_evict(WindowGroup *group, double start) {
+    while (group->samples.count > 0 && deque_front(&group->samples)->key < start) {
+        neumaier_add(&group->sum, &group->compensation, -deque_front(&group->samples)->value);
+        deque_pop_front(&group->samples);
+    }
+    while (group->minima.count > 0 && deque_front(&group->minima)->key < start) {
+        deque_pop_front(&group->minima);
+    }
+    while (group->maxima.count > 0 && deque_front(&group->maxima)->key < start) {
+        deque_pop_front(&group->maxima);
+    }
+    if (group->samples.count == 0) {
+        group->sum = 0.0;
+        group->compensation = 0.0;
+    }
+}
+
+// Write the aggregate of the window [end - size, end) of a group
+static void window_emit(const WindowState *state, WindowGroup *group, char delimiter,
+                        ArenaText *text) {
+    double end = group->next_end, start = end - state->size;
+    if (!state->by_time && start < 0) start = 0;    // First windows of a count stream
+    size_t count = group->samples.count;
+    if (state->group_column > 0) text_append(text, "%s%c", group->key, delimiter);
+    text_append(text, "%.15g%c%.15g%c%zu%c%.15g%c%.15g%c%.15g\n",
+                start, delimiter, end, delimiter, count, delimiter,
+                (group->sum + group->compensation) / (double)count, delimiter,
+                deque_front(&group->minima)->value, delimiter,
+                deque_front(&group->maxima)->value);
+    group->pending = false;
+}
+
+// Add one converted sample to its group, first closing (and emitting)
+// every window that ends at or before its key
+// Each sample enters and leaves each deque once: O(1) amortized
+static void window_add(WindowState *state, WindowGroup *group, double key, double value,
+                       char delimiter, ArenaText *text) {
+    if (group->started && key < group->last_key) {
+        state->late++;
+        return;
+    }
+    if (!group->started) {
+        group->next_end = floor(key / state->slide) * state->slide + state->slide;
+        group->started = true;
+    }
+    while (key >= group->next_end) {
+        window_evict(group, group->next_end - state->size);
+        if (group->samples.count > 0) window_emit(state, group, delimiter, text);
+        group->next_end += state->slide;
+        if (group->samples.count == 0 && key >= group->next_end) {
+            // Skip the empty windows of a gap in one step
+            group->next_end = floor(key / state->slide) * state->slide + state->slide;
+        }
+    }
+
+    deque_push(&group->samples, key, value);
+    neumaier_add(&group->sum, &group->compensation, value);
+    // Minima increase and maxima decrease from front to back; a new sample
+    // retires every sample it dominates, which can never be the extreme
+    // of a later window
+    while (group->minima.count > 0 && deque_back(&group->minima)->value >= value) {
+        group->minima.count--;
+    }
+    deque_push(&group->minima, key, value);
+    while (group->maxima.count > 0 && deque_back(&group->maxima)->value <= value) {
+        group->maxima.count--;
+    }
+    deque_push(&group->maxima, key, value);
+    group->last_key = key;
+    group->pending = true;
+}
+
+// Seconds since the epoch of a numeric or ISO 8601 UTC timestamp
+// ("2024-05-01T12:00:30.5Z", "2024-05-01 12:00:30")
+static bool parse_timestamp(const char *p, const char *end, const NumberFormat *format,
+                            double *seconds) {
+    if (parse_number(p, end, format, seconds)) return true;
+
+    char text[40];
+    size_t n = (size_t)(end - p);
+    if (n >= sizeof(text)) return false;
+    memcpy(text, p, n);
+    text[n] = '\0';
+
+    struct tm tm = {0};
+    double second;
+    int consumed = 0;
+    if (sscanf(text, "%4d-%2d-%2d%*1[T ]%2d:%2d:%lf%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &second, &consumed) != 6) {
+        return false;
+    }
+    if (text[consumed] == 'Z') consumed++;
+    if (text[consumed] != '\0' || second < 0 || second >= 61) return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *seconds = (double)timegm(&tm) + second;
+    return true;
+}
+
+// Window mode: parse the value (and timestamp and group key) of every
+// line, convert the block with one kernel call, then feed the samples to
+// their groups in input order
+// Lines without a valid value or timestamp are skipped
+static void window_segment(const BatchOptions *options, const char *data, size_t length,
+                           Arena *arena, OutputSink *sink) {
+    WindowState *state = options->window;
+    const char *end = data + length;
+    uint64_t trace_start = trace_begin();
+
+    size_t rows = 0;
+    for (const char *p = data; p < end; rows++) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        p = newline ? newline + 1 : end;
+    }
+    if (rows == 0) return;
+
+    double *raw = arena_alloc(arena, rows * sizeof(double));
+    double *converted = arena_alloc(arena, rows * sizeof(double));
+    double *keys = arena_alloc(arena, rows * sizeof(double));
+    const char **group_keys = arena_alloc(arena, rows * sizeof(char *));
+    size_t *group_lengths = arena_alloc(arena, rows * sizeof(size_t));
+    size_t count = 0;
+
+    const char *line = data;
+    for (size_t row = 0; row < rows; row++) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        const char *line_end = newline ? newline : end;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+
+        const char *start, *stop;
+        bool valid = find_csv_field(line, line_end, options->column, options->delimiter,
+                                    &start, &stop) &&
+                     parse_number(start, stop, &options->number_format, &raw[count]);
+        if (valid && state->time_column > 0) {
+            valid = find_csv_field(line, line_end, state->time_column, options->delimiter,
+                                   &start, &stop) &&
+                    parse_timestamp(start, stop, &options->number_format, &keys[count]);
+        }
+        if (valid && state->group_column > 0) {
+            valid = find_csv_field(line, line_end, state->group_column, options->delimiter,
+                                   &start, &stop);
+            group_keys[count] = start;
+            group_lengths[count] = valid ? (size_t)(stop - start) : 0;
+        }
+        count += valid;
+        line = newline ? newline + 1 : end;
+    }
+    trace_end(STAGE_CSV_PARSE, trace_start);
+
+    trace_start = trace_begin();
+    convert_batch(&options->plan, raw, converted, count);
+    trace_end(STAGE_CSV_CONVERT, trace_start);
+    metrics_count_pair(options->plan.from_index, options->plan.to_index, count);
+
+    trace_start = trace_begin();
+    ArenaText text;
+    text_init(&text, arena, 4096);
+    for (size_t i = 0; i < count; i++) {
+        WindowGroup *group = state->group_column > 0
+                           ? window_group(state, group_keys[i], group_lengths[i])
+                           : window_group(state, "", 0);
+        double key = state->time_column > 0 ? keys[i] : group->sequence++;
+        window_add(state, group, key, converted[i], options->delimiter, &text);
+    }
+    sink_add(sink, text.data, text.length);
+    trace_end(STAGE_WINDOW_AGGREGATE, trace_start);
+}
+
+// End of input closes every open window that still holds samples: the
+// one ending at next_end and, for sliding windows, the later ones that
+// overlap it; the groups are then released
+static int finish_windows(WindowState *state, char delimiter) {
+    Arena arena = {0};
+    OutputSink sink;
+    ArenaText text;
+    sink_init(&sink, STDOUT_FILENO);
+    text_init(&text, &arena, 4096);
+
+    for (size_t g = 0; g < state->group_count; g++) {
+        WindowGroup *group = &state->groups[g];
+        if (group->pending) {
+            for (;;) {
+                window_evict(group, group->next_end - state->size);
+                if (group->samples.count == 0) break;
+                window_emit(state, group, delimiter, &text);
+                group->next_end += state->slide;
+            }
+        }
+        free(group->samples.samples);
+        free(group->minima.samples);
+        free(group->maxima.samples);
+    }
+    sink_add(&sink, text.data, text.length);
+    bool written = sink_flush(&sink);
+    arena_free(&arena);
+
+    free(state->groups);
+    free(state->slots);
+    if (state->late > 0) {
+        fprintf(stderr, "Note: %ld out-of-order samples dropped\n", state->late);
+    }
+    if (!written) {
+        perror("writev");
+        return 1;
+    }
+    return 0;
+}
+
+// Parse a --window or --slide size: a count ("100") or a duration with
+// a unit ("500ms", "30s", "1m", "2h")
+static bool parse_window_size(const char *text, double *size, bool *by_time) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || !(value > 0)) return false;
+    static const struct {
+        const char *suffix;
+        double seconds;
+    } suffixes[] = { {"ms", 0.001}, {"s", 1}, {"m", 60}, {"h", 3600} };
+    if (*end == '\0') {
+        *size = value;
+        *by_time = false;
+        return value == floor(value);
+    }
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        if (strcmp(end, suffixes[i].suffix) == 0) {
+            *size = value * suffixes[i].seconds;
+            *by_time = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse a stream option at argv[*i]: --latency, --throughput,
+// --deadline MS, --stats, --follow FILE or --state PATH. Returns 1 if it
+// was one (advancing *i past its argument), 0 if not, -1 on a bad argument
+int parse_stream_option(int argc, char *argv[], int *i) {
+    const char *option = argv[*i];
+    if (strcmp(option, "--latency") == 0) {
+        stream_batching.deadline = 0.0;
+        stream_batching.wait_for_input = false;
+        stream_batching.batch_size = STREAM_BUFFER_SIZE;
+    } else if (strcmp(option, "--throughput") == 0) {
+        stream_batching.deadline = STREAM_THROUGHPUT_DEADLINE;
+        stream_batching.wait_for_input = true;
+        stream_batching.batch_size = STREAM_BUFFER_SIZE * 4;
+    } else if (strcmp(option, "--deadline") == 0 && *i + 1 < argc) {
+        char *end;
+        double ms = strtod(argv[++*i], &end);
+        if (end == argv[*i] || *end != '\0' || !(ms >= 0.0)) {
+            fprintf(stderr, "Error: --deadline expects milliseconds, got '%s'\n", argv[*i]);
+            return -1;
+        }
+        stream_batching.deadline = ms / 1e3;
+    } else if (strcmp(option, "--stats") == 0) {
+        stream_batching.stats = true;
+    } else if (strcmp(option, "--follow") == 0 && *i + 1 < argc) {
+        follow_options.path = argv[++*i];
+    } else if (strcmp(option, "--state") == 0 && *i + 1 < argc) {
+        follow_options.state_path = argv[++*i];
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Record one converted batch in the stream statistics
+static void stream_stats_add(StreamStats *stats, size_t bytes, const char *data,
+                             FlushReason reason, double held) {
+    size_t lines = 0;
+    for (const char *p = data; (p = memchr(p, '\n', (size_t)(data + bytes - p))) != NULL; p++) {
+        lines++;
+    }
+    if (bytes > 0 && data[bytes-1] != '\n') lines++;
+    if (stats->batches == 0 || bytes < stats->min_bytes) stats->min_bytes = bytes;
+    if (bytes > stats->max_bytes) stats->max_bytes = bytes;
+    if (lines > stats->max_lines) stats->max_lines = lines;
+    if (held > stats->max_held) stats->max_held = held;
+    stats->batches++;
+    stats->bytes += bytes;
+    stats->lines += lines;
+    stats->reasons[reason]++;
+}
+
+// Print the --stats summary of a stream run to stderr
+static void print_stream_stats(const StreamStats *stats) {
+    static const char *reasons[FLUSH_REASONS] = {"full", "blocked", "deadline", "end"};
+    double batches = stats->batches ? (double)stats->batches : 1.0;
+    fprintf(stderr, "Stream batches: %llu (", (unsigned long long)stats->batches);
+    for (int r = 0; r < FLUSH_REASONS; r++) {
+        fprintf(stderr, "%s%llu %s", r ? ", " : "", (unsigned long long)stats->reasons[r],
+                reasons[r]);
+    }
+    fprintf(stderr, ")\n");
+    fprintf(stderr, "  bytes per batch: min %zu, mean %.0f, max %zu\n",
+            stats->batches ? stats->min_bytes : 0, stats->bytes / batches, stats->max_bytes);
+    fprintf(stderr, "  lines per batch: mean %.1f, max %zu\n", stats->lines / batches,
+            stats->max_lines);
+    fprintf(stderr, "  longest a line was held: %.3f ms\n", stats->max_held * 1e3);
+}
+
+#ifdef __linux__
+// Read the offset saved by a previous follow run
+// Only valid while the file is the same (device and inode) and no shorter
+static bool follow_load_state(const char *state_path, const struct stat *file, off_t *offset) {
+    unsigned long long device, inode;
+    long long saved;
+    FILE *state = fopen(state_path, "r");
+    if (state == NULL) return false;
+    int fields = fscanf(state, "%llu %llu %lld", &device, &inode, &saved);
+    fclose(state);
+    if (fields != 3 || saved < 0) return false;
+    if (device != (unsigned long long)file->st_dev || inode != (unsigned long long)file->st_ino) {
+        fprintf(stderr, "Note: %s was replaced since the last run; reading from the start\n",
+                follow_options.path);
+        return false;
+    }
+    if (saved > (long long)file->st_size) {
+        fprintf(stderr, "Note: %s was truncated since the last run; reading from the start\n",
+                follow_options.path);
+        return false;
+    }
+    *offset = (off_t)saved;
+    return true;
+}
+
+// Persist the offset up to which the followed file has been converted
+// Written to a temporary file and renamed, so a crash leaves the old or
+// the new offset, never a torn one
+static void follow_save_state(const char *state_path, const struct stat *file, off_t offset) {
+    char temp[4096 + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", state_path);
+    FILE *state = fopen(temp, "w");
+    if (state == NULL) return;
+    fprintf(state, "%llu %llu %lld\n", (unsigned long long)file->st_dev,
+            (unsigned long long)file->st_ino, (long long)offset);
+    if (fclose(state) != 0 || rename(temp, state_path) != 0) {
+        fprintf(stderr, "Warning: cannot save offset to '%s': %s\n", state_path, strerror(errno));
+    }
+}
+
+// Block until inotify reports an event, then discard the queued events;
+// the caller re-checks the file either way
+static bool follow_wait(int notify) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(notify, events, sizeof(events));
+        if (n > 0) return true;
+        if (n < 0 && errno != EINTR) {
+            perror("inotify");
+            return false;
+        }
+    }
+}
+
+// Follow mode: convert the existing content of the file, then sleep in
+// inotify until it grows and convert only the new complete lines
+// A truncated file is read again from the start; when the path names a
+// new file (rotation), the old one is drained and the new one followed
+// from its first byte
+static int follow_segments(SegmentFn convert, const void *context) {
+    const char *path = follow_options.path;
+    char state_path[4096], dir[4096];
+    if (follow_options.state_path) {
+        snprintf(state_path, sizeof(state_path), "%s", follow_options.state_path);
+    } else {
+        snprintf(state_path, sizeof(state_path), "%s.offset", path);
+    }
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+
+    // The directory watch sees the file appear, be renamed or deleted;
+    // the file watch sees appends and truncation
+    int notify = inotify_init1(IN_CLOEXEC);
+    if (notify < 0 || inotify_add_watch(notify, dir, IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                     IN_DELETE) < 0) {
+        fprintf(stderr, "Error: cannot watch '%s': %s\n", dir, strerror(errno));
+        if (notify >= 0) close(notify);
+        return 1;
+    }
+
+    fflush(stdout);
+    Arena *arena = scratch_arena();
+    Arena segment_arena = {0};
+    OutputSink sink;
+    size_t capacity = STREAM_BUFFER_SIZE, filled = 0;
+    char *buffer = arena_alloc(arena, capacity);
+    off_t consumed = 0;         // File offset of buffer[0]
+    struct stat info;
+    int fd = -1, file_watch = -1, status = 0;
+    bool first_open = true, rotated = false;
+
+    sink_init(&sink, STDOUT_FILENO);
+    for (;;) {
+        if (fd < 0) {
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                if (errno != ENOENT) {
+                    fprintf(stderr, "Error: cannot open '%s': %s\n", path, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                if (!follow_wait(notify)) {
+                    status = 1;
+                    break;
+                }
+                continue;
+            }
+            // The identity saved with the offset comes from fstat()
+            if (fstat(fd, &info) != 0) {
+                fprintf(stderr, "Error: cannot open '%s': %s\n", path, strerror(errno));
+                status = 1;
+                break;
+            }
+            file_watch = inotify_add_watch(notify, path, IN_MODIFY | IN_ATTRIB);
+            consumed = 0;
+            filled = 0;
+            if (first_open && follow_load_state(state_path, &info, &consumed)) {
+                lseek(fd, consumed, SEEK_SET);
+            }
+            first_open = false;
+        }
+
+        // Read until the buffer is full or the end of the file
+        uint64_t trace_start = trace_begin();
+        ssize_t n = read(fd, buffer + filled, capacity - filled);
+        trace_end(STAGE_STREAM_READ, trace_start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            status = 1;
+            break;
+        }
+        filled += (size_t)n;
+        if (n > 0 && filled < capacity) continue;
+
+        // Convert the complete lines; the last line of a rotated-away
+        // file is terminated once it is drained
+        if (rotated && n == 0 && filled > 0 && buffer[filled-1] != '\n') {
+            if (filled == capacity) {
+                buffer = arena_grow(arena, buffer, capacity, capacity * 2);
+                capacity *= 2;
+            }
+            buffer[filled++] = '\n';
+        }
+        size_t complete = filled;
+        while (complete > 0 && buffer[complete-1] != '\n') complete--;
+        if (complete == 0 && filled == capacity) {
+            buffer = arena_grow(arena, buffer, capacity, capacity * 2);
+            capacity *= 2;
+            continue;
+        }
+        if (complete > 0) {
+            convert(context, buffer, complete, &segment_arena, &sink);
+            trace_start = trace_begin();
+            bool written = sink_flush(&sink);
+            trace_end(STAGE_STREAM_WRITE, trace_start);
+            arena_reset(&segment_arena);
+            if (!written) {
+                perror("writev");
+                status = 1;
+                break;
+            }
+            memmove(buffer, buffer + complete, filled - complete);
+            filled -= complete;
+            consumed += (off_t)complete;
+            follow_save_state(state_path, &info, consumed);
+        }
+        if (n > 0) continue;
+
+        if (rotated) {
+            // Old file drained; follow whatever the path names now
+            if (file_watch >= 0) inotify_rm_watch(notify, file_watch);
+            close(fd);
+            fd = -1;
+            rotated = false;
+            continue;
+        }
+
+        // At the end of the file: check for rotation and truncation
+        // Until a new file appears under the path, writers may still
+        // append to the renamed one, so it is followed until then
+        struct stat current;
+        if (stat(path, &current) == 0 && (current.st_ino != info.st_ino ||
+                                          current.st_dev != info.st_dev)) {
+            rotated = true;     // Drain the old file, then switch
+            continue;
+        }
+        if (fstat(fd, &current) == 0 && current.st_size < consumed + (off_t)filled) {
+            fprintf(stderr, "Note: %s was truncated; reading from the start\n", path);
+            lseek(fd, 0, SEEK_SET);
+            consumed = 0;
+            filled = 0;
+            continue;
+        }
+        if (!follow_wait(notify)) {
+            status = 1;
+            break;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    close(notify);
+    arena_free(&segment_arena);
+    arena_reset(arena);
+    return status;
+}
+#else
+static int follow_segments(SegmentFn convert, const void *context) {
+    (void)convert;
+    (void)context;
+    fprintf(stderr, "Error: --follow needs inotify (Linux)\n");
+    return 1;
+}
+#endif
+
+// Run `convert` over stdin in batches, writing its output to stdout
+// Only complete lines are handed over; the partial last line is carried
+// over to the next batch. A batch grows while input is immediately
+// available and is converted when the buffer is full, when the input
+// would block, or when its first line has waited for the deadline
+// With --follow the input is a growing file instead
+static int stream_segments(SegmentFn convert, const void *context) {
+    if (follow_options.path != NULL) return follow_segments(convert, context);
+#ifndef _WIN32
+    fflush(stdout);
+
+    const StreamBatching *policy = &stream_batching;
+    Arena *arena = scratch_arena();
+    Arena segment_arena = {0};
+    OutputSink sink;
+    StreamStats stats = {0};
+    size_t capacity = policy->batch_size, filled = 0;
+    size_t complete = 0;        // Bytes of complete lines in the buffer
+    double batch_start = 0.0;   // When the first of them was read
+    char *buffer = arena_alloc(arena, capacity);
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    bool at_end = false;
+
+    sink_init(&sink, STDOUT_FILENO);
+    while (!at_end || complete > 0) {
+        FlushReason reason = FLUSH_REASONS;
+        if (at_end) {
+            reason = FLUSH_END;
+        } else if (complete > 0) {
+            double waited = now_seconds() - batch_start;
+            if (filled == capacity) {
+                reason = FLUSH_FULL;
+            } else if (waited >= policy->deadline) {
+                reason = FLUSH_DEADLINE;
+            } else {
+                int timeout = policy->wait_for_input
+                              ? (int)ceil((policy->deadline - waited) * 1e3) : 0;
+                int ready = poll(&input, 1, timeout);
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready == 0) reason = policy->wait_for_input ? FLUSH_DEADLINE : FLUSH_BLOCKED;
+            }
+        }
+
+        if (reason == FLUSH_REASONS) {
+            uint64_t trace_start = trace_begin();
+            ssize_t n = read(STDIN_FILENO, buffer + filled, capacity - filled);
+            trace_end(STAGE_STREAM_READ, trace_start);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("read");
+                break;
+            }
+            if (n == 0) {
+                // Everything left is converted, including a last line
+                // without newline
+                if (complete == 0) batch_start = now_seconds();
+                at_end = true;
+                complete = filled;
+                continue;
+            }
+            filled += (size_t)n;
+
+            // Extend the batch up to the last newline
+            size_t last = filled;
+            while (last > complete && buffer[last-1] != '\n') last--;
+            if (last > complete) {
+                if (complete == 0) batch_start = now_seconds();
+                complete = last;
+            } else if (complete == 0 && filled == capacity) {
+                // A single line longer than the buffer
+                buffer = arena_grow(arena, buffer, capacity, capacity * 2);
+                capacity *= 2;
+            }
+            continue;
+        }
+
+        if (policy->stats) {
+            stream_stats_add(&stats, complete, buffer, reason, now_seconds() - batch_start);
+        }
+        convert(context, buffer, complete, &segment_arena, &sink);
+        uint64_t trace_start = trace_begin();
+        bool written = sink_flush(&sink);
+        trace_end(STAGE_STREAM_WRITE, trace_start);
+        if (!written) {
+            perror("writev");
+            arena_free(&segment_arena);
+            return 1;
+        }
+        arena_reset(&segment_arena);
+
+        memmove(buffer, buffer + complete, filled - complete);
+        filled -= complete;
+        complete = 0;
+        if (at_end) break;
+    }
+
+    if (policy->stats) print_stream_stats(&stats);
+    arena_free(&segment_arena);
+    arena_reset(arena);
+    return 0;
+#else
+    (void)convert;
+    (void)context;
+    fprintf(stderr, "Error: streaming modes are not supported on this platform\n");
+    return 1;
+#endif
+}
+
+// Adapter from the generic segment callback to the CSV converter
+static void csv_segment(const void *context, const char *data, size_t length,
+                        Arena *arena, OutputSink *sink) {
+    const BatchOptions *options = context;
+    if (options->window != NULL) {
+        window_segment(options, data, length, arena, sink);
+    } else if (options->expressions != NULL) {
+        evaluate_csv_segment(options, data, length, arena, sink);
+    } else {
+        convert_csv_segment(options, data, length, arena, sink);
+    }
+}
+
+// CSV mode: convert one column of a delimited stream, passing every other
+// byte through untouched
+static int run_batch_csv(const BatchOptions *options) {
+#ifndef _WIN32
+    // An identity conversion changes nothing, so skip parsing entirely
+    if (options->plan.scale == 1.0 && options->plan.offset == 0.0 &&
+        options->expressions == NULL && options->window == NULL &&
+        follow_options.path == NULL) {
+        fflush(stdout);
+        return passthrough_fd(STDIN_FILENO, STDOUT_FILENO) ? 0 : 1;
+    }
+#endif
+    int status = stream_segments(csv_segment, options);
+    if (options->window != NULL) {
+        int finished = finish_windows(options->window, options->delimiter);
+        if (status == 0) status = finished;
+    }
+    return status;
+}
+
+// Text batch mode: one value per line from stdin, streamed like CSV mode,
+// so a slow live feed is converted line by line and a file in full buffers
+static int run_batch_text(const BatchOptions *options) {
+    long line_number = 0;
+    TextStream stream = { options, &line_number };
+#ifndef _WIN32
+    return stream_segments(text_segment, &stream);
+#else
+    // No poll() here: convert line by line
+    Arena *arena = scratch_arena();
+    Arena line_arena = {0};
+    OutputSink sink;
+    bool written = true;
+    char *line;
+    fflush(stdout);
+    sink_init(&sink, STDOUT_FILENO);
+    while (written && (line = arena_read_line(&line_arena, stdin)) != NULL) {
+        text_segment(&stream, line, strlen(line), arena, &sink);
+        written = sink_flush(&sink);
+        arena_reset(arena);
+        arena_reset(&line_arena);
+    }
+    arena_free(&line_arena);
+    return written ? 0 : 1;
+#endif
+}
+
+// Units of the imperial/US customary system; everything else counts as metric
+// The first ones are also the units annotate mode converts into
+static const char *imperial_symbols[] = {
+    "in", "ft", "yd", "mi", "oz", "lb", "°F", "gal", "qt", "pt",
+    "ft²", "mi²", "ac", "psi", "hp",
+    "fur", "ch", "ftm", "hh", "lea", "tsp", "tbsp", "fl oz", "cup", "gi", "st", "ton"
+};
+#define IMPERIAL_TARGET_COUNT 15
+
+// Index of a unit in imperial_symbols[], or -1 for metric units
+static int imperial_index(const Unit *unit) {
+    for (size_t i = 0; i < sizeof(imperial_symbols) / sizeof(imperial_symbols[0]); i++) {
+        if (strcmp(unit->symbol, imperial_symbols[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static bool is_imperial_unit(const Unit *unit) {
+    return imperial_index(unit) >= 0;
+}
+
+// Add one name to the trie of the matcher; the first unit to claim a name
+// keeps it, as in find_unit()
+static void matcher_insert(UnitMatcher *m, const char *name, int unit) {
+    int state = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        int16_t *slot = &m->next[state * m->class_count + m->byte_class[*p]];
+        if (*slot < 0) {
+            *slot = (int16_t)m->state_count;
+            m->depth[m->state_count] = (uint8_t)(m->depth[state] + 1);
+            m->state_count++;
+        }
+        state = *slot;
+    }
+    if (m->unit[state] < 0) m->unit[state] = (int16_t)unit;
+}
+
+// Build the automaton: a trie of all names, then failure links in
+// breadth-first order folded into the transition table
+static void build_unit_matcher(UnitMatcher *m) {
+    size_t max_states = 1;
+    memset(m->byte_class, 0, sizeof(m->byte_class));
+    m->class_count = 1;
+    for (int i = 0; i < unit_count; i++) {
+        for (int j = -1; j < units[i].alias_count; j++) {
+            const char *name = j < 0 ? units[i].symbol : units[i].aliases[j];
+            for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+                if (m->byte_class[*p] == 0) m->byte_class[*p] = (uint8_t)m->class_count++;
+            }
+            max_states += strlen(name);
+        }
+    }
+
+    m->next = malloc(max_states * m->class_count * sizeof(int16_t));
+    m->depth = calloc(max_states, sizeof(uint8_t));
+    m->unit = malloc(max_states * sizeof(int16_t));
+    int *queue = malloc(max_states * sizeof(int));
+    int16_t *fail = calloc(max_states, sizeof(int16_t));
+    if (!m->next || !m->depth || !m->unit || !queue || !fail) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < max_states * m->class_count; i++) m->next[i] = -1;
+    for (size_t i = 0; i < max_states; i++) m->unit[i] = -1;
+
+    m->state_count = 1;
+    for (int i = 0; i < unit_count; i++) {
+        for (int j = -1; j < units[i].alias_count; j++) {
+            const char *name = j < 0 ? units[i].symbol : units[i].aliases[j];
+            if (name[0] != '\0') matcher_insert(m, name, i);
+        }
+    }
+
+    // Missing transitions take the transition of the failure state, so
+    // the scan never has to follow failure links itself
+    int head = 0, tail = 0;
+    for (int c = 0; c < m->class_count; c++) {
+        int16_t *slot = &m->next[c];
+        if (*slot < 0) {
+            *slot = 0;
+        } else {
+            fail[*slot] = 0;
+            queue[tail++] = *slot;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (int c = 0; c < m->class_count; c++) {
+            int16_t *slot = &m->next[state * m->class_count + c];
+            int16_t fallback = m->next[fail[state] * m->class_count + c];
+            if (*slot < 0) {
+                *slot = fallback;
+            } else {
+                fail[*slot] = fallback;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+    m->built = true;
+}
+
+// Get the unit matcher, building it on first use
+const UnitMatcher *get_unit_matcher() {
+    if (!unit_matcher.built) build_unit_matcher(&unit_matcher);
+    return &unit_matcher;
+}
+
+// True if a unit name may end before p: end of text, or a byte that
+// cannot continue a word or a compound unit such as "ft-lb" or "m/s"
+static bool unit_ends_at(const char *p, const char *end) {
+    if (p == end) return true;
+    unsigned char c = (unsigned char)*p;
+    if (isalnum(c) || c == '_' || c >= 0x80) return false;
+    if ((c == '-' || c == '/' || c == '^' || c == '*') && p + 1 < end &&
+        (isalnum((unsigned char)p[1]) || (unsigned char)p[1] >= 0x80)) {
+        return false;
+    }
+    return true;
+}
+
+// Unit names that are also common words or abbreviations ("5 in b",
+// "21st century"); annotate mode only takes them as units when no
+// lowercase word follows
+static const char *ambiguous_unit_names[] = { "in", "st", "pt", "ch", "gi", "hh", "fn" };
+
+// True if [name, name+length) is ambiguous and the next word, after
+// spaces or tabs, starts with a lowercase letter
+static bool ambiguous_unit_at(const char *name, size_t length, const char *end) {
+    bool ambiguous = false;
+    for (size_t i = 0; i < sizeof(ambiguous_unit_names) / sizeof(ambiguous_unit_names[0]); i++) {
+        if (strlen(ambiguous_unit_names[i]) == length &&
+            memcmp(ambiguous_unit_names[i], name, length) == 0) {
+            ambiguous = true;
+        }
+    }
+    if (!ambiguous) return false;
+    const char *p = name + length;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p < end && islower((unsigned char)*p);
+}
+
+// Longest unit name starting exactly at p
+// The walk follows the automaton from the root and stops as soon as a
+// transition falls back along a failure link, since such a state no
+// longer describes a match starting at p
+static int match_unit_at(const UnitMatcher *m, const char *p, const char *end,
+                         size_t *length) {
+    int state = 0, best = -1;
+    for (size_t i = 0; p + i < end; i++) {
+        state = m->next[state * m->class_count + m->byte_class[(unsigned char)p[i]]];
+        if (m->depth[state] != i + 1) break;
+        if (m->unit[state] >= 0 && unit_ends_at(p + i + 1, end)) {
+            best = m->unit[state];
+            *length = i + 1;
+        }
+    }
+    return best;
+}
+
+// Offset of the first ASCII digit in [p, end), or end - p if there is none
+// Eight bytes are tested at once (SWAR); a hit is located bytewise
+static size_t find_digit(const char *p, const char *end) {
+    const char *start = p;
+    while (end - p >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        if (swar_digit_mask(x) != 0) break;
+        p += 8;
+    }
+    while (p < end && (*p < '0' || *p > '9')) p++;
+    return (size_t)(p - start);
+}
+
+// End of the number whose first digit is at p: digits, an optional
+// fraction and an optional exponent
+static const char *scan_number(const char *p, const char *end) {
+    while (p < end && isdigit((unsigned char)*p)) p++;
+    if (p + 1 < end && *p == '.' && isdigit((unsigned char)p[1])) {
+        p++;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+    }
+    if (p + 1 < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        if (q + 1 < end && (*q == '-' || *q == '+')) q++;
+        if (isdigit((unsigned char)*q)) {
+            p = q;
+            while (p < end && isdigit((unsigned char)*p)) p++;
+        }
+    }
+    return p;
+}
+
+// True if a number may start at p: not inside a word, a longer number or
+// a digit group like "1,5"
+static bool number_starts_at(const char *p, const char *data) {
+    if (p == data) return true;
+    unsigned char c = (unsigned char)p[-1];
+    if (isalnum(c) || c == '_' || c == '.' || c >= 0x80) return false;
+    if (c == ',' && p - 1 > data && isdigit((unsigned char)p[-2])) return false;
+    return true;
+}
+
+// Format a quantity in the target system
+// Returns false if the unit already belongs to it or has no counterpart
+static bool annotate_quantity(const AnnotateOptions *options, double value, int unit_index,
+                              char *buffer, size_t size) {
+    const Unit *unit = &units[unit_index];
+    bool imperial = is_imperial_unit(unit);
+    if (imperial == (options->system == SYSTEM_IMPERIAL)) return false;
+
+    ConversionPlan plan;
+    if (unit->is_temp) {
+        const char *target = options->system == SYSTEM_SI ? "°C" : "°F";
+        if (!plan_conversion(unit->symbol, target, &plan)) return false;
+        snprintf(buffer, size, "%.3g %s", value * plan.scale + plan.offset, target);
+        return true;
+    }
+
+    double base_value = value * unit->factor;
+    if (options->system == SYSTEM_SI) {
+        const ScaleTable *table = get_scale_table(unit->category);
+        if (table == NULL) return false;
+        format_scaled(table, classify_scale(table, base_value), base_value, buffer, size);
+        return true;
+    }
+
+    // Largest imperial unit of the category that keeps the value >= 1,
+    // or the smallest one for tiny values
+    double magnitude = fabs(base_value);
+    const Unit *best = NULL;
+    for (int i = 0; i < unit_count; i++) {
+        const Unit *candidate = &units[i];
+        int index = imperial_index(candidate);
+        if (strcmp(candidate->category, unit->category) != 0 ||
+            index < 0 || index >= IMPERIAL_TARGET_COUNT) {
+            continue;
+        }
+        bool fits = candidate->factor <= magnitude;
+        bool best_fits = best != NULL && best->factor <= magnitude;
+        if (best == NULL ||
+            (fits && (!best_fits || candidate->factor > best->factor)) ||
+            (!fits && !best_fits && candidate->factor < best->factor)) {
+            best = candidate;
+        }
+    }
+    if (best == NULL) return false;
+    snprintf(buffer, size, "%.3g %s", base_value / best->factor, best->symbol);
+    return true;
+}
+
+// Annotate mode: find number + unit quantities in the complete lines
+// [data, data+length) and append (or substitute) their conversion
+// Digit-free spans are skipped eight bytes at a time; unit names are
+// matched with the automaton right after each number
+static void annotate_segment(const void *context, const char *data, size_t length,
+                             Arena *arena, OutputSink *sink) {
+    const AnnotateOptions *options = context;
+    const char *end = data + length, *cursor = data, *p = data;
+    uint64_t trace_start = trace_begin();
+
+    while (p < end) {
+        p += find_digit(p, end);
+        if (p == end) break;
+
+        // Take a leading decimal point, and a sign that is not a hyphen
+        const char *number = p;
+        if (number > data && number[-1] == '.') number--;
+        if (number > data && (number[-1] == '-' || number[-1] == '+') &&
+            number_starts_at(number - 1, data)) {
+            number--;
+        }
+        const char *number_end = scan_number(p, end);
+        if (!number_starts_at(number, data) || number_end - number >= 64) {
+            p = number_end;
+            continue;
+        }
+
+        const char *unit_start = number_end;
+        if (unit_start < end && *unit_start == ' ') unit_start++;
+        size_t unit_length = 0;
+        int unit = match_unit_at(options->matcher, unit_start, end, &unit_length);
+        if (unit < 0 || ambiguous_unit_at(unit_start, unit_length, end)) {
+            p = number_end;
+            continue;
+        }
+
+        char text[64], converted[64];
+        memcpy(text, number, (size_t)(number_end - number));
+        text[number_end - number] = '\0';
+        const char *quantity_end = unit_start + unit_length;
+        if (!annotate_quantity(options, strtod(text, NULL), unit, converted, sizeof(converted))) {
+            p = quantity_end;
+            continue;
+        }
+
+        size_t fragment_size = sizeof(converted) + 4;
+        char *fragment = arena_alloc(arena, fragment_size);
+        int n;
+        if (options->replace) {
+            sink_add(sink, cursor, (size_t)(number - cursor));
+            n = snprintf(fragment, fragment_size, "%s", converted);
+        } else {
+            sink_add(sink, cursor, (size_t)(quantity_end - cursor));
+            n = snprintf(fragment, fragment_size, " (%s)", converted);
+        }
+        sink_add(sink, fragment, (size_t)n);
+        cursor = p = quantity_end;
+    }
+    sink_add(sink, cursor, (size_t)(end - cursor));
+    trace_end(STAGE_ANNOTATE_SCAN, trace_start);
+}
+
+// Annotate mode: copy stdin to stdout with every recognized quantity
+// converted to `system`
+int run_annotate(UnitSystem system, bool replace) {
+    AnnotateOptions options = { system, replace, get_unit_matcher() };
+    return stream_segments(annotate_segment, &options);
+}
+
+// Parse a sysfs cpulist such as "0-3,8-11" into `cpus`
+// Returns the number of CPUs stored, or -1 if the text is malformed
+static int parse_cpu_list(const char *text, int *cpus, int max) {
+    int count = 0;
+    const char *p = text;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return -1;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && count < max; cpu++) cpus[count++] = (int)cpu;
+        if (*p == ',') p++;
+        else if (*p && *p != '\n') return -1;
+    }
+    return count;
+}
+
+// True if this process may run on `cpu`
+static bool cpu_allowed(int cpu) {
+#ifdef __linux__
+    static cpu_set_t allowed;
+    static bool loaded = false, known = false;
+    if (!loaded) {
+        known = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        loaded = true;
+    }
+    return !known || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed));
+#else
+    (void)cpu;
+    return true;
+#endif
+}
+
+// Read the NUMA layout from /sys/devices/system/node, keeping the CPUs in
+// our affinity mask grouped by node. Without the directory (or with one
+// node) the machine is a single node of all online CPUs
+static void detect_cpu_topology(CpuTopology *topology) {
+    memset(topology, 0, sizeof(*topology));
+#ifndef _WIN32
+    int nodes[MAX_NUMA_NODES], node_count = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL && node_count < MAX_NUMA_NODES) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) == 1) nodes[node_count++] = node;
+    }
+    if (dir) closedir(dir);
+
+    // readdir() order is arbitrary; visit nodes by number
+    for (int i = 1; i < node_count; i++) {
+        for (int j = i; j > 0 && nodes[j-1] > nodes[j]; j--) {
+            int node = nodes[j];
+            nodes[j] = nodes[j-1];
+            nodes[j-1] = node;
+        }
+    }
+    for (int n = 0; n < node_count; n++) {
+        int cpus[MAX_PIN_CPUS], count = -1;
+        char path[64], text[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[n]);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) continue;
+        if (fgets(text, sizeof(text), file)) count = parse_cpu_list(text, cpus, MAX_PIN_CPUS);
+        fclose(file);
+
+        // Memory-only nodes and nodes outside our mask get no workers
+        int start = topology->cpu_count;
+        for (int i = 0; i < count && topology->cpu_count < MAX_PIN_CPUS; i++) {
+            if (cpu_allowed(cpus[i])) topology->cpus[topology->cpu_count++] = cpus[i];
+        }
+        if (topology->cpu_count == start) continue;
+        topology->node_ids[topology->node_count] = nodes[n];
+        topology->node_start[topology->node_count++] = start;
+    }
+#endif
+    if (topology->cpu_count == 0) {
+        long online = 1;
+#ifndef _WIN32
+        online = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        for (int cpu = 0; cpu < online && topology->cpu_count < MAX_PIN_CPUS; cpu++) {
+            if (cpu_allowed(cpu)) topology->cpus[topology->cpu_count++] = cpu;
+        }
+        if (topology->cpu_count == 0) topology->cpus[topology->cpu_count++] = 0;
+        topology->node_count = 1;
+        topology->node_ids[0] = 0;
+        topology->node_start[0] = 0;
+    }
+    topology->node_start[topology->node_count] = topology->cpu_count;
+}
+
+// Parse the argument of --pin: auto, compact, scatter, none or a cpulist
+bool parse_pin_policy(const char *text) {
+    static const char *names[] = {"none", "auto", "compact", "scatter"};
+    pin_options.policy = PIN_LIST;
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(text, names[i]) == 0) pin_options.policy = (PinPolicy)i;
+    }
+    if (pin_options.policy == PIN_LIST) {
+        pin_options.list_count = parse_cpu_list(text, pin_options.list, MAX_PIN_CPUS);
+        if (pin_options.list_count <= 0) {
+            fprintf(stderr, "Error: --pin expects auto, compact, scatter, none or a CPU list, got '%s'\n",
+                    text);
+            return false;
+        }
+    }
+    if (pin_options.policy != PIN_NONE) detect_cpu_topology(&pin_options.topology);
+    return true;
+}
+
+// CPU for worker `index` under the --pin policy, -1 to leave it unpinned
+// On a single node compact and scatter are the same plain pinning
+int pin_cpu(int index) {
+    const CpuTopology *topology = &pin_options.topology;
+    PinPolicy policy = pin_options.policy;
+    if (policy == PIN_NONE) return -1;
+    if (policy == PIN_LIST) return pin_options.list[index % pin_options.list_count];
+    if (policy == PIN_AUTO) policy = topology->node_count > 1 ? PIN_SCATTER : PIN_COMPACT;
+    if (policy == PIN_COMPACT) return topology->cpus[index % topology->cpu_count];
+
+    // Scatter: worker i goes to node i % nodes; nodes with fewer CPUs wrap
+    int node = index % topology->node_count;
+    int start = topology->node_start[node], size = topology->node_start[node + 1] - start;
+    return topology->cpus[start + (index / topology->node_count) % size];
+}
+
+// Bind the calling thread to `cpu`; memory it touches first is then
+// placed on that CPU's node by the kernel's first-touch policy
+bool pin_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Pin the calling thread as worker `index`, warning once per run on failure
+static void pin_worker(int index) {
+    static atomic_bool warned;
+    int cpu = pin_cpu(index);
+    if (cpu >= 0 && !pin_thread(cpu) && !atomic_exchange(&warned, true)) {
+        fprintf(stderr, "Warning: cannot pin to CPU %d; continuing unpinned\n", cpu);
+    }
+}
+
+// Unit pairs seen during a replay, each resolved once per worker
+typedef struct {
+    char from[16];
+    char to[16];
+    ConversionPlan plan;
+    bool valid;
+} ReplayPair;
+
+// One replay worker. It owns the lines that start in its byte range of
+// the file and reads, parses and checks them in its own arena, so with
+// --pin every buffer it uses is first touched (and placed) on its node
+// Workers are merged after the join
+typedef struct {
+    const char *path;
+    int fd;
+    const char *blob_path;  // Values of batch records (path.blob)
+    int blob_fd;            // -1 if there is no blob
+    long long begin, end;   // Byte range of the file
+    int index;              // Worker number, for --pin
+    double tolerance;
+    ReplayEntry *entries;   // Lines numbered from 1 within the range
+    size_t count;
+    ReplayPair *pairs;      // Worker-local pair table
+    int pair_count, pair_capacity;
+    ReplayStats *stats;     // pair_count entries
+    size_t *deviations;     // Indices into entries
+    size_t deviation_count;
+    long lines;             // Lines owned, to number the next worker's
+    long unresolved;
+    long missing_batches;   // Batch records whose values could not be read
+    bool failed;
+    Arena arena;
+} ReplayWorker;
+
+// Relative error of a stored result against a recomputed one
+static double relative_error(double stored, double expected) {
+    double scale = fabs(expected) > 1e-300 ? fabs(expected) : 1e-300;
+    return fabs(stored - expected) / scale;
+}
+
+// Find or add a unit pair in the worker's pair table
+static int replay_pair_index(ReplayWorker *worker, const char *from, const char *to) {
+    for (int i = worker->pair_count - 1; i >= 0; i--) {
+        const ReplayPair *pair = &worker->pairs[i];
+        if (strcmp(pair->from, from) == 0 && strcmp(pair->to, to) == 0) {
+            metrics_count(METRIC_REPLAY_PAIR_HITS);
+            return pair->valid ? i : -1;
+        }
+    }
+    metrics_count(METRIC_REPLAY_PAIR_MISSES);
+    if (worker->pair_count == MAX_REPLAY_PAIRS) return -1;
+    if (worker->pair_count == worker->pair_capacity) {
+        size_t size = worker->pair_capacity * sizeof(ReplayPair);
+        worker->pairs = arena_grow(&worker->arena, worker->pairs, size, size * 2);
+        worker->pair_capacity *= 2;
+    }
+
+    ReplayPair *pair = &worker->pairs[worker->pair_count++];
+    snprintf(pair->from, sizeof(pair->from), "%s", from);
+    snprintf(pair->to, sizeof(pair->to), "%s", to);
+    pair->valid = plan_conversion(from, to, &pair->plan);
+    return pair->valid ? worker->pair_count - 1 : -1;
+}
+
+// Read up to `size` bytes of the replay file or blob at `offset`, through
+// `fd`, or by opening `path` where there is no pread()
+static long long replay_read(int fd, const char *path, char *buffer, size_t size,
+                             long long offset) {
+#ifndef _WIN32
+    (void)path;
+    ssize_t n;
+    do {
+        n = pread(fd, buffer, size, (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    return n;
+#else
+    (void)fd;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL || fseek(file, (long)offset, SEEK_SET) != 0) {
+        if (file) fclose(file);
+        return -1;
+    }
+    size_t n = fread(buffer, 1, size, file);
+    fclose(file);
+    return (long long)n;
+#endif
+}
+
+// Read the worker's range into its arena, extended to the newline ending
+// its last line, plus the byte before it to tell whether a line starts at
+// `begin`. Returns the first owned line and sets `*limit` past the last
+static char *replay_read_range(ReplayWorker *worker, char **limit) {
+    long long start = worker->begin > 0 ? worker->begin - 1 : 0;
+    size_t end = (size_t)(worker->end - start);
+    size_t capacity = end + 256, filled = 0, searched = end ? end - 1 : 0;
+    char *buffer = arena_alloc(&worker->arena, capacity + 1);
+
+    for (;;) {
+        if (filled == capacity) {
+            buffer = arena_grow(&worker->arena, buffer, capacity + 1, capacity * 2 + 1);
+            capacity *= 2;
+        }
+        long long n = replay_read(worker->fd, worker->path, buffer + filled, capacity - filled,
+                                  start + filled);
+        if (n < 0) {
+            worker->failed = true;
+            return NULL;
+        }
+        if (n == 0) break;
+        filled += (size_t)n;
+        if (filled > searched) {
+            char *newline = memchr(buffer + searched, '\n', filled - searched);
+            if (newline) {
+                filled = (size_t)(newline - buffer) + 1;
+                break;
+            }
+            searched = filled;
+        }
+    }
+    buffer[filled] = '\0';
+    *limit = buffer + filled;
+
+    // Skip the line running into the range from the previous worker's
+    char *first = buffer;
+    if (worker->begin > 0) {
+        char *newline = memchr(buffer, '\n', filled < end ? filled : end);
+        first = newline && newline + 1 < buffer + end ? newline + 1 : *limit;
+    }
+    return first;
+}
+
+// Read the `count` (value, result) pairs of a batch record from the blob
+static bool replay_read_batch(const ReplayWorker *worker, long long offset, long count,
+                              double *pairs) {
+    size_t size = (size_t)count * 2 * sizeof(double), done = 0;
+    if (worker->blob_fd < 0) return false;
+    while (done < size) {
+        long long n = replay_read(worker->blob_fd, worker->blob_path, (char *)pairs + done,
+                                  size - done, offset + (long long)done);
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+// Parse the owned lines, resolving each distinct unit pair once
+// A batch record becomes one entry per value, read from the blob; if
+// its values are missing only the first value in the line is checked
+static void replay_parse_range(ReplayWorker *worker) {
+    uint64_t trace_start = trace_begin();
+    char *limit, *line = replay_read_range(worker, &limit);
+    size_t capacity = 1024, batch_capacity = 0;
+    double *batch = NULL;
+    worker->pair_capacity = 16;
+    worker->pairs = arena_alloc(&worker->arena, worker->pair_capacity * sizeof(ReplayPair));
+    worker->entries = arena_alloc(&worker->arena, capacity * sizeof(ReplayEntry));
+
+    while (line != NULL && line < limit) {
+        char *newline = memchr(line, '\n', (size_t)(limit - line));
+        char *next = newline ? newline + 1 : limit;
+        char from[16], to[16];
+        double value, result;
+        long batch_count = 0;
+        long long blob_offset = 0;
+        if (newline) *newline = '\0';
+        worker->lines++;
+        int fields = sscanf(line, "%15[^,],%15[^,],%lf,%lf,%*[^,],%ld,%lld", from, to,
+                            &value, &result, &batch_count, &blob_offset);
+        if (fields >= 4) {
+            size_t n = 1;
+            if (fields == 6 && batch_count > 1) {
+                if ((size_t)batch_count > batch_capacity) {
+                    batch_capacity = (size_t)batch_count;
+                    batch = arena_alloc(&worker->arena, batch_capacity * 2 * sizeof(double));
+                }
+                if (replay_read_batch(worker, blob_offset, batch_count, batch)) {
+                    n = (size_t)batch_count;
+                } else {
+                    worker->missing_batches++;
+                }
+            }
+            while (worker->count + n > capacity) {
+                worker->entries = arena_grow(&worker->arena, worker->entries,
+                                             capacity * sizeof(ReplayEntry),
+                                             capacity * 2 * sizeof(ReplayEntry));
+                capacity *= 2;
+            }
+            int pair = replay_pair_index(worker, from, to);
+            for (size_t k = 0; k < n; k++) {
+                ReplayEntry *entry = &worker->entries[worker->count++];
+                entry->value = n > 1 ? batch[2 * k] : value;
+                entry->result = n > 1 ? batch[2 * k + 1] : result;
+                entry->line = worker->lines;
+                entry->pair = pair;
+            }
+            if (pair < 0) worker->unresolved += (long)n;
+        }
+        line = next;
+    }
+    trace_end(STAGE_REPLAY_PARSE, trace_start);
+}
+
+// Replay one range of the history
+static void *replay_worker(void *arg) {
+    ReplayWorker *worker = arg;
+    size_t capacity = 256;
+
+    pin_worker(worker->index);
+    replay_parse_range(worker);
+    if (worker->failed) return NULL;
+
+    uint64_t trace_start = trace_begin();
+    size_t stats_size = (worker->pair_count ? worker->pair_count : 1) * sizeof(ReplayStats);
+    worker->stats = arena_alloc(&worker->arena, stats_size);
+    memset(worker->stats, 0, stats_size);
+    worker->deviations = arena_alloc(&worker->arena, capacity * sizeof(size_t));
+    for (size_t i = 0; i < worker->count; i++) {
+        const ReplayEntry *entry = &worker->entries[i];
+        if (entry->pair < 0) continue;
+
+        const ConversionPlan *plan = &worker->pairs[entry->pair].plan;
+        double expected = entry->value * plan->scale + plan->offset;
+        double error = relative_error(entry->result, expected);
+
+        ReplayStats *stats = &worker->stats[entry->pair];
+        stats->count++;
+        stats->sum_error += error;
+        if (error > stats->max_error) stats->max_error = error;
+        if (error > worker->tolerance) {
+            stats->deviating++;
+            if (worker->deviation_count == capacity) {
+                worker->deviations = arena_grow(&worker->arena, worker->deviations,
+                                                capacity * sizeof(size_t),
+                                                capacity * 2 * sizeof(size_t));
+                capacity *= 2;
+            }
+            worker->deviations[worker->deviation_count++] = i;
+        }
+    }
+    trace_end(STAGE_REPLAY_WORKER, trace_start);
+    return NULL;
+}
+
+// Print where --pin placed the replay workers
+static void print_pinning(int threads) {
+    const char *names[] = {"none", "auto", "compact", "scatter", "list"};
+    fprintf(stderr, "Pinned %d thread%s (%s, %d NUMA node%s):", threads,
+            threads == 1 ? "" : "s", names[pin_options.policy], pin_options.topology.node_count,
+            pin_options.topology.node_count == 1 ? "" : "s");
+    for (int t = 0; t < threads; t++) fprintf(stderr, "%s%d", t ? "," : " ", pin_cpu(t));
+    fprintf(stderr, "\n");
+}
+
+// Replay every history record against the current catalogue in parallel
+// Reports records whose stored result deviates by more than `tolerance`
+// (relative) and per-pair error statistics
+int run_replay(const char *path, double tolerance, int threads) {
+    long long size = 0;
+    int fd = -1, blob_fd = -1;
+    char blob_path[1024];
+    snprintf(blob_path, sizeof(blob_path), "%s.blob", path);
+#ifndef _WIN32
+    // The live history is opened with its blob under the shared lock, so
+    // a compaction cannot replace one without the other; the lock is
+    // dropped once both are open. A replay never creates the file
+    struct stat info;
+    bool live = strcmp(path, history_path) == 0;
+    fd = live ? history_open_shared() : open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &info) == 0) size = (long long)info.st_size;
+    if (fd >= 0) blob_fd = open(blob_path, O_RDONLY);
+    if (live && fd >= 0) history_flock(fd, LOCK_UN);
+#else
+    FILE *probe = fopen(path, "rb");
+    if (probe && fseek(probe, 0, SEEK_END) == 0) size = ftell(probe);
+    if (probe) {
+        fclose(probe);
+        fd = 0;
+    }
+    probe = fopen(blob_path, "rb");
+    if (probe) {
+        fclose(probe);
+        blob_fd = 0;
+    }
+#endif
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_REPLAY_THREADS) threads = MAX_REPLAY_THREADS;
+    if (threads > size / REPLAY_MIN_RANGE + 1) threads = (int)(size / REPLAY_MIN_RANGE + 1);
+
+    // Workers are set up here but allocate everything they touch themselves
+    Arena *arena = scratch_arena();
+    ReplayWorker *workers = arena_alloc(arena, threads * sizeof(ReplayWorker));
+    for (int t = 0; t < threads; t++) {
+        ReplayWorker *worker = &workers[t];
+        memset(worker, 0, sizeof(*worker));
+        worker->path = path;
+        worker->fd = fd;
+        worker->blob_path = blob_path;
+        worker->blob_fd = blob_fd;
+        worker->index = t;
+        worker->tolerance = tolerance;
+        worker->begin = size * t / threads;
+        worker->end = size * (t + 1) / threads;
+    }
+    if (pin_options.policy != PIN_NONE) print_pinning(threads);
+
+#ifndef _WIN32
+    // A worker whose thread cannot be created runs on this one instead
+    pthread_t thread_ids[MAX_REPLAY_THREADS];
+    bool started[MAX_REPLAY_THREADS] = {false};
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&thread_ids[t], NULL, replay_worker, &workers[t]) == 0;
+        if (!started[t]) replay_worker(&workers[t]);
+    }
+    replay_worker(&workers[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(thread_ids[t], NULL);
+    }
+    close(fd);
+    if (blob_fd >= 0) close(blob_fd);
+#else
+    for (int t = 0; t < threads; t++) replay_worker(&workers[t]);
+#endif
+
+    for (int t = 0; t < threads; t++) {
+        if (workers[t].failed) {
+            fprintf(stderr, "Error: reading '%s' failed\n", path);
+            for (int k = 0; k < threads; k++) arena_free(&workers[k].arena);
+            arena_reset(arena);
+            return 1;
+        }
+    }
+
+    // Merge the pair tables in worker order, so pairs are listed in order
+    // of first appearance in the file
+    static ReplayPair pairs[MAX_REPLAY_PAIRS];
+    static ReplayStats totals[MAX_REPLAY_PAIRS];
+    int pair_count = 0;
+    size_t count = 0;
+    long deviating = 0, unresolved = 0, missing_batches = 0, line_base = 0;
+    for (int t = 0; t < threads; t++) {
+        const ReplayWorker *worker = &workers[t];
+        for (int p = 0; p < worker->pair_count; p++) {
+            const ReplayPair *pair = &worker->pairs[p];
+            int g = pair_count - 1;
+            while (g >= 0 && (strcmp(pairs[g].from, pair->from) != 0 ||
+                              strcmp(pairs[g].to, pair->to) != 0)) {
+                g--;
+            }
+            if (g < 0) {
+                if (pair_count == MAX_REPLAY_PAIRS) continue;
+                g = pair_count++;
+                pairs[g] = *pair;
+                memset(&totals[g], 0, sizeof(totals[g]));
+            }
+            const ReplayStats *stats = &worker->stats[p];
+            totals[g].count += stats->count;
+            totals[g].deviating += stats->deviating;
+            totals[g].sum_error += stats->sum_error;
+            if (stats->max_error > totals[g].max_error) totals[g].max_error = stats->max_error;
+        }
+
+        // Workers cover consecutive ranges, so deviations come out in file order
+        for (size_t k = 0; k < worker->deviation_count; k++) {
+            const ReplayEntry *entry = &worker->entries[worker->deviations[k]];
+            const ReplayPair *pair = &worker->pairs[entry->pair];
+            double expected = entry->value * pair->plan.scale + pair->plan.offset;
+            printf("line %ld: %.15g %s -> %s stored %.15g, now %.15g (relative error %.3g)\n",
+                   line_base + entry->line, entry->value, pair->from, pair->to, entry->result,
+                   expected, relative_error(entry->result, expected));
+            deviating++;
+        }
+        count += worker->count;
+        unresolved += worker->unresolved;
+        missing_batches += worker->missing_batches;
+        line_base += worker->lines;
+    }
+
+    printf("\n%-12s %-12s %10s %10s %12s %12s\n",
+           "From", "To", "Count", "Deviating", "Max error", "Mean error");
+    printf("----------------------------------------------------------------------\n");
+    for (int p = 0; p < pair_count; p++) {
+        if (!pairs[p].valid) continue;
+        printf("%-12s %-12s %10ld %10ld %12.3g %12.3g\n", pairs[p].from, pairs[p].to,
+               totals[p].count, totals[p].deviating, totals[p].max_error,
+               totals[p].count ? totals[p].sum_error / totals[p].count : 0.0);
+    }
+    printf("\n%zu entries replayed with %d thread%s, %ld deviating beyond %g, %ld unresolved\n",
+           count, threads, threads == 1 ? "" : "s", deviating, tolerance, unresolved);
+    if (missing_batches > 0) {
+        printf("%ld batch record%s without values in %s; only their first value was checked\n",
+               missing_batches, missing_batches == 1 ? "" : "s", blob_path);
+    }
+
+    for (int t = 0; t < threads; t++) arena_free(&workers[t].arena);
+    arena_reset(arena);
+    return deviating > 0 ? 3 : 0;
+}
+
+// Conversion paths checked by the differential harness
+typedef enum {
+    PATH_CONVERT_VALUE,     // convert_value() / convert_temperature()
+    PATH_BATCH,             // convert_batch()
+    PATH_BATCH_F32,         // convert_batch_f32()
+    PATH_INTEGER,           // convert_integer() / convert_integer_batch()
+    PATH_DECIMAL,           // convert_decimal()
+    PATH_SCALE,             // classify_scale() / classify_scale_batch()
+    PATH_TOKENIZER,         // parse_number()
+    PATH_EXPRESSION,        // convert() in --where / --derive expressions
+    PATH_CONTAINER,         // container_read()
+    PATH_COUNT
+} VerifyPath;
+
+// Per-path error budget and results
+typedef struct {
+    const char *name;
+    double budget;          // Allowed error in units of the path's last place
+    long checked;
+    long failures;
+    double max_error;
+} VerifyStats;
+
+#define VERIFY_BLOCK 37     // Odd block length so kernels run their loop tails
+#define VERIFY_MAX_REPORTS 20
+#define VERIFY_CONTAINER_COLUMNS 20 // Columns of the temporary container, all read before any is checked
+#define VERIFY_CONTAINER_ROWS 16 // Its block rows, so a block of values ends in a partial block
+#define VERIFY_CONTAINER_EVERY 8 // Blocks of values per container written
+
+// xorshift64* generator, deterministic for a given seed
+static uint64_t verify_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * UINT64_C(2685821657736338717);
+}
+
+// Random double across all magnitudes: normal values over the whole
+// exponent range, small integers and decimals, subnormals, huge values,
+// zeros, infinities and NaN, either sign
+static double verify_value(uint64_t *state) {
+    uint64_t r = verify_random(state);
+    double sign = (r & 1) ? -1.0 : 1.0;
+    double v;
+
+    switch ((r >> 1) % 16) {
+        case 0: v = (double)(verify_random(state) % 1000); break;
+        case 1: v = (double)(verify_random(state) % 100000) / 1000.0; break;
+        case 2: {
+            uint64_t bits = verify_random(state) & UINT64_C(0x000fffffffffffff);
+            memcpy(&v, &bits, sizeof(v));   // Subnormal (or zero)
+            break;
+        }
+        case 3: v = DBL_MAX / (double)(1 + verify_random(state) % 1000000); break;
+        case 4: v = (r >> 8) % 3 == 0 ? INFINITY : ((r >> 8) % 3 == 1 ? NAN : 0.0); break;
+        default: {
+            // Uniform in exponent: any finite normal double
+            uint64_t bits = verify_random(state) & UINT64_C(0x7fffffffffffffff);
+            uint64_t exponent = 1 + verify_random(state) % 2046;
+            bits = (bits & UINT64_C(0x000fffffffffffff)) | (exponent << 52);
+            memcpy(&v, &bits, sizeof(v));
+            break;
+        }
+    }
+    return sign * v;
+}
+
+// High-precision reference with the semantics of convert_value() and
+// convert_temperature(), evaluated in long double
+static long double reference_convert(int from, int to, long double v) {
+    const Unit *src = &units[from];
+    const Unit *dst = &units[to];
+    if (!src->is_temp) {
+        return v * (long double)src->factor / (long double)dst->factor;
+    }
+
+    long double celsius = v;
+    if (strcmp(src->name, "Fahrenheit") == 0) celsius = (v - 32) * 5 / 9;
+    else if (strcmp(src->name, "Kelvin") == 0) celsius = v - (long double)273.15;
+
+    if (strcmp(dst->name, "Fahrenheit") == 0) return celsius * 9 / 5 + 32;
+    if (strcmp(dst->name, "Kelvin") == 0) return celsius + (long double)273.15;
+    return celsius;
+}
+
+// Size of one unit in the last place of a double (or float) of magnitude x
+static double ulp_of(double x, bool single) {
+    x = fabs(x);
+    if (single) {
+        float f = (float)x;
+        if (f >= FLT_MAX) return (double)(FLT_MAX - nextafterf(FLT_MAX, 0));
+        return (double)(nextafterf(f, INFINITY) - f);
+    }
+    if (x >= DBL_MAX) return DBL_MAX - nextafter(DBL_MAX, 0);
+    return nextafter(x, INFINITY) - x;
+}
+
+// Error of a result in last-place units of the largest magnitude involved
+// (result, scaled input or offset), so affine conversions that cancel to
+// near zero are judged against the size of their terms
+// Returns 0 for matching special values and INFINITY for mismatches
+static double verify_error(double got, long double expected, double magnitude, bool single) {
+    if (isnan((double)expected)) return isnan(got) ? 0 : INFINITY;
+    double limit = single ? FLT_MAX : DBL_MAX;
+    if (fabsl(expected) > limit) {
+        return (isinf(got) && signbit(got) == signbit((double)expected)) ? 0 : INFINITY;
+    }
+    if (isnan(got) || isinf(got)) return INFINITY;
+
+    double scale = fabs((double)expected);
+    if (magnitude > scale) scale = magnitude;
+    return (double)(fabsl((long double)got - expected) / ulp_of(scale, single));
+}
+
+// Error of a float-kernel result as a fraction of the bound documented
+// for convert_batch_f32() (section 3.7), against the double kernel y64:
+//   |y32 - y64| <= 4u * |value * scale| + 2u * |offset|,  u = 2^-24
+// for rounding the input, scale, product, offset and sum; 1 is at the
+// bound. Special values are judged as by verify_error()
+static double verify_f32_error(double got, long double expected, const ConversionPlan *plan,
+                               double v) {
+    double error = verify_error(got, expected, 0, true);
+    if (error == 0 || isinf(error)) return error;
+    const double u = 0x1p-24;
+    double y64 = v * plan->scale + plan->offset;
+    double bound = (4 * fabs(v * plan->scale) + 2 * fabs(plan->offset)) * u * (1 + 0x1p-20);
+    return fabs(got - y64) / bound;
+}
+
+// Largest magnitude a conversion works with: the scaled input, the
+// offset and, for temperatures, the Celsius offsets of both units
+static double verify_magnitude(const ConversionPlan *plan, int from, int to, double v) {
+    double magnitude = fmax(fabs(v * plan->scale), fabs(plan->offset));
+    if (units[from].is_temp) {
+        for (int k = 0; k < 2; k++) {
+            const char *name = units[k == 0 ? from : to].name;
+            if (strcmp(name, "Fahrenheit") == 0) magnitude = fmax(magnitude, 32.0);
+            if (strcmp(name, "Kelvin") == 0) magnitude = fmax(magnitude, 273.15);
+        }
+        magnitude = fmax(magnitude, fabs(v));
+    }
+    return magnitude;
+}
+
+// Run convert(x, 'FROM', 'TO') through the expression compiler, with x
+// the field $1 over `n` values, or (`folded`) in[0] written as a
+// constant, which is folded at compile time
+// Returns false for units an expression cannot name
+static bool verify_expression(int from, int to, const double *in, double *out, size_t n,
+                              bool folded) {
+    static ExprProgram program;
+    static double temporaries[2][VERIFY_BLOCK];
+    const char *a = units[from].symbol, *b = units[to].symbol;
+    if (strchr(a, '\'') != NULL || strchr(b, '\'') != NULL || n > VERIFY_BLOCK ||
+        (folded && !isfinite(in[0]))) {
+        return false;
+    }
+
+    char source[128], argument[32];
+    if (folded) snprintf(argument, sizeof(argument), "%.17g", in[0]);
+    else snprintf(argument, sizeof(argument), "$1");
+    snprintf(source, sizeof(source), "convert(%s, '%s', '%s')", argument, a, b);
+    memset(&program, 0, sizeof(program));
+    int result = compile_expression(&program, "--verify", source);
+    if (result < 0 || program.register_count > 2) return false;
+
+    double *registers[MAX_EXPR_REGISTERS] = { temporaries[0], temporaries[1] };
+    registers[MAX_EXPR_REGISTERS - 1] = (double *)in;
+    run_expression(&program, registers, n);
+    memcpy(out, registers[result], n * sizeof(double));
+    return true;
+}
+
+// Check one value on one path; returns the error in last-place units,
+// or -1 if the path does not apply to this input
+static double verify_one(VerifyPath path, int from, int to, double v) {
+    ConversionPlan plan;
+    if (!plan_conversion(units[from].symbol, units[to].symbol, &plan)) return -1;
+    long double expected = reference_convert(from, to, v);
+    double magnitude = verify_magnitude(&plan, from, to, v);
+
+    switch (path) {
+        case PATH_CONVERT_VALUE: {
+            // convert_value() warns above 1e15; the harness stays quiet
+            // Its value * from / to also underflows early when the
+            // intermediate product is subnormal, which is not checked
+            if (fabs(v) > 1e15 || isnan(v) ||
+                (v != 0 && fabs(v * units[from].factor) < DBL_MIN)) return -1;
+            double got;
+            if (units[from].is_temp) {
+                const char *names[] = {"C", "F", "K"};
+                int a = units[from].name[0] == 'F' ? 1 : (units[from].name[0] == 'K' ? 2 : 0);
+                int b = units[to].name[0] == 'F' ? 1 : (units[to].name[0] == 'K' ? 2 : 0);
+                got = convert_temperature(v, names[a], names[b]);
+            } else {
+                char a[16], b[16];
+                strcpy(a, units[from].symbol);
+                strcpy(b, units[to].symbol);
+                normalize_unit_name(a);
+                normalize_unit_name(b);
+                got = convert_value(v, a, b);
+            }
+            return verify_error(got, expected, magnitude, false);
+        }
+        case PATH_BATCH: {
+            double out;
+            convert_batch(&plan, &v, &out, 1);
+            return verify_error(out, expected, magnitude, false);
+        }
+        case PATH_BATCH_F32: {
+            // Only values that are representable as normal floats
+            if (isfinite(v) && (fabs(v) > FLT_MAX || (v != 0 && fabs(v) < FLT_MIN))) return -1;
+            if (isfinite((double)expected) && fabsl(expected) != 0 && fabsl(expected) < FLT_MIN) return -1;
+            ConversionPlanF32 plan32 = plan_to_f32(&plan);
+            float in = (float)v, out;
+            convert_batch_f32(&plan32, &in, &out, 1);
+            return verify_f32_error(out, expected, &plan, v);
+        }
+        case PATH_EXPRESSION: {
+            double out;
+            if (!verify_expression(from, to, &v, &out, 1, true)) return -1;
+            return verify_error(out, expected, magnitude, false);
+        }
+        default:
+            return -1;
+    }
+}
+
+// Shrink a failing value to the shortest decimal that still fails
+static double minimize_failure(VerifyPath path, int from, int to, double v, double budget) {
+    if (!isfinite(v)) return v;
+    for (int precision = 1; precision <= 17; precision++) {
+        char text[40];
+        snprintf(text, sizeof(text), "%.*g", precision, v);
+        double candidate = strtod(text, NULL);
+        if (verify_one(path, from, to, candidate) > budget) return candidate;
+    }
+    return v;
+}
+
+// Record the outcome of one check, printing minimized failures
+static void verify_record(VerifyStats *stats, VerifyPath path, int from, int to,
+                          double v, double error) {
+    if (error < 0) return;
+    VerifyStats *s = &stats[path];
+    s->checked++;
+    if (error > s->max_error) s->max_error = error;
+    if (error <= s->budget) return;
+
+    if (s->failures++ < VERIFY_MAX_REPORTS) {
+        double minimal = minimize_failure(path, from, to, v, s->budget);
+        double minimal_error = verify_one(path, from, to, minimal);
+        printf("FAIL %-14s %s -> %s  value %.17g  error %.3g ulp (budget %g)\n",
+               s->name, units[from].symbol, units[to].symbol, minimal,
+               minimal_error >= 0 ? minimal_error : error, s->budget);
+    }
+}
+
+// Exact integer path against the long double reference
+static void verify_integer(VerifyStats *stats, uint64_t *state, int from, int to) {
+    ConversionPlan plan;
+    IntegerPlan iplan;
+    if (!plan_conversion(units[from].symbol, units[to].symbol, &plan) ||
+        !plan_integer(&plan, &iplan)) {
+        return;
+    }
+
+    uint64_t in[VERIFY_BLOCK], remainders[VERIFY_BLOCK];
+    unsigned __int128 quotients[VERIFY_BLOCK];
+    for (int i = 0; i < VERIFY_BLOCK; i++) {
+        in[i] = verify_random(state) >> (verify_random(state) % 64);
+    }
+    convert_integer_batch(&iplan, in, quotients, remainders, VERIFY_BLOCK);
+
+    for (int i = 0; i < VERIFY_BLOCK; i++) {
+        unsigned __int128 q;
+        uint64_t r;
+        convert_integer(&iplan, in[i], &q, &r);
+
+        // Exactness: q * den + r must equal value * num
+        unsigned __int128 lhs = q * iplan.denominator + r;
+        unsigned __int128 rhs = (unsigned __int128)in[i] * iplan.numerator;
+        long double got = (long double)q + (long double)r / (long double)iplan.denominator;
+        long double expected = reference_convert(from, to, (long double)in[i]);
+        double error = (lhs != rhs || q != quotients[i] || r != remainders[i] ||
+                        r >= iplan.denominator) ? INFINITY :
+                       (double)(fabsl(got - expected) / ulp_of((double)expected, false));
+        VerifyStats *s = &stats[PATH_INTEGER];
+        s->checked++;
+        if (error > s->max_error) s->max_error = error;
+        if (error > s->budget && s->failures++ < VERIFY_MAX_REPORTS) {
+            printf("FAIL %-14s %s -> %s  value %llu  error %.3g ulp (budget %g)\n",
+                   s->name, units[from].symbol, units[to].symbol,
+                   (unsigned long long)in[i], error, s->budget);
+        }
+    }
+}
+
+// Exact decimal path: the printed result must match the decimal reference
+static void verify_decimal(VerifyStats *stats, uint64_t *state, int from, int to, double v) {
+    ConversionPlan plan;
+    DecimalPlan dplan;
+    if (!isfinite(v) || !plan_conversion(units[from].symbol, units[to].symbol, &plan) ||
+        !plan_decimal(&plan, &dplan)) {
+        return;
+    }
+
+    char text[40], printed[96], factor_text[2][32];
+    snprintf(text, sizeof(text), "%.*g", 1 + (int)(verify_random(state) % 17), v);
+    Decimal value, result;
+    if (!parse_decimal(text, &value, NULL) || !convert_decimal(&dplan, &value, &result) ||
+        !format_decimal(&result, printed, sizeof(printed))) {
+        return;
+    }
+
+    // Reference: the input text times the factors' shortest decimals
+    for (int k = 0; k < 2; k++) {
+        double factor = units[k == 0 ? from : to].factor;
+        for (int precision = 1; precision <= 17; precision++) {
+            snprintf(factor_text[k], sizeof(factor_text[k]), "%.*g", precision, factor);
+            if (strtod(factor_text[k], NULL) == factor) break;
+        }
+    }
+    long double expected = strtold(text, NULL) * strtold(factor_text[0], NULL) /
+                           strtold(factor_text[1], NULL);
+    double got = strtod(printed, NULL);
+    double error = verify_error(got, expected, 0, false);
+
+    VerifyStats *s = &stats[PATH_DECIMAL];
+    s->checked++;
+    if (error > s->max_error) s->max_error = error;
+    if (error > s->budget && s->failures++ < VERIFY_MAX_REPORTS) {
+        printf("FAIL %-14s %s -> %s  value %s  got %s  error %.3g ulp (budget %g)\n",
+               s->name, units[from].symbol, units[to].symbol, text, printed, error, s->budget);
+    }
+}
+
+// Auto-scale classification against a linear scan of the thresholds
+static void verify_scale(VerifyStats *stats, int unit, const double *values, size_t n) {
+    const ScaleTable *table = get_scale_table(units[unit].category);
+    if (table == NULL) return;
+
+    uint8_t batch[VERIFY_BLOCK];
+    classify_scale_batch(table, values, batch, n);
+    for (size_t i = 0; i < n; i++) {
+        if (isnan(values[i])) continue;
+        int expected = 0;
+        while (expected + 1 < table->count &&
+               fabs(values[i]) >= table->thresholds[expected + 1]) {
+            expected++;
+        }
+        int got = classify_scale(table, values[i]);
+        double error = (got == expected && batch[i] == expected) ? 0 : INFINITY;
+
+        VerifyStats *s = &stats[PATH_SCALE];
+        s->checked++;
+        if (error > s->max_error) s->max_error = error;
+        if (error > 0 && s->failures++ < VERIFY_MAX_REPORTS) {
+            printf("FAIL %-14s %s  value %.17g  picked %s, expected %s\n", s->name,
+                   units[unit].category, values[i], table->symbols[got],
+                   table->symbols[expected]);
+        }
+    }
+}
+
+// Tokenizer: parse_number() must read a value written with random
+// precision, a zero-padded exponent or locale separators exactly as
+// strtod() reads its plain form; a rejected number is a failure
+static void verify_tokenizer(VerifyStats *stats, uint64_t *state, double v) {
+    if (!isfinite(v)) return;
+    uint64_t r = verify_random(state);
+    int precision = 1 + (int)(r % 17);
+    char plain[48], text[512];
+    NumberFormat format = { '.', '\0' };
+
+    switch ((r >> 8) % 4) {
+        case 0:
+            snprintf(plain, sizeof(plain), "%.*g", precision, v);
+            snprintf(text, sizeof(text), "%s", plain);
+            break;
+        case 1: {
+            // "1.5e+" followed by up to 400 zeros and the exponent
+            snprintf(plain, sizeof(plain), "%.*e", precision - 1, v);
+            const char *e = strchr(plain, 'e');
+            int zeros = (int)((r >> 16) % 401);
+            int length = snprintf(text, sizeof(text), "%.*s", (int)(e + 2 - plain), plain);
+            memset(text + length, '0', (size_t)zeros);
+            snprintf(text + length + zeros, sizeof(text) - (size_t)(length + zeros), "%s", e + 2);
+            break;
+        }
+        default: {
+            // Fixed notation with grouped thousands, "1,234,567.25", or
+            // with the separators swapped, "1.234.567,25"
+            if (fabs(v) >= 1e15) return;
+            snprintf(plain, sizeof(plain), "%.*f", (int)((r >> 16) % 10), v);
+            bool swapped = (r >> 8) % 4 == 3;
+            format.decimal_sep = swapped ? ',' : '.';
+            format.group_sep = swapped ? '.' : ',';
+            const char *p = plain;
+            size_t length = 0;
+            if (*p == '-') text[length++] = *p++;
+            size_t integer = strcspn(p, ".");
+            for (size_t i = 0; i < integer; i++) {
+                if (i > 0 && (integer - i) % 3 == 0) text[length++] = format.group_sep;
+                text[length++] = p[i];
+            }
+            text[length] = '\0';
+            if (p[integer] == '.') {
+                text[length++] = format.decimal_sep;
+                snprintf(text + length, sizeof(text) - length, "%s", p + integer + 1);
+            }
+            break;
+        }
+    }
+
+    double expected = strtod(plain, NULL), got = 0;
+    double error = parse_number(text, text + strlen(text), &format, &got)
+                 ? verify_error(got, expected, 0, false) : INFINITY;
+    VerifyStats *s = &stats[PATH_TOKENIZER];
+    s->checked++;
+    if (error > s->max_error) s->max_error = error;
+    if (error > s->budget && s->failures++ < VERIFY_MAX_REPORTS) {
+        printf("FAIL %-14s text %s  got %.17g, expected %.17g\n", s->name, text, got, expected);
+    }
+}
+
+// Container reads: pack a block of values into a temporary container,
+// one rotation of them per column in unit `from`, then read every column
+// of each container block in unit `to` before checking any, as --unpack
+// does; reads must match convert_batch() and the reference
+static void verify_container(VerifyStats *stats, const char *path, const ConversionPlan *plan,
+                             int from, int to, const double *in) {
+    ContainerHeader header = {0};
+    ContainerColumn descriptors[VERIFY_CONTAINER_COLUMNS];
+    memset(descriptors, 0, sizeof(descriptors));
+    // Columns name their unit by symbol; skip units whose symbol finds
+    // another catalogue entry first (the Data category's KB, MB, ...)
+    if (strlen(units[from].symbol) >= sizeof(descriptors[0].unit) ||
+        find_unit(units[from].symbol) != from) {
+        return;
+    }
+
+    double columns[VERIFY_CONTAINER_COLUMNS][VERIFY_BLOCK];
+    for (int c = 0; c < VERIFY_CONTAINER_COLUMNS; c++) {
+        snprintf(descriptors[c].name, sizeof(descriptors[c].name), "c%d", c + 1);
+        snprintf(descriptors[c].unit, sizeof(descriptors[c].unit), "%s", units[from].symbol);
+        snprintf(descriptors[c].category, sizeof(descriptors[c].category), "%s",
+                 units[from].category);
+        for (int i = 0; i < VERIFY_BLOCK; i++) columns[c][i] = in[(i + c) % VERIFY_BLOCK];
+    }
+    memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+    header.byte_order = CONTAINER_BYTE_ORDER;
+    header.column_count = VERIFY_CONTAINER_COLUMNS;
+    header.block_rows = VERIFY_CONTAINER_ROWS;
+    header.row_count = VERIFY_BLOCK;
+
+    FILE *out = fopen(path, "wb");
+    bool ok = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(descriptors, sizeof(descriptors), 1, out) == 1;
+    for (size_t first = 0; ok && first < VERIFY_BLOCK; first += VERIFY_CONTAINER_ROWS) {
+        size_t rows = VERIFY_BLOCK - first < VERIFY_CONTAINER_ROWS
+                    ? VERIFY_BLOCK - first : VERIFY_CONTAINER_ROWS;
+        for (int c = 0; ok && c < VERIFY_CONTAINER_COLUMNS; c++) {
+            ok = fwrite(&columns[c][first], sizeof(double), rows, out) == rows;
+        }
+    }
+    if (out != NULL && fclose(out) != 0) ok = false;
+
+    VerifyStats *s = &stats[PATH_CONTAINER];
+    Container container;
+    if (!ok || !container_open(&container, path)) {
+        if (s->failures++ < VERIFY_MAX_REPORTS) {
+            printf("FAIL %-14s %s: cannot write or open '%s'\n", s->name,
+                   units[from].symbol, path);
+        }
+        return;
+    }
+    for (size_t block = 0; block < container.block_count; block++) {
+        const double *read[VERIFY_CONTAINER_COLUMNS];
+        size_t rows = 0, first = block * VERIFY_CONTAINER_ROWS;
+        for (int c = 0; c < VERIFY_CONTAINER_COLUMNS; c++) {
+            read[c] = container_read(&container, c, to, block, &rows);
+        }
+        for (int c = 0; c < VERIFY_CONTAINER_COLUMNS; c++) {
+            double batch[VERIFY_CONTAINER_ROWS];
+            convert_batch(plan, &columns[c][first], batch, rows);
+            for (size_t i = 0; i < rows; i++) {
+                double v = columns[c][first + i];
+                double error = INFINITY;
+                if (read[c] != NULL &&
+                    (read[c][i] == batch[i] || (isnan(read[c][i]) && isnan(batch[i])))) {
+                    error = verify_error(read[c][i], reference_convert(from, to, v),
+                                         verify_magnitude(plan, from, to, v), false);
+                }
+                verify_record(stats, PATH_CONTAINER, from, to, v, error);
+            }
+        }
+    }
+    container_close(&container);
+}
+
+// Randomized differential test of every conversion path against a
+// high-precision reference, with a last-place error budget per path
+// Returns 0 if every path stayed within its budget
+int run_verify(uint64_t seed, long count) {
+    VerifyStats stats[PATH_COUNT] = {
+        [PATH_CONVERT_VALUE] = {"convert_value", 4},
+        [PATH_BATCH]         = {"batch", 3},
+        [PATH_BATCH_F32]     = {"batch_f32", 1},    // Fraction of the 3.7 bound
+        [PATH_INTEGER]       = {"integer", 1},
+        [PATH_DECIMAL]       = {"decimal", 1},
+        [PATH_SCALE]         = {"auto_scale", 0},
+        [PATH_TOKENIZER]     = {"tokenizer", 0},
+        [PATH_EXPRESSION]    = {"expression", 3},
+        [PATH_CONTAINER]     = {"container", 3},
+    };
+    uint64_t state = seed ? seed : 1;
+
+    // Containers are written to one temporary file, rewritten each time
+    const char *container_path = NULL;
+#ifndef _WIN32
+    char temp_path[] = "/tmp/converter-verify-XXXXXX";
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd >= 0) {
+        close(temp_fd);
+        container_path = temp_path;
+    }
+#endif
+
+    for (long block = 0; block * VERIFY_BLOCK < count; block++) {
+        // Random pair within a category, then a block of values through
+        // the kernels so their vector bodies and tails both run
+        int from = (int)(verify_random(&state) % (uint64_t)unit_count);
+        int to;
+        do {
+            to = (int)(verify_random(&state) % (uint64_t)unit_count);
+        } while (strcmp(units[from].category, units[to].category) != 0);
+
+        ConversionPlan plan;
+        if (!plan_conversion(units[from].symbol, units[to].symbol, &plan)) continue;
+        ConversionPlanF32 plan32 = plan_to_f32(&plan);
+
+        double in[VERIFY_BLOCK], out[VERIFY_BLOCK];
+        float in32[VERIFY_BLOCK], out32[VERIFY_BLOCK];
+        for (int i = 0; i < VERIFY_BLOCK; i++) {
+            in[i] = verify_value(&state);
+            in32[i] = (float)in[i];
+        }
+        convert_batch(&plan, in, out, VERIFY_BLOCK);
+        convert_batch_f32(&plan32, in32, out32, VERIFY_BLOCK);
+        double applied[VERIFY_BLOCK];
+        bool expression = verify_expression(from, to, in, applied, VERIFY_BLOCK, false);
+
+        for (int i = 0; i < VERIFY_BLOCK; i++) {
+            // Block results must match the single-value path bit for bit
+            double single = verify_one(PATH_BATCH, from, to, in[i]);
+            long double expected = reference_convert(from, to, in[i]);
+            double magnitude = verify_magnitude(&plan, from, to, in[i]);
+            verify_record(stats, PATH_BATCH, from, to, in[i],
+                          fmax(single, verify_error(out[i], expected, magnitude, false)));
+            verify_record(stats, PATH_CONVERT_VALUE, from, to, in[i],
+                          verify_one(PATH_CONVERT_VALUE, from, to, in[i]));
+            double f32 = verify_one(PATH_BATCH_F32, from, to, in[i]);
+            if (f32 >= 0) {
+                f32 = fmax(f32, verify_f32_error(out32[i], expected, &plan, in[i]));
+            }
+            verify_record(stats, PATH_BATCH_F32, from, to, in[i], f32);
+            verify_decimal(stats, &state, from, to, in[i]);
+            verify_tokenizer(stats, &state, in[i]);
+            if (expression) {
+                // Folded constant and field program alike
+                double folded = verify_one(PATH_EXPRESSION, from, to, in[i]);
+                verify_record(stats, PATH_EXPRESSION, from, to, in[i],
+                              fmax(folded, verify_error(applied[i], expected, magnitude, false)));
+            }
+        }
+        verify_integer(stats, &state, from, to);
+        verify_scale(stats, from, in, VERIFY_BLOCK);
+        if (container_path != NULL && block % VERIFY_CONTAINER_EVERY == 0) {
+            verify_container(stats, container_path, &plan, from, to, in);
+        }
+    }
+    if (container_path != NULL) remove(container_path);
+
+    printf("\n%-14s %10s %10s %12s %8s\n", "Path", "Checked", "Failures", "Max error", "Budget");
+    printf("--------------------------------------------------------\n");
+    bool ok = true;
+    for (int p = 0; p < PATH_COUNT; p++) {
+        printf("%-14s %10ld %10ld %12.3g %8g\n", stats[p].name, stats[p].checked,
+               stats[p].failures, stats[p].max_error, stats[p].budget);
+        if (stats[p].failures > 0) ok = false;
+    }
+    printf("\nseed %llu: %s\n", (unsigned long long)seed, ok ? "all paths within budget" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// Events reported by the benchmark, in PerfCounters order
+static const char *perf_event_names[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"
+};
+
+#ifdef __linux__
+static int perf_event_open_fd(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;    // Works with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Open the benchmark counters; missing events are left at -1 and the
+// benchmark falls back to wall-clock time when none are available
+// (errno then holds the reason from the last failed open)
+void perf_open(PerfCounters *counters) {
+    counters->available = false;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->fds[i] = -1;
+        counters->values[i] = 0;
+    }
+#ifdef __linux__
+    const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint64_t llc_read_miss = PERF_COUNT_HW_CACHE_LL |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    counters->fds[0] = perf_event_open_fd(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fds[1] = perf_event_open_fd(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counters->fds[2] = perf_event_open_fd(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    counters->fds[3] = perf_event_open_fd(PERF_TYPE_HW_CACHE, l1d_read_miss);
+    counters->fds[4] = perf_event_open_fd(PERF_TYPE_HW_CACHE, llc_read_miss);
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) counters->available = true;
+    }
+#endif
+}
+
+// Reset and enable every open counter
+void perf_start(PerfCounters *counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)counters;
+#endif
+}
+
+// Disable the counters and read their values
+void perf_stop(PerfCounters *counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->values[i] = 0;
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(counters->fds[i], &value, sizeof(value)) == sizeof(value)) {
+            counters->values[i] = value;
+        }
+    }
+#else
+    (void)counters;
+#endif
+}
+
+void perf_close(PerfCounters *counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+#endif
+    counters->available = false;
+}
+
+// Parse "NAME:UNIT" (UNIT may be omitted when `unit_optional`)
+static bool parse_column_spec(const char *spec, char *name, size_t name_size, char *unit,
+                              size_t unit_size, bool unit_optional) {
+    const char *colon = strrchr(spec, ':');
+    size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+    if (length == 0 || length >= name_size || (colon == NULL && !unit_optional) ||
+        (colon && (colon[1] == '\0' || strlen(colon + 1) >= unit_size))) {
+        fprintf(stderr, "Error: expected NAME:UNIT, got '%s'\n", spec);
+        return false;
+    }
+    memcpy(name, spec, length);
+    name[length] = '\0';
+    snprintf(unit, unit_size, "%s", colon ? colon + 1 : "");
+    return true;
+}
+
+// Write the block buffered in `columns` (column-major, `rows` filled)
+static bool container_write_block(FILE *out, double *const *columns, int column_count,
+                                  size_t rows) {
+    for (int c = 0; c < column_count; c++) {
+        if (fwrite(columns[c], sizeof(double), rows, out) != rows) return false;
+    }
+    return true;
+}
+
+// Pack mode: read delimited rows of numbers from stdin and store them in
+// a container, one column per NAME:UNIT spec, values in their own unit
+// Lines that do not hold a number in every column are skipped
+int run_pack(const char *path, int spec_count, char *specs[], char delimiter) {
+    ContainerHeader header = {0};
+    ContainerColumn descriptors[MAX_CONTAINER_COLUMNS];
+    memset(descriptors, 0, sizeof(descriptors));
+    if (spec_count < 1 || spec_count > MAX_CONTAINER_COLUMNS) {
+        fprintf(stderr, "Error: --pack takes 1 to %d NAME:UNIT columns\n", MAX_CONTAINER_COLUMNS);
+        return 2;
+    }
+    for (int c = 0; c < spec_count; c++) {
+        ContainerColumn *column = &descriptors[c];
+        char unit[sizeof(column->unit)];
+        if (!parse_column_spec(specs[c], column->name, sizeof(column->name), unit,
+                               sizeof(unit), false)) {
+            return 2;
+        }
+        int index = find_unit(unit);
+        if (index < 0) {
+            fprintf(stderr, "Error: unknown unit '%s'\n", unit);
+            return 1;
+        }
+        snprintf(column->unit, sizeof(column->unit), "%s", units[index].symbol);
+        snprintf(column->category, sizeof(column->category), "%s", units[index].category);
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: cannot write '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+    header.byte_order = CONTAINER_BYTE_ORDER;
+    header.column_count = (uint32_t)spec_count;
+    header.block_rows = CONTAINER_BLOCK_ROWS;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(descriptors, sizeof(ContainerColumn), (size_t)spec_count, out) ==
+                  (size_t)spec_count;
+
+    Arena *arena = scratch_arena();
+    Arena line_arena = {0};
+    NumberFormat format = { '.', '\0' };
+    double *columns[MAX_CONTAINER_COLUMNS];
+    for (int c = 0; c < spec_count; c++) {
+        columns[c] = arena_alloc(arena, CONTAINER_BLOCK_ROWS * sizeof(double));
+    }
+    size_t rows = 0;
+    long skipped = 0;
+    char *line;
+    while (ok && (line = arena_read_line(&line_arena, stdin)) != NULL) {
+        const char *end = line + strlen(line), *start, *stop;
+        int c = 0;
+        for (; c < spec_count; c++) {
+            if (!find_csv_field(line, end, c + 1, delimiter, &start, &stop) ||
+                !parse_number(start, stop, &format, &columns[c][rows])) {
+                break;
+            }
+        }
+        arena_reset(&line_arena);
+        if (c < spec_count) {
+            skipped++;
+            continue;
+        }
+        header.row_count++;
+        if (++rows == CONTAINER_BLOCK_ROWS) {
+            ok = container_write_block(out, columns, spec_count, rows);
+            rows = 0;
+        }
+    }
+    arena_free(&line_arena);
+    if (ok && rows > 0) ok = container_write_block(out, columns, spec_count, rows);
+    arena_reset(arena);
+
+    // The row count is known only now
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Error: writing '%s' failed\n", path);
+        return 1;
+    }
+    fprintf(stderr, "Packed %llu rows into %s", (unsigned long long)header.row_count, path);
+    if (skipped > 0) fprintf(stderr, " (%ld lines skipped)", skipped);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+// Open a container: map the file and check the header and every column
+// unit against the catalogue
+bool container_open(Container *container, const char *path) {
+    memset(container, 0, sizeof(*container));
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = size >= sizeof(ContainerHeader)
+              ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: '%s' is not a unit container\n", path);
+        return false;
+    }
+    container->map = map;
+    container->map_size = size;
+
+    const ContainerHeader *header = map;
+    container->header = *header;
+    size_t columns = header->column_count;
+    size_t data_start = sizeof(ContainerHeader) + columns * sizeof(ContainerColumn);
+    bool valid = memcmp(header->magic, CONTAINER_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->byte_order == CONTAINER_BYTE_ORDER && columns >= 1 &&
+                 columns <= MAX_CONTAINER_COLUMNS && header->block_rows > 0 &&
+                 data_start <= size &&
+                 header->row_count <= (size - data_start) / sizeof(double) / columns &&
+                 data_start + header->row_count * columns * sizeof(double) == size;
+    if (!valid) {
+        fprintf(stderr, "Error: '%s' is not a unit container or is truncated\n", path);
+        container_close(container);
+        return false;
+    }
+    container->columns = (const ContainerColumn *)(header + 1);
+    container->block_count = (header->row_count + header->block_rows - 1) / header->block_rows;
+    for (size_t c = 0; c < columns; c++) {
+        const ContainerColumn *column = &container->columns[c];
+        char unit[sizeof(column->unit) + 1], category[sizeof(column->category) + 1];
+        snprintf(unit, sizeof(unit), "%.*s", (int)sizeof(column->unit), column->unit);
+        snprintf(category, sizeof(category), "%.*s", (int)sizeof(column->category),
+                 column->category);
+        int index = find_unit(unit);
+        if (index < 0 || strcmp(units[index].category, category) != 0) {
+            fprintf(stderr, "Error: column %zu of '%s' has unit '%s' (%s), which the "
+                            "catalogue does not know\n", c + 1, path, unit, category);
+            container_close(container);
+            return false;
+        }
+        container->unit_index[c] = index;
+    }
+    return true;
+#else
+    (void)path;
+    fprintf(stderr, "Error: containers are not supported on this platform\n");
+    return false;
+#endif
+}
+
+// Release the mapping and every cached block
+void container_close(Container *container) {
+#ifndef _WIN32
+    if (container->map != NULL) munmap((void *)container->map, container->map_size);
+#endif
+    for (int i = 0; i < CONTAINER_CACHE_BLOCKS; i++) free(container->cache[i].values);
+    memset(container, 0, sizeof(*container));
+}
+
+// Index of the column called `name`, or -1
+int container_find_column(const Container *container, const char *name) {
+    for (uint32_t c = 0; c < container->header.column_count; c++) {
+        if (strncmp(container->columns[c].name, name, sizeof(container->columns[c].name)) == 0) {
+            return (int)c;
+        }
+    }
+    return -1;
+}
+
+// Values of one block of a column in unit `to_index`
+// Values in their stored unit point straight into the mapping; other
+// units are converted on first use with the batch kernel and kept in a
+// small LRU cache, so repeated reads of a block cost nothing
+// A converted block stays valid until CONTAINER_CACHE_BLOCKS other blocks
+// have been converted, so one block of every column can be held at once
+// Returns NULL if the units are incompatible
+const double *container_read(Container *container, int column, int to_index, size_t block,
+                             size_t *rows) {
+    const ContainerHeader *header = &container->header;
+    size_t first = block * header->block_rows;
+    *rows = header->row_count - first < header->block_rows
+          ? (size_t)(header->row_count - first) : header->block_rows;
+    size_t offset = sizeof(ContainerHeader) + header->column_count * sizeof(ContainerColumn) +
+                    (first * header->column_count + (size_t)column * *rows) * sizeof(double);
+    const double *stored = (const double *)(container->map + offset);
+    int from_index = container->unit_index[column];
+    if (to_index == from_index) return stored;
+
+    ContainerCacheEntry *slot = &container->cache[0];
+    for (int i = 0; i < CONTAINER_CACHE_BLOCKS; i++) {
+        ContainerCacheEntry *entry = &container->cache[i];
+        if (entry->values != NULL && entry->column == column && entry->to_index == to_index &&
+            entry->block == block) {
+            entry->last_used = ++container->clock;
+            metrics_count(METRIC_BLOCK_CACHE_HITS);
+            return entry->values;
+        }
+        if (entry->last_used < slot->last_used) slot = entry;
+    }
+    metrics_count(METRIC_BLOCK_CACHE_MISSES);
+
+    ConversionPlan plan;
+    if (!plan_conversion(units[from_index].symbol, units[to_index].symbol, &plan)) return NULL;
+    if (slot->values == NULL) {
+        slot->values = malloc(header->block_rows * sizeof(double));
+        if (slot->values == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    convert_batch(&plan, stored, slot->values, *rows);
+    metrics_count_pair(from_index, to_index, *rows);
+    slot->column = column;
+    slot->to_index = to_index;
+    slot->block = block;
+    slot->last_used = ++container->clock;
+    return slot->values;
+}
+
+// Unpack mode: print the requested columns of a container as delimited
+// text, each in the unit asked for (NAME:UNIT) or its stored one (NAME);
+// without specs, every column in its stored unit
+// Blocks are read, and converted, one at a time
+int run_unpack(const char *path, int spec_count, char *specs[], char delimiter) {
+    Container container;
+    if (!container_open(&container, path)) return 1;
+
+    int columns[MAX_CONTAINER_COLUMNS], targets[MAX_CONTAINER_COLUMNS];
+    int count = spec_count > 0 ? spec_count : (int)container.header.column_count;
+    if (count > MAX_CONTAINER_COLUMNS) {
+        fprintf(stderr, "Error: at most %d columns per --unpack\n", MAX_CONTAINER_COLUMNS);
+        container_close(&container);
+        return 2;
+    }
+    for (int i = 0; i < count; i++) {
+        char name[sizeof(container.columns[0].name) + 1], unit[32];
+        columns[i] = i;
+        unit[0] = '\0';
+        if (spec_count > 0) {
+            if (!parse_column_spec(specs[i], name, sizeof(name), unit, sizeof(unit), true)) {
+                container_close(&container);
+                return 2;
+            }
+            columns[i] = container_find_column(&container, name);
+            if (columns[i] < 0) {
+                fprintf(stderr, "Error: '%s' has no column '%s'\n", path, name);
+                container_close(&container);
+                return 1;
+            }
+        }
+        int stored = container.unit_index[columns[i]];
+        targets[i] = unit[0] ? find_unit(unit) : stored;
+        if (targets[i] < 0 ||
+            strcmp(units[targets[i]].category, units[stored].category) != 0) {
+            fprintf(stderr, "Error: cannot convert column '%s' from '%s' to '%s'\n",
+                    container.columns[columns[i]].name, units[stored].symbol, unit);
+            container_close(&container);
+            return 1;
+        }
+    }
+
+    fflush(stdout);
+    Arena arena = {0};
+    OutputSink sink;
+    ArenaText text;
+    bool written = true;
+    sink_init(&sink, STDOUT_FILENO);
+    text_init(&text, &arena, 4096);
+    char separator[2] = { delimiter, '\0' };
+    for (int i = 0; i < count; i++) {
+        text_append(&text, "%s%.*s[%s]", i ? separator : "",
+                    (int)sizeof(container.columns[0].name), container.columns[columns[i]].name,
+                    units[targets[i]].symbol);
+    }
+    text_append(&text, "\n");
+
+    for (size_t block = 0; block < container.block_count && written; block++) {
+        const double *values[MAX_CONTAINER_COLUMNS];
+        size_t rows = 0;
+        for (int i = 0; i < count; i++) {
+            values[i] = container_read(&container, columns[i], targets[i], block, &rows);
+        }
+        for (size_t row = 0; row < rows; row++) {
+            for (int i = 0; i < count; i++) {
+                text_append(&text, i + 1 < count ? "%.15g%c" : "%.15g\n", values[i][row],
+                            delimiter);
+            }
+        }
+        sink_add(&sink, text.data, text.length);
+        written = sink_flush(&sink);
+        arena_reset(&arena);
+        text_init(&text, &arena, 4096);
+    }
+    if (container.block_count == 0) {
+        sink_add(&sink, text.data, text.length);
+        written = sink_flush(&sink);
+    }
+    arena_free(&arena);
+    container_close(&container);
+    if (!written) {
+        perror("writev");
+        return 1;
+    }
+    return 0;
+}
+
+// Benchmark stages; each runs its workload `count` times
+typedef enum {
+    BENCH_LOOKUP,
+    BENCH_CONVERT,
+    BENCH_HOT_PAIR,
+    BENCH_PARSE,
+    BENCH_FORMAT,
+    BENCH_HISTORY,
+    BENCH_STAGE_COUNT
+} BenchStage;
+
+static const char *bench_stage_names[BENCH_STAGE_COUNT] = {
+    "lookup", "conversion", "hot pair", "parsing", "formatting", "history append"
+};
+
+// Shared inputs of the benchmark stages
+typedef struct {
+    const char **symbols;
+    int symbol_count;
+    double *values;
+    double *results;
+    char **texts;
+    ConversionPlan plan;        // Generic kernel
+    ConversionPlan hot_plan;    // Generated kernel, when one is built in
+} BenchData;
+
+// Run one stage over `count` values; the result is folded into a sink
+// so the compiler cannot drop the work
+static double bench_run_stage(BenchStage stage, BenchData *data, long count) {
+    double sink = 0;
+    char buffer[64], unit[16];
+
+    switch (stage) {
+        case BENCH_LOOKUP:
+            for (long i = 0; i < count; i++) {
+                sink += find_unit(data->symbols[i % data->symbol_count]);
+            }
+            break;
+        case BENCH_CONVERT:
+            convert_batch(&data->plan, data->values, data->results, (size_t)count);
+            sink = data->results[count - 1];
+            break;
+        case BENCH_HOT_PAIR:
+            convert_batch(&data->hot_plan, data->values, data->results, (size_t)count);
+            sink = data->results[count - 1];
+            break;
+        case BENCH_PARSE:
+            for (long i = 0; i < count; i++) {
+                sink += parse_value_with_prefix(data->texts[i], unit);
+            }
+            break;
+        case BENCH_FORMAT:
+            for (long i = 0; i < count; i++) {
+                format_number(data->values[i], buffer, sizeof(buffer));
+                sink += buffer[0];
+            }
+            break;
+        case BENCH_HISTORY:
+            for (long i = 0; i < count; i++) {
+                add_history_entry("km", "mi", data->values[i], data->results[i]);
+            }
+            sink = history_count;
+            break;
+        default:
+            break;
+    }
+    return sink;
+}
+
+// Print one counter per converted value, or n/a if it was not measured
+static void bench_print_counter(const PerfCounters *counters, int event, long count) {
+    if (counters->fds[event] < 0) {
+        printf(" %10s", "n/a");
+    } else {
+        printf(" %10.2f", (double)counters->values[event] / count);
+    }
+}
+
+// Benchmark the hot paths with wall-clock time and, where the kernel
+// allows it, hardware counters per converted value
+// History appends go to a temporary file, never the user's history
+int run_bench(long count) {
+    Arena *arena = scratch_arena();
+    BenchData data;
+    uint64_t state = 12345;
+
+    if (count < 1000) count = 1000;
+    data.values = arena_alloc(arena, count * sizeof(double));
+    data.results = arena_alloc(arena, count * sizeof(double));
+    memset(data.results, 0, count * sizeof(double));   // Fault pages in before timing
+    data.texts = arena_alloc(arena, count * sizeof(char *));
+    data.symbols = arena_alloc(arena, unit_count * sizeof(char *));
+    data.symbol_count = unit_count;
+    for (int i = 0; i < unit_count; i++) data.symbols[i] = units[i].symbol;
+    for (long i = 0; i < count; i++) {
+        data.values[i] = (double)(verify_random(&state) % 1000000) / 100.0;
+        data.texts[i] = arena_alloc(arena, 24);
+        snprintf(data.texts[i], 24, "%.2f km", data.values[i]);
+    }
+    // The conversion stage forces the generic kernel on the pair the hot
+    // pair stage converts, so the two rows compare like with like
+    plan_conversion("km", "mi", &data.hot_plan);
+#if HOT_PAIR_COUNT > 0
+    plan_conversion(hot_pairs[0].from, hot_pairs[0].to, &data.hot_plan);
+#endif
+    data.plan = data.hot_plan;
+    data.plan.hot_pair = 0;
+
+    // Stages cost very different amounts; scale the work to match
+    const long stage_counts[BENCH_STAGE_COUNT] = {
+        count / 10, count, data.hot_plan.hot_pair ? count : 0, count, count / 10,
+        count / 1000 + 1
+    };
+
+    char temp_history[] = "/tmp/converter-bench-XXXXXX";
+#ifndef _WIN32
+    int temp_fd = mkstemp(temp_history);
+    if (temp_fd >= 0) close(temp_fd);
+#endif
+    history_path = temp_history;
+    history_loaded = true;
+    history_count = 0;
+
+    PerfCounters counters;
+    perf_open(&counters);
+    if (!counters.available) {
+        fprintf(stderr, "Note: hardware counters unavailable (perf_event_open: %s), "
+                        "reporting wall-clock time only\n", strerror(errno));
+    }
+
+    printf("%-15s %10s %10s", "Stage", "Values", "ns/value");
+    for (int e = 0; e < PERF_COUNTER_COUNT; e++) printf(" %10s", perf_event_names[e]);
+    printf(" %10s\n", "IPC");
+    printf("------------------------------------------------------------------------------------------------\n");
+
+    volatile double sink = 0;
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        long n = stage_counts[stage];
+        if (n == 0) continue;
+        sink += bench_run_stage(stage, &data, n < 100 ? n : n / 10); // Warm up
+
+        double start = now_seconds();
+        perf_start(&counters);
+        sink += bench_run_stage(stage, &data, n);
+        perf_stop(&counters);
+        double elapsed = now_seconds() - start;
+
+        printf("%-15s %10ld %10.2f", bench_stage_names[stage], n, elapsed * 1e9 / n);
+        for (int e = 0; e < PERF_COUNTER_COUNT; e++) {
+            bench_print_counter(&counters, e, n);
+        }
+        if (counters.fds[0] >= 0 && counters.fds[1] >= 0 && counters.values[0] > 0) {
+            printf(" %10.2f\n", (double)counters.values[1] / counters.values[0]);
+        } else {
+            printf(" %10s\n", "n/a");
+        }
+    }
+    (void)sink;
+
+    perf_close(&counters);
+    remove(temp_history);
+    arena_reset(arena);
+    return 0;
+}
+
+// Write the kernel of one hot pair: the plan constants become literals
+// and the main loop handles four values per step, which the compiler
+// turns into packed multiplies even where it does not vectorize the
+// generic kernel
+static void emit_hot_pair_kernel(FILE *out, int id, const ConversionPlan *plan) {
+    char expression[96];
+    if (plan->offset == 0.0) {
+        snprintf(expression, sizeof(expression), "in[i + k] * %.17g", plan->scale);
+    } else {
+        snprintf(expression, sizeof(expression), "in[i + k] * %.17g %c %.17g",
+                 plan->scale, plan->offset < 0 ? '-' : '+', fabs(plan->offset));
+    }
+    fprintf(out, "// %s -> %s\n", units[plan->from_index].symbol, units[plan->to_index].symbol);
+    fprintf(out, "static void hot_pair_%d(const double *restrict in, double *restrict out, size_t n) {\n", id);
+    fprintf(out, "    size_t i = 0;\n");
+    fprintf(out, "    for (; i + 4 <= n; i += 4) {\n");
+    fprintf(out, "        for (size_t k = 0; k < 4; k++) out[i + k] = %s;\n", expression);
+    fprintf(out, "    }\n");
+    fprintf(out, "    for (size_t k = 0; i + k < n; k++) out[i + k] = %s;\n", expression);
+    fprintf(out, "}\n\n");
+}
+
+// Hot-pair generator: write a header with one specialized kernel per
+// FROM:TO pair and the switch convert_hot_pair() dispatches through
+// Rebuilding with the header next to the source enables the kernels
+int run_emit_hot_pairs(const char *path, int pair_count, char *pairs[]) {
+    ConversionPlan plans[MAX_HOT_PAIRS];
+    if (pair_count < 1 || pair_count > MAX_HOT_PAIRS) {
+        fprintf(stderr, "Error: --emit-hot-pairs takes 1 to %d FROM:TO pairs\n", MAX_HOT_PAIRS);
+        return 2;
+    }
+    for (int i = 0; i < pair_count; i++) {
+        char from[32];
+        const char *to = strchr(pairs[i], ':');
+        size_t length = to ? (size_t)(to - pairs[i]) : 0;
+        if (to == NULL || length == 0 || length >= sizeof(from)) {
+            fprintf(stderr, "Error: expected FROM:TO, got '%s'\n", pairs[i]);
+            return 2;
+        }
+        memcpy(from, pairs[i], length);
+        from[length] = '\0';
+        if (!plan_conversion(from, to + 1, &plans[i])) {
+            fprintf(stderr, "Error: cannot convert from '%s' to '%s'\n", from, to + 1);
+            return 1;
+        }
+    }
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: cannot write '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "// Generated by `converter --emit-hot-pairs`; do not edit.\n");
+    fprintf(out, "// Included by Converter-v3.c when present at build time.\n\n");
+    fprintf(out, "#define HOT_PAIR_COUNT %d\n\n", pair_count);
+    fprintf(out, "// Plans the kernels were generated from; a pair is only used while\n");
+    fprintf(out, "// the catalogue still produces exactly these constants\n");
+    fprintf(out, "static const HotPair hot_pairs[HOT_PAIR_COUNT] = {\n");
+    for (int i = 0; i < pair_count; i++) {
+        fprintf(out, "    {\"%s\", \"%s\", %.17g, %.17g},\n", units[plans[i].from_index].symbol,
+                units[plans[i].to_index].symbol, plans[i].scale, plans[i].offset);
+    }
+    fprintf(out, "};\n\n");
+    for (int i = 0; i < pair_count; i++) {
+        emit_hot_pair_kernel(out, i + 1, &plans[i]);
+    }
+    fprintf(out, "// Run the kernel of hot pair `id` (1-based)\n");
+    fprintf(out, "static bool convert_hot_pair(int id, const double *restrict in,\n");
+    fprintf(out, "                             double *restrict out, size_t n) {\n");
+    fprintf(out, "    switch (id) {\n");
+    for (int i = 0; i < pair_count; i++) {
+        fprintf(out, "        case %d: hot_pair_%d(in, out, n); return true;\n", i + 1, i + 1);
+    }
+    fprintf(out, "        default: return false;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n");
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Error: writing '%s' failed\n", path);
+        return 1;
+    }
+    printf("Wrote %s with %d hot pair%s\n", path, pair_count, pair_count == 1 ? "" : "s");
+    return 0;
+}
+
+// Write `text` as a C++ identifier: lowercase, '_' for spaces and
+// separators, "deg" for '°', "2" for '²', other bytes dropped
+static void cpp_identifier(const char *text, char *out, size_t size) {
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p && n + 4 < size; p++) {
+        if (isalnum(*p)) {
+            out[n++] = (char)*p;
+        } else if (p[0] == 0xC2 && p[1] == 0xB0) {         // °
+            memcpy(out + n, "deg", 3);
+            n += 3;
+            p++;
+        } else if (p[0] == 0xC2 && p[1] == 0xB2) {         // ²
+            out[n++] = '2';
+            p++;
+        } else if ((*p == ' ' || *p == '-' || *p == '/') && n > 0 && out[n-1] != '_') {
+            out[n++] = '_';
+        }
+    }
+    if (n > 0 && isdigit((unsigned char)out[0]) && n + 1 < size) {
+        memmove(out + 1, out, n++);
+        out[0] = '_';
+    }
+    out[n] = '\0';
+}
+
+// Same, lowercased, for unit and dimension type names
+static void cpp_type_name(const char *text, char *out, size_t size) {
+    cpp_identifier(text, out, size);
+    for (char *p = out; *p; p++) *p = (char)tolower((unsigned char)*p);
+}
+
+// True if `name` is in the first `count` entries of `names`
+static bool cpp_name_taken(char (*names)[48], int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) return true;
+    }
+    return false;
+}
+
+// Emit units.hpp: dimension tags, one unit type per catalogue unit,
+// quantity<Dim, Unit, Rep> and quantity_cast, plus a quantity alias per
+// symbol. Factors are constexpr, so a cast folds to one multiply (and one
+// add for temperatures)
+static bool emit_cpp_header(FILE *out) {
+    static char unit_types[MAX_UNITS][48], dim_types[MAX_UNITS][48];
+    static char taken[MAX_UNITS * 2][48];
+    int taken_count = 0;
+
+    fprintf(out, "// Generated by `converter --emit-cpp` from the unit catalogue; do not edit.\n");
+    fprintf(out, "// Requires C++17.\n");
+    fprintf(out, "#pragma once\n\n#include <type_traits>\n\n");
+    fprintf(out, "namespace units {\n\n");
+
+    // Dimensions, one per category
+    fprintf(out, "namespace dim {\n");
+    for (int i = 0; i < unit_count; i++) {
+        cpp_type_name(units[i].category, dim_types[i], sizeof(dim_types[i]));
+        bool seen = false;
+        for (int j = 0; j < i; j++) {
+            if (strcmp(dim_types[j], dim_types[i]) == 0) seen = true;
+        }
+        if (!seen) fprintf(out, "struct %s {};\n", dim_types[i]);
+    }
+    fprintf(out, "}  // namespace dim\n\n");
+
+    // Units: factor and offset against the dimension base (Celsius for
+    // temperatures)
+    for (int i = 0; i < unit_count; i++) {
+        const Unit *unit = &units[i];
+        char name[48];
+        cpp_type_name(unit->name, name, sizeof(name));
+        if (cpp_name_taken(taken, taken_count, name)) {
+            size_t length = strlen(name);
+            snprintf(name + length, sizeof(name) - length, "_%.*s",
+                     (int)(sizeof(name) - length - 2), dim_types[i]);
+        }
+        snprintf(unit_types[i], sizeof(unit_types[i]), "%s", name);
+        snprintf(taken[taken_count++], sizeof(taken[0]), "%s", name);
+
+        double factor = unit->factor, offset = 0.0;
+        if (unit->is_temp) temperature_to_celsius(unit, &factor, &offset);
+        fprintf(out, "struct %s {\n", name);
+        fprintf(out, "    using dimension = dim::%s;\n", dim_types[i]);
+        fprintf(out, "    static constexpr double factor = %.17g;\n", factor);
+        fprintf(out, "    static constexpr double offset = %.17g;\n", offset);
+        fprintf(out, "    static constexpr const char *symbol = \"%s\";\n", unit->symbol);
+        fprintf(out, "};\n");
+    }
+
+    fprintf(out,
+        "\n"
+        "template <class Dim, class Unit, class Rep = double>\n"
+        "class quantity {\n"
+        "    static_assert(std::is_same_v<typename Unit::dimension, Dim>,\n"
+        "                  \"unit does not measure this dimension\");\n"
+        "\n"
+        "public:\n"
+        "    using dimension = Dim;\n"
+        "    using unit = Unit;\n"
+        "    using rep = Rep;\n"
+        "\n"
+        "    constexpr quantity() = default;\n"
+        "    constexpr explicit quantity(Rep value) : value_(value) {}\n"
+        "    constexpr Rep count() const { return value_; }\n"
+        "\n"
+        "    constexpr quantity operator+(quantity other) const { return quantity(value_ + other.value_); }\n"
+        "    constexpr quantity operator-(quantity other) const { return quantity(value_ - other.value_); }\n"
+        "    constexpr quantity operator*(Rep scalar) const { return quantity(value_ * scalar); }\n"
+        "    constexpr quantity operator/(Rep scalar) const { return quantity(value_ / scalar); }\n"
+        "    constexpr bool operator==(quantity other) const { return value_ == other.value_; }\n"
+        "    constexpr bool operator<(quantity other) const { return value_ < other.value_; }\n"
+        "\n"
+        "private:\n"
+        "    Rep value_{};\n"
+        "};\n"
+        "\n"
+        "// Convert to another unit of the same dimension\n"
+        "// Scale and offset are constant expressions, so this is one multiply,\n"
+        "// plus one add only for temperatures\n"
+        "template <class To, class Dim, class From, class Rep>\n"
+        "constexpr quantity<Dim, To, Rep> quantity_cast(quantity<Dim, From, Rep> q) {\n"
+        "    static_assert(std::is_same_v<typename To::dimension, Dim>,\n"
+        "                  \"quantity_cast between different dimensions\");\n"
+        "    constexpr Rep scale = static_cast<Rep>(From::factor / To::factor);\n"
+        "    constexpr Rep offset = static_cast<Rep>((From::offset - To::offset) / To::factor);\n"
+        "    if constexpr (offset == 0) {\n"
+        "        return quantity<Dim, To, Rep>(q.count() * scale);\n"
+        "    } else {\n"
+        "        return quantity<Dim, To, Rep>(q.count() * scale + offset);\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "// Quantity types named after unit symbols and aliases, e.g. km(5)\n"
+        "// Names that collide with a unit type are left out\n");
+
+    for (int i = 0; i < unit_count; i++) {
+        const Unit *unit = &units[i];
+        for (int j = -1; j < unit->alias_count; j++) {
+            char alias[48];
+            cpp_identifier(j < 0 ? unit->symbol : unit->aliases[j], alias, sizeof(alias));
+            if (alias[0] == '\0' || cpp_name_taken(taken, taken_count, alias)) continue;
+            snprintf(taken[taken_count++], sizeof(taken[0]), "%s", alias);
+            fprintf(out, "using %s = quantity<dim::%s, %s>;\n", alias, dim_types[i], unit_types[i]);
+            if (taken_count == MAX_UNITS * 2) break;
+        }
+        if (taken_count == MAX_UNITS * 2) break;
+    }
+
+    fprintf(out, "\n}  // namespace units\n");
+    return !ferror(out);
+}
+
+// Emit units_bench.cpp: compile-time checks of the header and a timing of
+// quantity_cast against the same conversion written by hand
+static bool emit_cpp_bench(FILE *out) {
+    int from = find_unit("km"), to = find_unit("mi");
+    if (from < 0 || to < 0 || strcmp(units[from].category, units[to].category) != 0) {
+        from = 0;
+        to = 1;
+    }
+    char from_type[48], to_type[48], dim_type[48];
+    cpp_type_name(units[from].name, from_type, sizeof(from_type));
+    cpp_type_name(units[to].name, to_type, sizeof(to_type));
+    cpp_type_name(units[from].category, dim_type, sizeof(dim_type));
+
+    fprintf(out,
+        "// Generated by `converter --emit-cpp`; build with\n"
+        "//   g++ -std=c++17 -O2 units_bench.cpp -o units_bench\n"
+        "#include \"units.hpp\"\n"
+        "\n"
+        "#include <algorithm>\n"
+        "#include <chrono>\n"
+        "#include <cstdio>\n"
+        "#include <vector>\n"
+        "\n"
+        "using namespace units;\n"
+        "using from_quantity = quantity<dim::%s, %s>;\n"
+        "\n"
+        "// Conversions are evaluated at compile time\n"
+        "static_assert(quantity_cast<%s>(from_quantity(1.0)).count() == %.17g / %.17g);\n"
+        "// Casting across dimensions does not compile, e.g.\n"
+        "//   quantity_cast<%s>(quantity<dim::%s, %s>(1.0));\n"
+        "\n"
+        "__attribute__((noinline)) void convert_typed(const double *in, double *out, size_t n) {\n"
+        "    for (size_t i = 0; i < n; i++) out[i] = quantity_cast<%s>(from_quantity(in[i])).count();\n"
+        "}\n"
+        "\n"
+        "__attribute__((noinline)) void convert_by_hand(const double *in, double *out, size_t n) {\n"
+        "    for (size_t i = 0; i < n; i++) out[i] = in[i] * (%.17g / %.17g);\n"
+        "}\n"
+        "\n"
+        "// Best of several timed rounds, in ns per value\n"
+        "template <class F>\n"
+        "static double time_ns(F convert, const std::vector<double> &in, std::vector<double> &out) {\n"
+        "    double best = 1e30;\n"
+        "    for (int round = 0; round < 50; round++) {\n"
+        "        auto start = std::chrono::steady_clock::now();\n"
+        "        convert(in.data(), out.data(), in.size());\n"
+        "        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;\n"
+        "        if (elapsed.count() < best) best = elapsed.count();\n"
+        "    }\n"
+        "    return best / double(in.size());\n"
+        "}\n"
+        "\n"
+        "int main() {\n"
+        "    std::vector<double> in(1 << 14), typed(in.size()), by_hand(in.size());\n"
+        "    for (size_t i = 0; i < in.size(); i++) in[i] = 0.5 + double(i) * 1.25;\n"
+        "\n"
+        "    // Alternate the two so clock ramp-up does not favour either\n"
+        "    double typed_ns = 1e30, by_hand_ns = 1e30;\n"
+        "    for (int pass = 0; pass < 5; pass++) {\n"
+        "        typed_ns = std::min(typed_ns, time_ns(convert_typed, in, typed));\n"
+        "        by_hand_ns = std::min(by_hand_ns, time_ns(convert_by_hand, in, by_hand));\n"
+        "    }\n"
+        "    bool same = typed == by_hand;\n"
+        "    std::printf(\"quantity_cast %%.3f ns/value, by hand %%.3f ns/value, results %%s\\n\",\n"
+        "                typed_ns, by_hand_ns, same ? \"identical\" : \"DIFFER\");\n"
+        "    return same ? 0 : 1;\n"
+        "}\n",
+        dim_type, from_type, to_type, units[from].factor, units[to].factor,
+        strcmp(dim_type, "mass") == 0 ? "meter" : "kilogram",
+        dim_type, from_type, to_type, units[from].factor, units[to].factor);
+    return !ferror(out);
+}
+
+// Write units.hpp and units_bench.cpp into `dir`
+int run_emit_cpp(const char *dir) {
+    char path[1024];
+    const char *names[] = {"units.hpp", "units_bench.cpp"};
+    bool (*emitters[])(FILE *) = {emit_cpp_header, emit_cpp_bench};
+
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error: cannot write '%s': %s\n", path, strerror(errno));
+            return 1;
+        }
+        bool ok = emitters[i](file);
+        if (fclose(file) != 0 || !ok) {
+            fprintf(stderr, "Error: writing '%s' failed\n", path);
+            return 1;
+        }
+        printf("Wrote %s\n", path);
+    }
+    return 0;
+}
+
+// One-shot conversion: converter VALUE FROM TO
+// Prints the result only; the history file is not touched
+static int run_one_shot(const char *input, const char *from, const char *to) {
+    ConversionPlan plan;
+    if (!plan_conversion(from, to, &plan)) {
+        fprintf(stderr, "Error: cannot convert from '%s' to '%s'\n", from, to);
+        return 1;
+    }
+
+    IntegerPlan integer_plan;
+    uint64_t integer_value;
+    char *endptr;
+    if (plan_integer(&plan, &integer_plan) && parse_u64(input, &integer_value, &endptr) &&
+        *endptr == '\0') {
+        unsigned __int128 quotient;
+        uint64_t remainder;
+        char buffer[128];
+        convert_integer(&integer_plan, integer_value, &quotient, &remainder);
+        format_integer_result(&integer_plan, quotient, remainder, ROUND_EXACT,
+                              buffer, sizeof(buffer));
+        metrics_count_pair(plan.from_index, plan.to_index, 1);
+        printf("%s\n", buffer);
+        return 0;
+    }
+
+    double value = strtod(input, &endptr);
+    if (endptr == input || *endptr != '\0') {
+        fprintf(stderr, "Error: invalid number '%s'\n", input);
+        return 1;
+    }
+    uint64_t trace_start = trace_begin();
+    double result = value * plan.scale + plan.offset;
+    trace_end(STAGE_CONVERT, trace_start);
+    metrics_count_pair(plan.from_index, plan.to_index, 1);
+    printf("%.15g\n", result);
+    return 0;
 }
 
-// Handle the conversion process for a given category
-// Supports unit prefixes and validates input
-void handle_conversion(const char *category) {
-    show_category_menu(category);
-    
-    char input[32], from_unit[16], to_unit[16];
-    double value;
-    int attempts = 0;
-    
-    // Get value and unit together
-    while (attempts < 3) {
-        printf("\nEnter value and unit: ");
-        if (fgets(input, sizeof(input), stdin)) {
-            input[strcspn(input, "\n")] = '\0';
-            
-            value = parse_value_with_prefix(input, from_unit);
-            normalize_unit_name(from_unit);
-            
-            if (unit_exists(from_unit, category)) {
-                break;
+// Handle non-interactive invocations
+// Returns the process exit status
+int run_command_line(int argc, char *argv[]) {
+    if (argc == 4 && strncmp(argv[1], "--", 2) != 0) {
+        return run_one_shot(argv[1], argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "--verify") == 0) {
+        uint64_t seed = (uint64_t)time(NULL);
+        long count = 200000;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                seed = strtoull(argv[++i], NULL, 10);
+            } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+                count = atol(argv[++i]);
+            } else {
+                fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+                return 2;
             }
-            print_error("Invalid unit! Please try again.");
         }
-        attempts++;
+        return run_verify(seed, count);
     }
-    
-    if (attempts >= 3) {
-        print_error("Too many failed attempts. Returning to menu.");
-        return;
+    if (strcmp(argv[1], "--bench") == 0) {
+        long count = 1000000;
+        if (argc > 3 && strcmp(argv[2], "--count") == 0) {
+            count = atol(argv[3]);
+        }
+        return run_bench(count);
     }
-    
-    // Get target unit
-    attempts = 0;
-    bool valid_unit = false;
-    while (!valid_unit && attempts < 3) {
-        printf("Convert to: ");
-        get_clean_input(to_unit, sizeof(to_unit));
-        
-        if (unit_exists(to_unit, category)) {
-            valid_unit = true;
-        } else {
-            print_error("Invalid unit! Please try again.");
-            attempts++;
+    if (strcmp(argv[1], "--history-stress") == 0 && argc > 2) {
+        long records = 10000;
+        if (argc > 4 && strcmp(argv[3], "--records") == 0) {
+            records = atol(argv[4]);
         }
+        return run_history_stress(atoi(argv[2]), records);
     }
-    
-    if (!valid_unit) {
-        print_error("Too many failed attempts. Returning to menu.");
-        return;
+    if (strcmp(argv[1], "--pack") == 0 || strcmp(argv[1], "--unpack") == 0) {
+        char delimiter = ',';
+        int spec_count = 0;
+        if (argc < 3) {
+            fprintf(stderr, "Error: %s takes a file\n", argv[1]);
+            return 2;
+        }
+        // Column specs stay in argv order; --delimiter C may come anywhere
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--delimiter") == 0 && i + 1 < argc) {
+                delimiter = argv[++i][0];
+            } else {
+                argv[3 + spec_count++] = argv[i];
+            }
+        }
+        return strcmp(argv[1], "--pack") == 0
+             ? run_pack(argv[2], spec_count, argv + 3, delimiter)
+             : run_unpack(argv[2], spec_count, argv + 3, delimiter);
     }
-    
-    // Perform conversion
-    double result = convert_value(value, from_unit, to_unit);
-    
-    // Format numbers for display
-    char value_str[32], result_str[32];
-    format_number(value, value_str, sizeof(value_str));
-    format_number(result, result_str, sizeof(result_str));
-    
-    // Display result
-    printf("\nResult: %s %s = %s %s\n\n", value_str, from_unit, result_str, to_unit);
-    
-    // Add to history
-    add_history_entry(from_unit, to_unit, value, result);
-    
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-// Batch conversion mode
-void batch_conversion() {
-    clear_screen();
-    print_header("Batch Conversion Mode");
-    
-    char from_unit[16], to_unit[16];
-    double values[100];
-    int value_count = 0;
-    
-    printf("Enter values to convert (one per line, empty line to finish):\n");
-    
-    char input[32];
-    while (value_count < 100) {
-        if (fgets(input, sizeof(input), stdin) == NULL) break;
-        input[strcspn(input, "\n")] = '\0';
-        
-        if (strlen(input) == 0) break;
-        
-        char *endptr;
-        double value = strtod(input, &endptr);
-        if (endptr == input || *endptr != '\0') {
-            print_error("Invalid number! Skipping...");
-            continue;
+    if (strcmp(argv[1], "--emit-hot-pairs") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Error: --emit-hot-pairs takes a file and FROM:TO pairs\n");
+            return 2;
         }
-        
-        values[value_count++] = value;
+        return run_emit_hot_pairs(argv[2], argc - 3, argv + 3);
     }
-    
-    if (value_count == 0) {
-        print_error("No values entered!");
-        return;
+    if (strcmp(argv[1], "--emit-cpp") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: --emit-cpp takes a directory\n");
+            return 2;
+        }
+        return run_emit_cpp(argv[2]);
     }
-    
-    // Get units
-    printf("\nConvert from: ");
-    get_clean_input(from_unit, sizeof(from_unit));
-    
-    printf("Convert to: ");
-    get_clean_input(to_unit, sizeof(to_unit));
-    
-    // Perform conversions
-    printf("\nResults:\n");
-    for (int i = 0; i < value_count; i++) {
-        double result = convert_value(values[i], from_unit, to_unit);
-        printf("%.8g %s = %.8g %s\n", values[i], from_unit, result, to_unit);
-        add_history_entry(from_unit, to_unit, values[i], result);
+    if (strcmp(argv[1], "--annotate") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        UnitSystem system;
+        if (strcmp(argv[2], "si") == 0) {
+            system = SYSTEM_SI;
+        } else if (strcmp(argv[2], "imperial") == 0) {
+            system = SYSTEM_IMPERIAL;
+        } else {
+            fprintf(stderr, "Error: unknown unit system '%s'\n", argv[2]);
+            return 2;
+        }
+        bool replace = false;
+        for (int i = 3; i < argc; i++) {
+            int stream_option = parse_stream_option(argc, argv, &i);
+            if (stream_option < 0) return 2;
+            if (stream_option > 0) continue;
+            if (strcmp(argv[i], "--replace") == 0) {
+                replace = true;
+            } else {
+                fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+                return 2;
+            }
+        }
+        return run_annotate(system, replace);
     }
-    
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-// Show main menu
-void show_main_menu() {
-    clear_screen();
-    print_header("Ultimate Unit Converter");
-    
-    printf("Select a category:\n\n");
-    
-    for (int i = 0; i < category_count; i++) {
-        printf("%2d. %s\n", i+1, categories[i]);
+    if (strcmp(argv[1], "--replay") == 0) {
+        const char *path = history_path;
+        double tolerance = 1e-6;
+        int threads = 1;
+#ifndef _WIN32
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+                tolerance = atof(argv[++i]);
+            } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--pin") == 0 && i + 1 < argc) {
+                if (!parse_pin_policy(argv[++i])) return 2;
+            } else if (argv[i][0] != '-') {
+                path = argv[i];
+            } else {
+                fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+                return 2;
+            }
+        }
+        return run_replay(path, tolerance, threads);
+    }
+    if (strcmp(argv[1], "--batch") != 0 || argc < 4) {
+        print_usage(argv[0]);
+        return 2;
     }
-    
-    printf("\n");
-    printf("%2d. History\n", category_count+1);
-    printf("%2d. Help\n", category_count+2);
-    printf("%2d. Quit\n\n", category_count+3);
-    
-    printf("Enter your choice: ");
-}
 
-// Add new function to show unit information
-void show_unit_info(const char *unit) {
-    for (int i = 0; i < unit_count; i++) {
-        if (strcmp(units[i].name, unit) == 0 || strcmp(units[i].symbol, unit) == 0) {
-            printf("\nUnit Information:\n");
-            printf("Name: %s\n", units[i].name);
-            printf("Symbol: %s\n", units[i].symbol);
-            printf("Category: %s\n", units[i].category);
-            printf("Description: %s\n", units[i].description);
-            if (units[i].alias_count > 0) {
-                printf("Aliases: ");
-                for (int j = 0; j < units[i].alias_count; j++) {
-                    printf("%s%s", units[i].aliases[j],
-                           j < units[i].alias_count-1 ? ", " : "");
-                }
-                printf("\n");
+    BatchOptions options = {0};
+    const char *where = NULL, *derive[MAX_DERIVED_COLUMNS];
+    int derive_count = 0;
+    bool stream_options = false;
+    const char *window_size = NULL, *window_slide = NULL;
+    static WindowState window;
+    options.rounding = ROUND_EXACT;
+    options.delimiter = ',';
+    options.number_format.decimal_sep = '.';
+    for (int i = 4; i < argc; i++) {
+        int stream_option = parse_stream_option(argc, argv, &i);
+        if (stream_option < 0) return 2;
+        if (stream_option > 0) {
+            stream_options = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--f32") == 0) {
+            options.use_f32 = true;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            options.binary = true;
+        } else if (strcmp(argv[i], "--decimal") == 0) {
+            options.decimal = true;
+        } else if (strcmp(argv[i], "--column") == 0 && i + 1 < argc) {
+            options.column = atoi(argv[++i]);
+            if (options.column < 1) {
+                fprintf(stderr, "Error: --column needs a field number from 1\n");
+                return 2;
             }
-            return;
+        } else if (strcmp(argv[i], "--delimiter") == 0 && i + 1 < argc) {
+            options.delimiter = argv[++i][0];
+        } else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc) {
+            where = argv[++i];
+        } else if (strcmp(argv[i], "--derive") == 0 && i + 1 < argc) {
+            if (derive_count == MAX_DERIVED_COLUMNS) {
+                fprintf(stderr, "Error: at most %d --derive expressions\n", MAX_DERIVED_COLUMNS);
+                return 2;
+            }
+            derive[derive_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window_size = argv[++i];
+        } else if (strcmp(argv[i], "--slide") == 0 && i + 1 < argc) {
+            window_slide = argv[++i];
+        } else if (strcmp(argv[i], "--time-column") == 0 && i + 1 < argc) {
+            window.time_column = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-column") == 0 && i + 1 < argc) {
+            window.group_column = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--decimal-sep") == 0 && i + 1 < argc) {
+            options.number_format.decimal_sep = argv[++i][0];
+        } else if (strcmp(argv[i], "--group-sep") == 0 && i + 1 < argc) {
+            const char *separator = argv[++i];
+            if (strcmp(separator, "none") == 0) options.number_format.group_sep = '\0';
+            else if (strcmp(separator, "space") == 0) options.number_format.group_sep = ' ';
+            else options.number_format.group_sep = separator[0];
+        } else if (strcmp(argv[i], "--round") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "exact") == 0) options.rounding = ROUND_EXACT;
+            else if (strcmp(mode, "down") == 0) options.rounding = ROUND_DOWN;
+            else if (strcmp(mode, "up") == 0) options.rounding = ROUND_UP;
+            else if (strcmp(mode, "nearest") == 0) options.rounding = ROUND_NEAREST;
+            else {
+                fprintf(stderr, "Error: unknown rounding mode '%s'\n", mode);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 2;
         }
     }
-    print_error("Unit not found");
-}
 
-// Add function to format numbers nicely
-void format_number(double num, char *buffer, size_t size) {
-    if (num == 0) {
-        snprintf(buffer, size, "0");
-        return;
+    if (window_size != NULL) {
+        bool slide_by_time = false;
+        if (!parse_window_size(window_size, &window.size, &window.by_time) ||
+            (window_slide && !parse_window_size(window_slide, &window.slide, &slide_by_time))) {
+            fprintf(stderr, "Error: window sizes are a count (100) or a duration "
+                            "(500ms, 30s, 1m, 2h)\n");
+            return 2;
+        }
+        if (window_slide == NULL) {
+            window.slide = window.size;
+            slide_by_time = window.by_time;
+        }
+        if (slide_by_time != window.by_time || window.slide > window.size) {
+            fprintf(stderr, "Error: --slide must be of the same kind as --window and "
+                            "not larger\n");
+            return 2;
+        }
+        if (window.by_time != (window.time_column > 0) || window.time_column < 0 ||
+            window.group_column < 0) {
+            fprintf(stderr, "Error: time windows need --time-column N, count windows "
+                            "must not have one\n");
+            return 2;
+        }
+        if (where != NULL || derive_count > 0) {
+            fprintf(stderr, "Error: --window cannot be combined with --where or --derive\n");
+            return 2;
+        }
+        options.window = &window;
+    } else if (window_slide || window.time_column || window.group_column) {
+        fprintf(stderr, "Error: --slide, --time-column and --group-column need --window\n");
+        return 2;
     }
 
-    // Count the number of digits
-    int digits = (int)ceil(log10(fabs(num) + 1));
-    
-    if (digits > 6) {
-        // Get the exponent
-        int exponent = (int)floor(log10(fabs(num)));
-        
-        // Calculate the mantissa
-        double mantissa = num / pow(10, exponent);
-        
-        // Format the number as x × 10^n
-        snprintf(buffer, size, "%.2f × 10^%d", mantissa, exponent);
-    } else {
-        // Use normal decimal format for smaller numbers
-        snprintf(buffer, size, "%.6g", num);
+    // Expressions and windows work on delimited fields; a plain stream
+    // is one field
+    if ((where != NULL || derive_count > 0 || options.window) && options.column == 0) {
+        options.column = 1;
     }
-}
 
-// Add function to show help
-void show_help() {
-    clear_screen();
-    print_header("Help");
-    
-    printf("Features:\n");
-    printf("1. Multiple unit categories\n");
-    printf("2. Quick conversion mode\n");
-    printf("3. Conversion history\n");
-    printf("4. Unit information display\n");
-    printf("5. Scientific notation for large/small numbers\n");
-    printf("6. Unit aliases support\n");
-    printf("7. Temperature conversion\n");
-    printf("8. Batch conversion mode\n");
-    
-    printf("\nTips:\n");
-    printf("- Use unit symbols (e.g., 'km' for kilometer)\n");
-    printf("- View unit info to learn more about each unit\n");
-    
-    printf("\nPress Enter to continue...");
-    getchar();
-}
+    const NumberFormat *format = &options.number_format;
+    bool localized = format->decimal_sep != '.' || format->group_sep != '\0';
+    if (format->decimal_sep == '\0' || format->decimal_sep == format->group_sep ||
+        isdigit((unsigned char)format->decimal_sep) || isdigit((unsigned char)format->group_sep)) {
+        fprintf(stderr, "Error: invalid decimal or group separator\n");
+        return 2;
+    }
+    if (localized && (options.binary || options.decimal)) {
+        fprintf(stderr, "Error: --decimal-sep and --group-sep cannot be combined with "
+                        "--binary or --decimal\n");
+        return 2;
+    }
+    if (options.column > 0 && (format->decimal_sep == options.delimiter ||
+                               format->group_sep == options.delimiter)) {
+        fprintf(stderr, "Error: the field delimiter cannot also be a number separator\n");
+        return 2;
+    }
 
-// Add function to export history to CSV
-void export_history_to_csv() {
-    FILE *file = fopen("conversion_history.csv", "w");
-    if (file == NULL) {
-        print_error("Could not create CSV file!");
-        return;
+    if (strcmp(argv[3], "auto") == 0) {
+        // Auto-scale: convert to the category base unit, then pick a
+        // display unit per value
+        int from_index = find_unit(argv[2]);
+        if (from_index < 0) {
+            fprintf(stderr, "Error: unknown unit '%s'\n", argv[2]);
+            return 1;
+        }
+        options.scale_table = get_scale_table(units[from_index].category);
+        if (options.scale_table == NULL || options.binary || options.decimal) {
+            fprintf(stderr, "Error: auto-scaling is not available for '%s'\n", argv[2]);
+            return 1;
+        }
+        options.plan = (ConversionPlan){ units[from_index].factor, 0.0, from_index, -1 };
+    } else if (plan_conversion(argv[2], argv[3], &options.plan)) {
+        options.has_integer_plan = plan_integer(&options.plan, &options.integer_plan);
+        if (options.decimal) {
+            plan_decimal(&options.plan, &options.decimal_plan);
+        }
+    } else {
+        fprintf(stderr, "Error: cannot convert from '%s' to '%s'\n", argv[2], argv[3]);
+        return 1;
     }
-    
-    // Write header
-    fprintf(file, "From,To,Value,Result,Timestamp\n");
-    
-    // Write data
-    for (int i = 0; i < history_count; i++) {
-        char time_str[32];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", 
-                localtime(&history[i].timestamp));
-        
-        fprintf(file, "%s,%s,%.8g,%.8g,%s\n",
-                history[i].from,
-                history[i].to,
-                history[i].value,
-                history[i].result,
-                time_str);
+
+    if (options.column > 0) {
+        if (options.scale_table || options.binary) {
+            fprintf(stderr, "Error: --column, --where, --derive and --window cannot be "
+                            "combined with auto or --binary\n");
+            return 2;
+        }
+        static ExprProgram program;
+        if (where != NULL || derive_count > 0) {
+            program.converted_column = options.column;
+            program.where_register = where ? compile_expression(&program, "--where", where) : -1;
+            if (where != NULL && program.where_register < 0) return 2;
+            for (int d = 0; d < derive_count; d++) {
+                int reg = compile_expression(&program, "--derive", derive[d]);
+                if (reg < 0) return 2;
+                program.derive_registers[program.derive_count++] = reg;
+            }
+            options.expressions = &program;
+        }
+        return run_batch_csv(&options);
     }
-    
-    fclose(file);
-    print_success("History exported to conversion_history.csv");
+    if (stream_options && options.binary) {
+        fprintf(stderr, "Error: --latency, --throughput, --deadline, --stats and --follow "
+                        "cannot be combined with --binary\n");
+        return 2;
+    }
+    return options.binary ? run_batch_binary(&options) : run_batch_text(&options);
+}
+
+// Print the time of each startup phase to stderr
+static void print_startup_profile(double start, double units_done, double ready,
+                                  const char *ready_label) {
+    fprintf(stderr, "Startup profile:\n");
+    fprintf(stderr, "  %-18s %9.3f ms\n", "initialize_units", (units_done - start) * 1e3);
+    fprintf(stderr, "  %-18s %9s\n", "load_history", history_loaded ? "loaded" : "deferred");
+    fprintf(stderr, "  %-18s %9.3f ms\n", ready_label, (ready - units_done) * 1e3);
+    fprintf(stderr, "  %-18s %9.3f ms\n", "total", (ready - start) * 1e3);
 }
 
 // Main function
 int main(int argc, char *argv[]) {
-    // Initialize the program
+    double start = now_seconds();
+    bool startup_profile = false;
+
+    // --startup-profile, --trace FILE, --metrics-file FILE,
+    // --metrics-socket PATH and --pin POLICY may come first in any mode
+    while (argc > 1) {
+        if (strcmp(argv[1], "--startup-profile") == 0) {
+            startup_profile = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+            if (!trace_open(argv[2])) {
+                fprintf(stderr, "Error: cannot enable tracing\n");
+                return 1;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--metrics-file") == 0 && argc > 2) {
+            if (!metrics_open_file(argv[2])) {
+                fprintf(stderr, "Error: cannot enable metrics\n");
+                return 1;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--metrics-socket") == 0 && argc > 2) {
+            if (!metrics_listen(argv[2])) return 1;
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--pin") == 0 && argc > 2) {
+            // Pin the main thread now, so the buffers of the single-threaded
+            // modes are first touched on its node
+            if (!parse_pin_policy(argv[2])) return 2;
+            pin_worker(0);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+
+    // Initialize the program; history is loaded on first use
     initialize_units();
-    load_history();
-    
+    double units_done = now_seconds();
+
+    if (argc > 1) {
+        int status = run_command_line(argc, argv);
+        if (startup_profile) {
+            print_startup_profile(start, units_done, now_seconds(), "command");
+        }
+        return status;
+    }
+
     // Main program loop
     while (1) {
         show_main_menu();
+        fflush(stdout);
+        if (startup_profile) {
+            print_startup_profile(start, units_done, now_seconds(), "first prompt");
+            startup_profile = false;
+        }
         
         char choice[16];
         fgets(choice, sizeof(choice), stdin);